@@ -0,0 +1,173 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: bitmatrix.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <cstring>
+
+#include "bitmatrix.h"
+
+// words counted together, 256 references
+static const unsigned int blockWords = 4;
+
+// enough counter bits for any number of query kmers
+static const unsigned int maxPlanes = 32;
+
+// the counting loop is also compiled for AVX2 where the compiler can pick
+// the version to run, so that the words of a block are added at once
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && __GNUC__ >= 6
+#define COUNT_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define COUNT_TARGETS
+#endif
+
+// add the block of words at offset in each row into the bit-sliced counters,
+// planes[p] holding bit p of the count for each reference. Each row is added
+// by rippling its bits up through the planes as carries
+COUNT_TARGETS
+static void countBlock(const uint64_t *const *rows, size_t numRows, uint64_t offset, uint64_t planes[][blockWords])
+{
+    for (size_t r=0; r<numRows; r++)
+    {
+        const uint64_t *row = rows[r] + offset;
+        uint64_t carry[blockWords];
+        uint64_t any = 0;
+        for (unsigned int i=0; i<blockWords; i++)
+        {
+            carry[i] = row[i];
+            any |= row[i];
+        }
+
+        for (unsigned int p=0; any; p++)
+        {
+            any = 0;
+            for (unsigned int i=0; i<blockWords; i++)
+            {
+                uint64_t next = planes[p][i] & carry[i];
+                planes[p][i] ^= carry[i];
+                carry[i] = next;
+                any |= next;
+            }
+        }
+    }
+}
+
+
+void BitMatrix::reset(uint64_t numSlots, unsigned int numSequences)
+{
+    numSlots_ = numSlots;
+    numSequences_ = numSequences;
+    words_ = (numSequences + 64 * blockWords - 1) / (64 * blockWords) * blockWords;
+    std::vector<uint64_t>(numSlots_ * words_, 0).swap(bits_);
+}
+
+unsigned int BitMatrix::count(kmerSize_t kmer) const
+{
+    unsigned int n = 0;
+    for (const uint64_t *it = &bits_[kmer * words_]; it != &bits_[kmer * words_] + words_; ++it)
+        n += __builtin_popcountll(*it);
+    return n;
+}
+
+void BitMatrix::search(const std::vector<kmerSize_t>& kmers, std::vector<unsigned int>& best, unsigned int& topScore, uint64_t *touched) const
+{
+    best.clear();
+    topScore = 0;
+    if (touched)
+        *touched = 0;
+    if (!numSequences_)
+        return;
+
+    unsigned int numPlanes = 1;
+    while (numPlanes < maxPlanes && (static_cast<uint64_t>(1) << numPlanes) <= kmers.size())
+        numPlanes++;
+
+    std::vector<const uint64_t *> rows(kmers.size());
+    for (size_t i=0; i<kmers.size(); i++)
+        rows[i] = &bits_[kmers[i] * words_];
+
+    uint64_t planes[maxPlanes][blockWords];
+    for (uint64_t w=0; w<words_; w+=blockWords)
+    {
+        memset(planes, 0, numPlanes * sizeof(planes[0]));
+        if (!rows.empty())
+            countBlock(&rows[0], rows.size(), w, planes);
+
+        // references past the last are never candidates
+        uint64_t candidates[blockWords];
+        for (unsigned int i=0; i<blockWords; i++)
+        {
+            uint64_t first = (w + i) * 64;
+            if (first + 64 <= numSequences_)
+                candidates[i] = ~static_cast<uint64_t>(0);
+            else if (first >= numSequences_)
+                candidates[i] = 0;
+            else
+                candidates[i] = (static_cast<uint64_t>(1) << (numSequences_ - first)) - 1;
+        }
+
+        if (touched)
+        {
+            for (unsigned int i=0; i<blockWords; i++)
+            {
+                uint64_t nonzero = 0;
+                for (unsigned int p=0; p<numPlanes; p++)
+                    nonzero |= planes[p][i];
+                *touched += __builtin_popcountll(nonzero & candidates[i]);
+            }
+        }
+
+        // the highest count in the block, narrowing the candidates down to the
+        // references having it one bit at a time from the top
+        unsigned int value = 0;
+        for (unsigned int p=numPlanes; p--; )
+        {
+            uint64_t narrowed[blockWords];
+            uint64_t any = 0;
+            for (unsigned int i=0; i<blockWords; i++)
+            {
+                narrowed[i] = candidates[i] & planes[p][i];
+                any |= narrowed[i];
+            }
+            if (any)
+            {
+                memcpy(candidates, narrowed, sizeof(candidates));
+                value |= 1u << p;
+            }
+        }
+
+        if (value < topScore)
+            continue;
+        if (value > topScore)
+        {
+            best.clear();
+            topScore = value;
+        }
+        for (unsigned int i=0; i<blockWords; i++)
+        {
+            for (uint64_t bits = candidates[i]; bits; bits &= bits - 1)
+                best.push_back((w + i) * 64 + __builtin_ctzll(bits));
+        }
+    }
+}
+
+uint64_t BitMatrix::bytes(uint64_t numSlots, uint64_t numSequences)
+{
+    uint64_t words = (numSequences + 64 * blockWords - 1) / (64 * blockWords) * blockWords;
+    return numSlots * words * sizeof(uint64_t);
+}
@@ -0,0 +1,78 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: bitmatrix.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __BITMATRIX_H__
+#define __BITMATRIX_H__
+
+#include <vector>
+#include <stdint.h>
+
+#include <boost/serialization/vector.hpp>
+
+#include "kmerizer.h"
+
+//======================================================================
+// BitMatrix class
+// the kmer index as a row of one bit per reference for each kmer. A
+// search adds up the rows of the query kmers in bit-sliced counters,
+// 256 references at a time, rather than walking postings lists, which
+// is faster once most kmers are held by a good share of the references
+//======================================================================
+class BitMatrix
+{
+private:
+    uint64_t numSlots_;
+    unsigned int numSequences_;
+    uint64_t words_;                // 64 bit words per row, whole blocks of references
+    std::vector<uint64_t> bits_;
+
+    friend class boost::serialization::access;
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+        ar & numSlots_;
+        ar & numSequences_;
+        ar & words_;
+        ar & bits_;
+    }
+
+public:
+    BitMatrix() : numSlots_(0), numSequences_(0), words_(0) {}
+
+    // an empty matrix, references are then added with set()
+    void reset(uint64_t numSlots, unsigned int numSequences);
+    void set(kmerSize_t kmer, unsigned int id) { bits_[kmer * words_ + id / 64] |= static_cast<uint64_t>(1) << (id % 64); }
+
+    // references holding kmer
+    unsigned int count(kmerSize_t kmer) const;
+
+    // the references sharing the most kmers with the query, in ascending order,
+    // and how many they share. Also counts the references sharing any if touched is given
+    void search(const std::vector<kmerSize_t>& kmers, std::vector<unsigned int>& best, unsigned int& topScore, uint64_t *touched = NULL) const;
+
+    unsigned int numSequences() const { return numSequences_; }
+    uint64_t numSlots() const { return numSlots_; }
+
+    // memory for a matrix of this size, and in use
+    static uint64_t bytes(uint64_t numSlots, uint64_t numSequences);
+    uint64_t memoryUsage() const { return bits_.capacity() * sizeof(uint64_t); }
+};
+
+#endif /* __BITMATRIX_H__ */
@@ -0,0 +1,311 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: cache.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "kmerizer.h"
+
+// results waiting to be appended before they are written out together
+static const size_t flushBytes = 1 << 20;
+
+// no result comes near this, so a larger size means the record is damaged
+static const uint32_t maxResultBytes = 1 << 20;
+
+static const size_t recordHeaderBytes = 3 * sizeof(uint64_t) + sizeof(uint32_t);
+
+template <typename T>
+static void put(std::string& out, const T& value)
+{
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool get(const char *&in, const char *end, T& value)
+{
+    if (static_cast<size_t>(end - in) < sizeof(value))
+        return false;
+    memcpy(&value, in, sizeof(value));
+    in += sizeof(value);
+    return true;
+}
+
+static void packRecord(const CacheKey& key, const Classification& result, std::string& out)
+{
+    std::string packed;
+    put(packed, result.score);
+    put(packed, static_cast<uint32_t>(result.annotationIds.size()));
+    for (std::vector<std::vector<unsigned int> >::const_iterator it=result.annotationIds.begin(); it!=result.annotationIds.end(); ++it)
+    {
+        put(packed, static_cast<uint32_t>(it->size()));
+        for (std::vector<unsigned int>::const_iterator id=it->begin(); id!=it->end(); ++id)
+            put(packed, static_cast<uint32_t>(*id));
+    }
+    put(packed, static_cast<uint32_t>(result.bootstraps.size()));
+    for (std::vector<float>::const_iterator it=result.bootstraps.begin(); it!=result.bootstraps.end(); ++it)
+        put(packed, *it);
+
+    put(out, key.settings);
+    put(out, key.sequence[0]);
+    put(out, key.sequence[1]);
+    put(out, static_cast<uint32_t>(packed.size()));
+    out += packed;
+}
+
+// false if the result does not fill exactly [in, end)
+static bool unpackResult(const char *in, const char *end, Classification& result)
+{
+    uint32_t numLevels, count;
+    if (!get(in, end, result.score) || !get(in, end, numLevels) || numLevels > static_cast<size_t>(end - in) / sizeof(uint32_t))
+        return false;
+    result.annotationIds.assign(numLevels, std::vector<unsigned int>());
+    for (uint32_t level=0; level<numLevels; level++)
+    {
+        if (!get(in, end, count) || count > static_cast<size_t>(end - in) / sizeof(uint32_t))
+            return false;
+        result.annotationIds[level].resize(count);
+        for (uint32_t i=0; i<count; i++)
+        {
+            uint32_t id = 0;
+            get(in, end, id);
+            result.annotationIds[level][i] = id;
+        }
+    }
+    if (!get(in, end, count) || count != static_cast<size_t>(end - in) / sizeof(float))
+        return false;
+    result.bootstraps.resize(count);
+    for (uint32_t i=0; i<count; i++)
+        get(in, end, result.bootstraps[i]);
+    return in == end;
+}
+
+
+ResultCache::ResultCache(const std::string& fileName, const std::string& settings, unsigned int minQuality) :
+    fileName_(fileName), settings_(hashBytes(settings.data(), settings.size(), 0)), minQuality_(minQuality), fd_(-1),
+    numLoaded_(0), numAdded_(0), numHits_(0), numMisses_(0), validBytes_(0), loadedBytes_(0), failed_(false)
+{
+    fd_ = open(fileName_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0)
+        throw std::runtime_error("Could not open result cache " + fileName_);
+    try {
+        load();
+    }
+    catch (...) {
+        close(fd_);
+        throw;
+    }
+}
+
+ResultCache::~ResultCache()
+{
+    flush();
+    close(fd_);
+}
+
+// read the records of this run's settings, stopping at any damaged by a run
+// which failed while appending
+void ResultCache::load()
+{
+    flock(fd_, LOCK_SH);
+    struct stat st;
+    fstat(fd_, &st);
+    loadedBytes_ = st.st_size;
+
+    std::ifstream file(fileName_.c_str(), std::ios::binary);
+    uint32_t header[2] = {0, 0};
+    if (loadedBytes_ && !file.read(reinterpret_cast<char *>(header), sizeof(header)))
+        header[0] = 0;
+    if (loadedBytes_ && (header[0] != CACHE_FILE_MAGIC || header[1] != CACHE_FILE_VERSION))
+    {
+        flock(fd_, LOCK_UN);
+        std::ostringstream msg;
+        msg << fileName_ << (header[0] == CACHE_FILE_MAGIC ? " is a result cache of another version" : " is not a result cache");
+        throw std::runtime_error(msg.str());
+    }
+    validBytes_ = loadedBytes_ ? sizeof(header) : 0;
+
+    std::vector<char> record(recordHeaderBytes);
+    std::vector<char> packed;
+    while (validBytes_ < loadedBytes_ && file.read(&record[0], recordHeaderBytes))
+    {
+        CacheKey key;
+        uint32_t bytes;
+        const char *in = &record[0], *end = in + recordHeaderBytes;
+        get(in, end, key.settings);
+        get(in, end, key.sequence[0]);
+        get(in, end, key.sequence[1]);
+        get(in, end, bytes);
+        if (bytes > maxResultBytes)
+            break;
+
+        packed.resize(bytes);
+        if (bytes && !file.read(&packed[0], bytes))
+            break;
+        if (key.settings == settings_)
+        {
+            Classification result;
+            if (!unpackResult(packed.empty() ? NULL : &packed[0], packed.empty() ? NULL : &packed[0] + bytes, result))
+                break;
+            if (results_.insert(std::make_pair(key, result)).second)
+                numLoaded_++;
+        }
+        validBytes_ += recordHeaderBytes + bytes;
+    }
+    flock(fd_, LOCK_UN);
+
+    if (validBytes_ < loadedBytes_)
+        std::cerr << "\nWarning: the result cache " << fileName_ << " is damaged after " << numLoaded_ << " results" << std::endl;
+}
+
+CacheKey ResultCache::key(const DnaSequence& read, const DnaSequence *mate, unsigned long seed) const
+{
+    CacheKey key;
+    key.settings = settings_;
+    uint64_t seed64 = seed;
+    for (unsigned int i=0; i<2; i++)
+    {
+        key.sequence[i] = hashRead(read, i + 1);
+        if (mate)
+            key.sequence[i] = hashRead(*mate, key.sequence[i]);
+        key.sequence[i] = hashBytes(&seed64, sizeof(seed64), key.sequence[i]);
+    }
+    return key;
+}
+
+// the bases of a read, and which of them are masked
+uint64_t ResultCache::hashRead(const DnaSequence& read, uint64_t seed) const
+{
+    uint64_t hash = hashBytes(read.sequence.data(), read.sequence.size(), seed);
+    if (minQuality_ && !read.quality.empty())
+    {
+        std::string masked(read.quality.size(), 0);
+        for (size_t i=0; i<read.quality.size(); i++)
+            masked[i] = Kmerizer::lowQuality(read.quality[i], minQuality_);
+        hash = hashBytes(masked.data(), masked.size(), hash);
+    }
+    return hash;
+}
+
+bool ResultCache::find(const CacheKey& key, Classification& result) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    std::map<CacheKey, Classification>::const_iterator it = results_.find(key);
+    if (it == results_.end())
+        return false;
+    result = it->second;
+    return true;
+}
+
+void ResultCache::insert(const CacheKey& key, const Classification& result)
+{
+    std::string records;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex_);
+        if (!results_.insert(std::make_pair(key, result)).second)
+            return;
+        packRecord(key, result, pending_);
+        numAdded_++;
+        if (pending_.size() < flushBytes)
+            return;
+        records.swap(pending_);
+    }
+    append(records);
+}
+
+void ResultCache::count(uint64_t hits, uint64_t misses)
+{
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    numHits_ += hits;
+    numMisses_ += misses;
+}
+
+void ResultCache::flush()
+{
+    std::string records;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex_);
+        records.swap(pending_);
+    }
+    append(records);
+}
+
+// whole records are appended while the file is locked, after the header if it is
+// new. A damaged end found when loading is cut off first, unless another run has
+// appended since
+void ResultCache::append(const std::string& records)
+{
+    boost::mutex::scoped_lock lock(fileMutex_);
+    if (records.empty() || failed_)
+        return;
+
+    std::string out;
+    flock(fd_, LOCK_EX);
+    struct stat st;
+    bool ok = fstat(fd_, &st) == 0;
+    if (ok && st.st_size == 0)
+    {
+        put(out, CACHE_FILE_MAGIC);
+        put(out, CACHE_FILE_VERSION);
+    }
+    else if (ok && validBytes_ < loadedBytes_ && static_cast<uint64_t>(st.st_size) == loadedBytes_)
+    {
+        ok = ftruncate(fd_, validBytes_) == 0;
+    }
+    validBytes_ = loadedBytes_;
+    out += records;
+
+    for (size_t written=0; ok && written<out.size(); )
+    {
+        ssize_t n = write(fd_, out.data() + written, out.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0;
+        written += ok ? n : 0;
+    }
+    flock(fd_, LOCK_UN);
+
+    if (!ok)
+    {
+        std::cerr << "\nWarning: could not write to the result cache " << fileName_ << ", results are no longer added" << std::endl;
+        failed_ = true;
+    }
+}
+
+std::string ResultCache::report() const
+{
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    std::ostringstream s;
+    s << fileName_ << ": " << numHits_ << " hits, " << numMisses_ << " misses, ";
+    s << numAdded_ << " results added to the " << numLoaded_ << " loaded";
+    return s.str();
+}
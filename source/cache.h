@@ -0,0 +1,133 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: cache.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+#include "classifier.h"
+
+/* Result cache file
+ *
+ * a header, then records appended by one run after another:
+ *
+ *   uint32 magic, uint32 version
+ *   record: uint64 settings    hash of the index fingerprint and the options results depend on
+ *           uint64 sequence[2] the read, its mate, its masked bases and its bootstrap seed,
+ *                              hashed with two seeds
+ *           uint32 bytes       of the result which follows
+ *           float score, uint32 levels, then per level uint32 count and the annotation ids,
+ *           then uint32 count and the bootstrap support of each level
+ *
+ * in native byte order, as for index files. Runs with different settings
+ * share a file, each loading only the records with its own
+ */
+
+static const uint32_t CACHE_FILE_MAGIC = 0x53504743;
+static const uint32_t CACHE_FILE_VERSION = 1;
+
+//======================================================================
+// CacheKey struct
+// what a cached result was classified from
+//======================================================================
+struct CacheKey
+{
+    uint64_t settings;
+    uint64_t sequence[2];
+
+    bool operator<(const CacheKey& other) const
+    {
+        if (settings != other.settings)
+            return settings < other.settings;
+        if (sequence[0] != other.sequence[0])
+            return sequence[0] < other.sequence[0];
+        return sequence[1] < other.sequence[1];
+    }
+};
+
+//======================================================================
+// ResultCache class
+// Results of earlier runs, loaded from a file shared by any number of
+// runs. Looked up by many threads at once, while the results of
+// sequences not found are appended to the file as they are added.
+// The file is locked while it is read or appended to, so that runs
+// sharing it only ever see whole records
+//======================================================================
+class ResultCache
+{
+private:
+    std::string fileName_;
+    uint64_t settings_;
+    unsigned int minQuality_;
+    int fd_;
+
+    mutable boost::shared_mutex mutex_;     // guards the fields below
+    std::map<CacheKey, Classification> results_;
+    std::string pending_;                   // records not yet appended
+    uint64_t numLoaded_;
+    uint64_t numAdded_;
+    uint64_t numHits_;
+    uint64_t numMisses_;
+
+    boost::mutex fileMutex_;                // one thread appends at a time
+    uint64_t validBytes_;                   // end of the last whole record when loaded
+    uint64_t loadedBytes_;                  // and the size of the file
+    bool failed_;                           // appending failed, so no more are tried
+
+    void load();
+    void append(const std::string& records);
+    uint64_t hashRead(const DnaSequence& read, uint64_t seed) const;
+
+public:
+    // opens or creates fileName, loading the results classified with settings,
+    // a description of everything results depend on. Throws if it cannot be
+    // opened or is not a result cache
+    ResultCache(const std::string& fileName, const std::string& settings, unsigned int minQuality);
+    ~ResultCache();
+
+    // key of a read, with its mate or NULL, and the seed of its bootstrap. A read
+    // found at another position of the input has a different seed and so
+    // another result, unless there is no bootstrap and seed is always 0
+    CacheKey key(const DnaSequence& read, const DnaSequence *mate, unsigned long seed) const;
+
+    // false if the result of key is not known yet
+    bool find(const CacheKey& key, Classification& result) const;
+
+    // add the result of a sequence not found, unless another thread has already
+    void insert(const CacheKey& key, const Classification& result);
+
+    // count lookups, once per batch of reads
+    void count(uint64_t hits, uint64_t misses);
+
+    // append the results not yet in the file
+    void flush();
+
+    // hits, misses and results added, for the report at the end of a run
+    std::string report() const;
+};
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,121 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: checkpoint.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+bool syncFile(const std::string& fileName)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+void Checkpoint::write(const std::string& fileName) const
+{
+    std::string tempName = fileName + ".tmp";
+    std::ofstream file(tempName.c_str());
+    file << "version=" << CHECKPOINT_VERSION << "\n";
+    file << "settings=" << settings << "\n";
+    file << "samples=" << numSamples << "\n";
+    file << "sample=" << sample << "\n";
+    file << "input=" << inputFilename << "\n";
+    file << "offset=" << offset << "\n";
+    file << "mateoffset=" << mateOffset << "\n";
+    file << "records=" << numRead << "\n";
+    file << "output=" << outputBytes << "\n";
+    if (hasSummary)
+    {
+        file << "summary\n";
+        summary.save(file);
+    }
+    file.close();
+
+    if (file.fail() || !syncFile(tempName) || rename(tempName.c_str(), fileName.c_str()) != 0)
+    {
+        throw std::runtime_error("Could not write checkpoint " + fileName);
+    }
+}
+
+bool Checkpoint::read(const std::string& fileName)
+{
+    std::ifstream file(fileName.c_str());
+    if (!file.is_open())
+        return false;
+
+    std::string line;
+    int version = 0;
+    bool valid = true;
+    while (valid && std::getline(file, line))
+    {
+        if (line == "summary")
+        {
+            hasSummary = true;
+            valid = summary.load(file);
+            break;
+        }
+
+        size_t equals = line.find('=');
+        if (equals == std::string::npos)
+        {
+            valid = false;
+            break;
+        }
+        std::string key = line.substr(0, equals);
+        std::istringstream value(line.substr(equals + 1));
+        if (key == "version")
+            value >> version;
+        else if (key == "settings")
+            settings = value.str();
+        else if (key == "samples")
+            value >> numSamples;
+        else if (key == "sample")
+            value >> sample;
+        else if (key == "input")
+            inputFilename = value.str();
+        else if (key == "offset")
+            value >> offset;
+        else if (key == "mateoffset")
+            value >> mateOffset;
+        else if (key == "records")
+            value >> numRead;
+        else if (key == "output")
+            value >> outputBytes;
+        valid = !value.fail();
+    }
+
+    if (!valid || version != CHECKPOINT_VERSION || sample > numSamples)
+    {
+        throw std::runtime_error(fileName + " is not a checkpoint of this version of spingo");
+    }
+    return true;
+}
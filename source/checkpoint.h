@@ -0,0 +1,81 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: checkpoint.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <string>
+#include <stdint.h>
+
+#include "summary.h"
+
+/* Checkpoint file
+ *
+ * key=value lines describing how far a run has got, then the summary
+ * table of the sample in progress if there is one:
+ *
+ *   version=1
+ *   settings=...       options the results depend on
+ *   samples=N          samples in the run
+ *   sample=I           samples before this one are finished
+ *   input=PATH         input file of sample I
+ *   offset=BYTES       where the next read of the input starts
+ *   mateoffset=BYTES   and of the second mates, 0 unless they have their own file
+ *   records=N          reads or pairs written
+ *   output=BYTES       bytes of results written
+ *   summary            the table follows, see AbundanceTable::save
+ */
+
+static const int CHECKPOINT_VERSION = 1;
+
+//======================================================================
+// Checkpoint struct
+// How far a run has got. Taken while no batches are in flight, so that
+// every read before offset has been written, and output bytes of the
+// results are on disk
+//======================================================================
+struct Checkpoint
+{
+    std::string settings;
+    uint64_t numSamples;
+    uint64_t sample;
+    std::string inputFilename;
+    uint64_t offset;
+    uint64_t mateOffset;
+    uint64_t numRead;
+    uint64_t outputBytes;
+    bool hasSummary;
+    AbundanceTable summary;
+
+    Checkpoint() : numSamples(0), sample(0), offset(0), mateOffset(0), numRead(0), outputBytes(0), hasSummary(false) {}
+
+    // written to fileName.tmp, synced and renamed over fileName, so that a
+    // checkpoint is never left half written
+    void write(const std::string& fileName) const;
+
+    // false if there is no checkpoint file. Exits if it cannot be read
+    bool read(const std::string& fileName);
+};
+
+// flush a file written by another stream to disk, false on failure
+bool syncFile(const std::string& fileName);
+
+#endif /* __CHECKPOINT_H__ */
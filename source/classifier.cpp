@@ -18,8 +18,105 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 =============================================================================*/
 
+#include <cmath>
+#include <cstdio>
 #include <iostream>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "classifier.h"
+#include "cache.h"
+#include "results.h"
+#include "format.h"
+
+// number of reads between each worker publishing its profiling counters
+static const uint64_t statsPublishInterval = 256;
+
+// reads classified as one task, enough to keep the locks quiet while
+// leaving many tasks to share out between the threads
+static const size_t readBatchSize = 32;
+
+// batches read ahead of the output for each thread, classified or waiting on
+// earlier batches to be written. Around inFlightPerThread of memory
+static const unsigned int batchesPerThread = 4;
+
+// seeds the choice of reads for calibration
+static const unsigned int calibrationSeed = 5489;
+
+
+//======================================================================
+// Sample struct
+// an input being classified and where its results go. Opened when it is
+// first read from, closed once its last batch is written
+//======================================================================
+struct Sample
+{
+    SampleFiles files;
+    boost::scoped_ptr<FastaReader> reader;  // single reads
+    boost::scoped_ptr<PairReader> pairs;    // or read pairs
+    boost::scoped_ptr<std::ofstream> file;  // output file, unless writing to stdout
+    std::ostream *output;
+    AbundanceTable summary;
+
+    // the fields below are guarded by outputMutex
+    boost::mutex outputMutex;
+    uint64_t numBatches;                    // batches read
+    uint64_t nextBatch;                     // the next batch to write
+    std::map<uint64_t, boost::shared_ptr<ReadBatch> > ready;   // classified, waiting on earlier batches
+    bool writing;                           // a thread is writing batches out
+    bool exhausted;                         // all sequences have been read
+    bool finished;                          // finishSample has been called
+
+    Sample() : output(NULL), numBatches(0), nextBatch(0), writing(false), exhausted(false), finished(false) {}
+
+    bool opened() const { return reader || pairs; }
+    long numRead() const { return reader ? reader->numRead() : pairs->numRead(); }
+    const char *unit() const { return pairs ? " pairs" : " sequences"; }
+
+    // true once, when the last batch has been read and written
+    bool finish()
+    {
+        if (finished || !exhausted || nextBatch != numBatches)
+            return false;
+        finished = true;
+        return true;
+    }
+};
+
+//======================================================================
+// ReadBatch struct
+// reads taken from a sample together, classified as one task and
+// written out in the order they were read
+//======================================================================
+struct ReadBatch
+{
+    Sample *sample;
+    uint64_t index;                         // position among the batches of the sample
+    std::vector<DnaSequence> reads;
+    std::vector<DnaSequence> mates;         // second mate of each read, empty for single reads
+    std::vector<Classification> results;
+    std::string output;
+
+    ReadBatch() : sample(NULL), index(0) {}
+};
+
+//======================================================================
+// WorkerState struct
+// profiling counters of a worker thread, set up by the thread itself
+// the first time it runs a task, since the hardware counters follow it
+//======================================================================
+struct WorkerState
+{
+    ThreadStats stats;
+    PerfCounters perf;
+    unsigned int statsSlot;
+    uint64_t readStart;                     // end of the previous read
+
+    WorkerState(StatsCollector& collector) : perf(collector.usePerf()), statsSlot(collector.addThread()), readStart(statsNow()) {}
+};
 
 // construct the classifier
 Classifier::Classifier(const ClassifierOptions &options )
@@ -30,134 +127,830 @@ Classifier::Classifier(const ClassifierOptions &options )
     subsampleSize_ = options.subsample;
     kmerizer_.setKmerSize(kmerSize_);
     outputAmbiguous_ = options.dumpAmbiguous;
+    writeReads_ = options.writeReads;
+    binaryOutput_ = options.binaryOutput;
+    binaryFlags_ = (options.binaryNames ? RESULTS_NAMES : 0) | (options.dumpAmbiguous ? RESULTS_AMBIGUOUS : 0);
+    summary_ = options.summary;
+    mateFilename_ = options.mateFilename;
+    interleaved_ = options.interleaved;
+    minQuality_ = options.minQuality;
+    checkpointFilename_ = options.checkpointFilename;
+    checkpointInterval_ = static_cast<uint64_t>(options.checkpointInterval * 1e9);
+    resume_ = options.resume;
+    resuming_ = false;
+    pinThreads_ = options.pinThreads;
+    seedBySequence_ = options.seedBySequence;
     
-    std::stringstream s;
-    s << options.dbFilename << ".idx_" << kmerSize_;
-    try {
-        // load cached index
-        std::ifstream ifs(s.str().c_str());
-        boost::archive::binary_iarchive ia(ifs);
+    if (!options.statsFilename.empty())
+        stats_.reset(new StatsCollector(options.statsFilename, options.statsInterval, options.statsPerf));
+
+    // everything the results depend on, so that a run is only resumed with the same settings
+    std::ostringstream settings;
+    settings << "database=" << options.dbFilename << " kmersize=" << kmerSize_ << " bootstrap=" << numBootstrap_;
+    settings << " subsample=" << subsampleSize_ << " minquality=" << minQuality_ << " mates=" << mateFilename_;
+    settings << " interleaved=" << interleaved_ << " ambiguous=" << outputAmbiguous_ << " reads=" << writeReads_;
+    settings << " binary=" << (binaryOutput_ ? binaryFlags_ + 1 : 0) << " summary=" << !summary_.fileName.empty();
+    settings << " common=" << options.approximate.commonKmers << " sample=" << options.approximate.sampleKmers;
+    if (seedBySequence_)
+        settings << " seed=sequence";
+    settings_ = settings.str();
+
+    uint64_t loadStart = statsNow();
+
+    if (options.shardSockets.empty())
+    {
+        loadReferences(options);
+    }
+    else
+    {
         ScopedTimer tim;
-        std::cerr << "Loading cached index from " << s.str();
-        ia >> referenceData_;
+        std::cerr << "Connecting to " << options.shardSockets.size() << " shard servers";
+        referenceData_.connectShards(options.dbFilename, kmerSize_, options.shardSockets);
+        std::cerr << " done, " << referenceData_.numSequences() << " reference sequences. ";
+    }
+    
+    referenceData_.setPruning(!options.exhaustive);
+    if (options.hierarchical)
+    {
+        // the level above species, the last in the database
+        unsigned int level = referenceData_.numLevels() > 1 ? referenceData_.numLevels() - 2 : 0;
+        ScopedTimer tim;
+        std::cerr << "Grouping references";
+        if (unsigned int groups = referenceData_.buildGroups(level))
+            std::cerr << " done, " << groups << " groups. ";
+        else
+            std::cerr << " skipped, the index has segments or is sharded. ";
+    }
+    if (options.shardSockets.empty())
+        loadSignatures(options);
+    referenceData_.setApproximate(options.approximate);
+
+    if (!options.cacheFilename.empty() && !options.shardSockets.empty())
+    {
+        throw std::invalid_argument("a result cache cannot be used with shards, whose index is not held here");
+    }
+    if (!options.cacheFilename.empty())
+    {
+        // everything a result depends on, so that runs with other settings or another index share the file safely
+        std::ostringstream cacheSettings;
+        cacheSettings << "index=" << referenceData_.fingerprint() << " kmersize=" << kmerSize_ << " bootstrap=" << numBootstrap_;
+        cacheSettings << " subsample=" << subsampleSize_ << " minquality=" << minQuality_;
+        if (options.approximate.enabled())
+            cacheSettings << " common=" << options.approximate.commonKmers << " sample=" << options.approximate.sampleKmers;
+        if (seedBySequence_ && numBootstrap_)
+            cacheSettings << " seed=sequence";
+
+        ScopedTimer tim;
+        std::cerr << "Loading result cache " << options.cacheFilename;
+        cache_.reset(new ResultCache(options.cacheFilename, cacheSettings.str(), minQuality_));
         std::cerr << " done. ";
     }
-    catch (boost::archive::archive_exception &) {
-        // create index from raw sequences
-        referenceData_.load(options.dbFilename, kmerizer_, numThreads_);
+
+    // with shards the search buffers are held by the shard servers
+    numRefSeqs_ = options.shardSockets.empty() ? referenceData_.numSequences() : 0;
+
+    if (summary_.level > static_cast<int>(referenceData_.numLevels()))
+    {
+        std::ostringstream msg;
+        msg << "summary level " << summary_.level << " requested but the database has " << referenceData_.numLevels() << " levels";
+        throw std::invalid_argument(msg.str());
+    }
+    std::cerr << "Memory: " << memoryUsage() << std::endl;
+
+    if (stats_)
+    {
+        stats_->setLoadSeconds((statsNow() - loadStart) / 1e9);
+        stats_->setMemory(memoryUsage());
+    }
+}
+
+
+// load the cached index, or build it from the fasta database
+void Classifier::loadReferences(const ClassifierOptions& options)
+{
+    std::stringstream s;
+    s << options.dbFilename << ".idx_" << kmerSize_;
+
+    IndexSummary summary;
+    bool cached = Database::readSummary(s.str(), summary);
+    if (cached)
+        Database::addSegmentSummaries(s.str(), summary);
+
+    // check the expected memory use against the budget before allocating anything,
+    // and whether so few kmers occur that the sparse layout is better whatever it is
+    IndexLayout layout = INDEX_DENSE;
+    if (options.maxMemory > 0 || cached || Database::sparseCandidate(kmerSize_))
+    {
+        if (!cached)
+            summary = Database::scanReferences(options.dbFilename).estimate(kmerSize_);
+
+        uint64_t threadBytes = numThreads_ * (summary.numSequences * sizeof(unsigned int) + threadScratchOverhead + inFlightPerThread);
+        layout = Database::chooseLayout(summary, options.maxMemory, threadBytes, !cached);
+        // a compact index file is loaded as it is, whether or not the budget needs it
+        bool overBudget = layout == INDEX_COMPACT;
+        if (cached && summary.layout == INDEX_COMPACT && layout == INDEX_DENSE)
+            layout = INDEX_COMPACT;
+
+        if (layout == INDEX_NONE)
+        {
+            IndexLayout smallest = Database::preferSparse(summary) ? INDEX_SPARSE : INDEX_COMPACT;
+            uint64_t indexBytes = cached ? summary.indexBytes(smallest) : summary.buildBytes(smallest);
+            std::ostringstream msg;
+            msg << "kmer size " << kmerSize_ << " needs an estimated " << formatMemorySize(indexBytes + summary.annotationTableBytes() + threadBytes);
+            msg << " which exceeds the memory limit of " << formatMemorySize(options.maxMemory);
+            throw std::runtime_error(msg.str());
+        }
+        if (overBudget)
+            std::cerr << "Using compact index to stay within " << formatMemorySize(options.maxMemory) << std::endl;
+        if (layout == INDEX_SPARSE && (!cached || summary.layout != INDEX_SPARSE))
+            std::cerr << "Using sparse index, as most kmers of size " << kmerSize_ << " do not occur" << std::endl;
+    }
+
+    if (cached)
+    {
+        try {
+            // load cached index
+            ScopedTimer tim;
+            std::cerr << "Loading cached index from " << s.str();
+            referenceData_.loadIndex(s.str(), layout);
+            if (unsigned int segments = referenceData_.loadSegments(s.str(), layout))
+                std::cerr << " and " << segments << " segment" << (segments > 1 ? "s" : "");
+            std::cerr << " done. ";
+        }
+        catch (boost::archive::archive_exception &) {
+            std::cerr << " failed. ";
+            cached = false;
+        }
+    }
+
+    if (!cached)
+    {
+        // create index from raw sequences, the threads stopping once it is built
+        TaskScheduler loader(numThreads_, pinThreads_);
+        referenceData_.load(options.dbFilename, kmerizer_, loader, layout);
         
         // save index for future use
         if (options.saveIndex)
         {
-            std::ofstream ofs(s.str().c_str());
-            boost::archive::binary_oarchive oa(ofs);
             ScopedTimer tim;
             std::cerr << "Writing cached index to " << s.str();
-            save_to(oa, referenceData_);
+            referenceData_.saveIndex(s.str());
             std::cerr << " done. ";
         }
     }
-    
-    numRefSeqs_ = referenceData_.numSequences();
 }
 
-// perform classification in separate threads
-void Classifier::runThread(FastaReader &reader)
+
+// set up the bit matrix engine when asked for, or for auto when the index is
+// dense enough and the matrix fits in the memory budget
+void Classifier::loadSignatures(const ClassifierOptions& options)
 {
-    DnaSequence seq;
-    boost::mt19937 randGen(0);
+    if (options.engine == ENGINE_POSTINGS || options.hierarchical)
+        return;
+
+    IndexSummary summary = referenceData_.summary();
+    if (referenceData_.numSegments())
+    {
+        if (options.engine == ENGINE_BITMATRIX)
+            std::cerr << "Warning: the index has segments, searching the postings lists instead of a bit matrix" << std::endl;
+        return;
+    }
+    if (options.engine == ENGINE_AUTO && !Database::preferSignatures(summary))
+        return;
+
+    if (options.maxMemory > 0)
+    {
+        uint64_t needed = referenceData_.memoryUsage().total() + Database::signatureBytes(summary) +
+                          numThreads_ * (summary.numSequences * sizeof(unsigned int) + threadScratchOverhead + inFlightPerThread);
+        if (needed > options.maxMemory)
+        {
+            if (options.engine == ENGINE_AUTO)
+                return;
+            std::ostringstream msg;
+            msg << "the bit matrix needs an estimated " << formatMemorySize(needed);
+            msg << " which exceeds the memory limit of " << formatMemorySize(options.maxMemory);
+            throw std::runtime_error(msg.str());
+        }
+    }
+
+    std::stringstream s;
+    s << options.dbFilename << ".idx_" << kmerSize_;
+    ScopedTimer tim;
+    if (referenceData_.loadSignatures(Database::signatureFileName(s.str())))
+    {
+        std::cerr << "Loaded bit matrix from " << Database::signatureFileName(s.str()) << ". ";
+    }
+    else
+    {
+        std::cerr << "Building bit matrix";
+        referenceData_.buildSignatures();
+        std::cerr << " done. ";
+    }
+}
+
+
+// memory used by the index plus an estimate for the classification threads
+MemoryEstimate Classifier::memoryUsage() const
+{
+    MemoryEstimate usage = referenceData_.memoryUsage();
+    usage.threadScratch = numThreads_ * (numRefSeqs_ * sizeof(unsigned int) + threadScratchOverhead);
+    if (!summary_.fileName.empty())
+        usage.threadScratch += AbundanceTable::tableBytes(referenceData_.numLevels(), referenceData_.numAnnotations());
+    usage.inFlight = numThreads_ * inFlightPerThread;
+    return usage;
+}
+
+// classify a single sequence
+void Classifier::classifySequence(const char *sequence, size_t length, unsigned long seed, Classification& result, ThreadStats *stats) const
+{
+    classifySequence(sequence, length, NULL, seed, numBootstrap_, subsampleSize_, result, stats);
+}
+
+// classify a single sequence with the given bootstrap settings
+void Classifier::classifySequence(const char *sequence, size_t length, const char *quality, unsigned long seed,
+                                  unsigned int numBootstrap, unsigned int subsample, Classification& result, ThreadStats *stats) const
+{
+    // get a query sequence and convert to kmers
+    PhaseTimer kmerTimer(stats, PHASE_KMERIZE);
+    KmerSequence fwdSeq = kmerizer_.kmerize(sequence, length, quality, minQuality_);
+    classifyQuery(fwdSeq, kmerTimer, seed, numBootstrap, subsample, result, stats);
+}
+
+// classify a read pair as one query, the orientation of the pair being found
+// as for a single read
+void Classifier::classifyPair(const DnaSequence& first, const DnaSequence& second, unsigned long seed,
+                              Classification& result, ThreadStats *stats) const
+{
+    PhaseTimer kmerTimer(stats, PHASE_KMERIZE);
+    KmerSequence fwdSeq = kmerizer_.kmerizePair(first.sequence.data(), first.sequence.size(), second.sequence.data(), second.sequence.size(),
+                                                first.qualities(), second.qualities(), minQuality_);
+    classifyQuery(fwdSeq, kmerTimer, seed, numBootstrap_, subsampleSize_, result, stats);
+}
+
+// search the kmers of a query in both directions and bootstrap the best hit.
+// kmerTimer is stopped once the query is ready
+void Classifier::classifyQuery(KmerSequence& fwdSeq, PhaseTimer& kmerTimer, unsigned long seed, unsigned int numBootstrap, unsigned int subsample,
+                               Classification& result, ThreadStats *stats) const
+{
+    // reproducible randomness
+    boost::mt19937 randGen(seed);
     RandomGen generator(randGen);
 
-    while(seq = reader.readSequence())
+    // the reverse complement
+    KmerSequence revSeq = kmerizer_.revComp(fwdSeq);
+    if (referenceData_.approximate().enabled())
+    {
+        referenceData_.reduceQuery(fwdSeq);
+        referenceData_.reduceQuery(revSeq);
+    }
+    kmerTimer.stop();
+    
+    // search against database using both forward and reverse sequences
+    PhaseTimer fwdTimer(stats, PHASE_SEARCH_FWD);
+    searchHit fwdHit = referenceData_.search(fwdSeq, stats);
+    fwdTimer.stop();
+    PhaseTimer revTimer(stats, PHASE_SEARCH_REV);
+    searchHit revHit = referenceData_.search(revSeq, stats);
+    revTimer.stop();
+
+    // use the direction which gave the highest scoring hit
+    KmerSequence &querySeq = fwdHit.score > revHit.score ? fwdSeq : revSeq;
+    searchHit &hit = fwdHit.score > revHit.score ? fwdHit : revHit;
+
+    // make each level annotations into a list of uniques
+    for (unsigned int i=0; i< hit.annotationIds.size(); i++)
     {
-        // reproducible randomness
-        randGen.seed(reader.numRead());
+        std::sort(hit.annotationIds[i].begin(), hit.annotationIds[i].end());
+        std::vector<unsigned int>::iterator it;
+        it = std::unique(hit.annotationIds[i].begin(), hit.annotationIds[i].end());
+        hit.annotationIds[i].resize(std::distance(hit.annotationIds[i].begin(), it));
+    }
 
-        // get a query sequence and convert to kmers
-        KmerSequence fwdSeq = kmerizer_.kmerize(seq);
+    // bootstrap
+    if(numBootstrap > 0)
+    {
+        PhaseTimer bootstrapTimer(stats, PHASE_BOOTSTRAP);
+        result.bootstraps = getBootstrap(querySeq, generator, hit, numBootstrap, subsample, stats);
+    }
+    else
+    {
+        result.bootstraps.assign(referenceData_.numLevels(), 0.f);
+    }
+
+    result.score = hit.score;
+    result.annotationIds.swap(hit.annotationIds);
+}
+
+
+// append a result to out as a line of tab separated output. Nothing is
+// allocated once out has grown to the longest line
+void Classifier::formatResult(const std::string& header, const Classification& result, std::string& out, bool listAmbiguous) const
+{
+    size_t tab = header.find('\t');
+    out.append(header, 0, tab);
+    out += '\t';
+    appendFixed2(out, result.score);
+    out += '\t';
+
+    unsigned int i=result.bootstraps.size();
+    while(i--)
+    {
+        const std::vector<unsigned int>& ids = result.annotationIds[i];
+        if (ids.size() == 1)
+            out += referenceData_.annotationFromId(ids[0]);
+        else
+            out += "AMBIGUOUS";
+        out += '\t';
+        appendFixed2(out, result.bootstraps[i]);
+        if(i>0)
+        {
+            out += '\t';
+        }
+        else
+        {
+            // dump ambiguous species
+            if (ids.size() > 1 && listAmbiguous)
+            { 
+                out += '\t';
+                for(std::vector<unsigned int>::const_iterator it = ids.begin(); it != ids.end(); ++it)
+                {
+                    if (it != ids.begin())
+                        out += ',';
         
-        // and the reverse complement
-        KmerSequence revSeq = kmerizer_.revComp(fwdSeq);
+                    out += referenceData_.annotationFromId(*it);
+                }
+            }
         
-        // search against database using both forward and reverse sequences
-        searchHit fwdHit = referenceData_.search(fwdSeq);
-        searchHit revHit = referenceData_.search(revSeq);
-
-        // use the direction which gave the highest scoring hit
-        KmerSequence &querySeq = fwdHit.score > revHit.score ? fwdSeq : revSeq;
-        searchHit &hit = fwdHit.score > revHit.score ? fwdHit : revHit;
-
-        std::vector<float> bootstraps(referenceData_.numLevels(), 0.f);
-        std::vector<std::string> annotations(referenceData_.numLevels(), "AMBIGUOUS");
-       
-        // make each level annotations into a list of uniques
-        for (unsigned int i=0; i< hit.annotationIds.size(); i++)
-        {
-            std::sort(hit.annotationIds[i].begin(), hit.annotationIds[i].end());
-            std::vector<unsigned int>::iterator it;
-            it = std::unique(hit.annotationIds[i].begin(), hit.annotationIds[i].end());
-            hit.annotationIds[i].resize(std::distance(hit.annotationIds[i].begin(), it));
-            if (hit.annotationIds[i].size() == 1)
-                annotations[i] = referenceData_.annotationFromId(*hit.annotationIds[i].begin());
-        }
-
-        // bootstrap
-        if(numBootstrap_ > 0)
-            bootstraps = getBootstrap(querySeq, generator, hit);
-       
-        // output        
-        std::stringstream s;
-        s << std::setprecision(2) << std::fixed;
-        s << querySeq.header.substr(0, querySeq.header.find("\t")) << "\t";
-        s << hit.score << "\t";
-
-        //for(unsigned int i=0; i<bootstraps.size(); i++)
-        unsigned int i=bootstraps.size();
-        while(i--)
-        {
-            s << annotations[i] << "\t";
-            s << bootstraps[i];
-            if(i>0)
+            out += '\n';
+        }
+    }
+}
+
+
+// cut the results file open on fd back to bytes, and carry on writing at its
+// end. With keep, the file is only checked to be one that can be carried on
+static bool truncateOutput(int fd, uint64_t bytes, bool keep = false)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || static_cast<uint64_t>(st.st_size) < bytes)
+        return false;
+    return keep || (ftruncate(fd, bytes) == 0 && lseek(fd, 0, SEEK_END) >= 0);
+}
+
+// flush the results of a sample to disk, returning how many bytes there are
+static uint64_t syncOutput(Sample& sample)
+{
+    sample.output->flush();
+    off_t bytes;
+    bool synced;
+    if (sample.file)
+    {
+        bytes = sample.file->tellp();
+        synced = syncFile(sample.files.outputFilename);
+    }
+    else
+    {
+        bytes = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+        synced = fsync(STDOUT_FILENO) == 0;
+    }
+    if (bytes < 0 || !synced)
+    {
+        throw std::runtime_error("Could not write the results of " + sample.files.inputFilename + " to disk for a checkpoint");
+    }
+    return bytes;
+}
+
+// the bootstrap seed of a read taken from its bases and those of its mate,
+// the same wherever the read is in the input
+static unsigned long sequenceSeed(const DnaSequence& read, const DnaSequence *mate)
+{
+    uint64_t hash = hashBytes(read.sequence.data(), read.sequence.size(), 0);
+    if (mate)
+        hash = hashBytes(mate->sequence.data(), mate->sequence.size(), hash);
+    return static_cast<unsigned long>(hash);
+}
+
+// the calling worker's profiling state, only used when profiling
+WorkerState& Classifier::workerState()
+{
+    boost::shared_ptr<WorkerState>& worker = workers_[scheduler_->currentWorker()];
+    if (!worker)
+        worker.reset(new WorkerState(*stats_));
+    return *worker;
+}
+
+// read stage: the next batch of reads. Only one read is queued at a time, so
+// batches are numbered in input order, and the next read is queued before
+// this batch is classified, for an idle thread to take. Once the window of
+// batches in flight is full, reading stops until one is written, so memory
+// stays bounded and a slow output holds back a streamed input
+void Classifier::readBatch()
+{
+    WorkerState *worker = stats_ ? &workerState() : NULL;
+    ThreadStats *stats = worker ? &worker->stats : NULL;
+
+    // a checkpoint waits for the batches in flight to be written, so that
+    // everything read has been written when it is taken
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        bool checkpoint = !checkpointFilename_.empty() && statsNow() >= nextCheckpoint_;
+        if (numInFlight_ >= batchesPerThread * scheduler_->numThreads() || (checkpoint && numInFlight_))
+        {
+            readWaiting_ = true;
+            return;
+        }
+        if (checkpoint)
+        {
+            writeCheckpoint();
+            nextCheckpoint_ = statsNow() + checkpointInterval_;
+        }
+        numInFlight_++;
+    }
+
+    Sample *sample = nextSample();
+    if (!sample)
+    {
+        releaseBatches(1);
+        return;
+    }
+
+    boost::shared_ptr<ReadBatch> batch(new ReadBatch);
+    batch->sample = sample;
+    batch->reads.reserve(readBatchSize);
+    bool failed = false;
+    if (sample->pairs)
+    {
+        DnaSequence first, second;
+        try {
+            while (batch->reads.size() < readBatchSize && sample->pairs->readPair(first, second, stats))
             {
-                s <<  "\t";
+                batch->reads.push_back(first);
+                batch->mates.push_back(second);
             }
+        }
+        catch (PairingException &e) {
+            std::cerr << "\nError: " << e.what() << std::endl;
+            failed = true;
+        }
+    }
+    else
+    {
+        DnaSequence seq;
+        while (batch->reads.size() < readBatchSize && (seq = sample->reader->readSequence(stats)))
+            batch->reads.push_back(seq);
+    }
+
+    bool exhausted = failed || batch->reads.size() < readBatchSize;
+    bool finished;
+    {
+        boost::mutex::scoped_lock lock(sample->outputMutex);
+        if (!batch->reads.empty())
+            batch->index = sample->numBatches++;
+        sample->exhausted = exhausted;
+        finished = sample->finish();
+    }
+    if (exhausted)
+        currentSample_++;
+    if (currentSample_ < samples_.size())
+        scheduler_->submit(boost::bind(&Classifier::readBatch, this));
+
+    if (failed || finished)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        numFailed_ += failed;
+        if (finished)
+            finishSample(*sample);
+    }
+    if (batch->reads.empty())
+    {
+        releaseBatches(1);
+        return;
+    }
+
+    classifyBatch(*batch);
+    writeBatch(batch);
+}
+
+// batches have left the window, resuming the read stage if it was waiting on them
+void Classifier::releaseBatches(unsigned int numBatches)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    numInFlight_ -= numBatches;
+    if (readWaiting_)
+    {
+        readWaiting_ = false;
+        scheduler_->submit(boost::bind(&Classifier::readBatch, this));
+    }
+}
+
+// classify stage: the results of a batch, formatted for output
+void Classifier::classifyBatch(ReadBatch& batch)
+{
+    WorkerState *worker = stats_ ? &workerState() : NULL;
+    ThreadStats *stats = worker ? &worker->stats : NULL;
+    bool summarise = !summary_.fileName.empty();
+
+    Classification result;
+    uint64_t numHits = 0;
+    if (summarise)
+        batch.results.reserve(batch.reads.size());
+    for (std::vector<DnaSequence>::const_iterator seq=batch.reads.begin(); seq!=batch.reads.end(); ++seq)
+    {
+        const DnaSequence *mate = batch.mates.empty() ? NULL : &batch.mates[seq - batch.reads.begin()];
+
+        // seeded by position in the input, or by the bases, so results do not depend on thread timing
+        unsigned long seed = seedBySequence_ ? sequenceSeed(*seq, mate) : seq->number;
+
+        // a cached result was seeded the same way, so it is the result classifying would give.
+        // A seed taken from the bases is already in the key
+        CacheKey key;
+        bool cached = false;
+        if (cache_)
+        {
+            key = cache_->key(*seq, mate, numBootstrap_ && !seedBySequence_ ? seq->number : 0);
+            cached = cache_->find(key, result);
+            numHits += cached;
+        }
+
+        if (!cached)
+        {
+            if (mate)
+                classifyPair(*seq, *mate, seed, result, stats);
             else
+                classifySequence(seq->sequence.data(), seq->sequence.size(), seq->qualities(), seed,
+                                 numBootstrap_, subsampleSize_, result, stats);
+            if (cache_)
+                cache_->insert(key, result);
+        }
+
+        if (summarise)
+            batch.results.push_back(result);
+
+        if (writeReads_)
+        {
+            PhaseTimer formatTimer(stats, PHASE_FORMAT);
+            if (binaryOutput_)
+                encodeResult(batch.output, seq->number, seq->header, result, binaryFlags_);
+            else
+                formatResult(seq->header, result, batch.output, outputAmbiguous_);
+        }
+
+        if (stats)
+        {
+            uint64_t now = statsNow();
+            stats->readLatencyNs.add(now - worker->readStart);
+            worker->readStart = now;
+            if (++stats->reads % statsPublishInterval == 0)
             {
-                // dump ambiguous species
-                if (hit.annotationIds[i].size() > 1 && outputAmbiguous_)
-                { 
-                    s << "\t";
-                    for(std::vector<unsigned int>::iterator it = hit.annotationIds[i].begin(); it != hit.annotationIds[i].end(); ++it)
-                    {
-                        if (it != hit.annotationIds[i].begin())
-                            s << ",";
-            
-                        s << referenceData_.annotationFromId(*it);
-                    }
-                }
-            
-                s << std::endl;
+                worker->perf.read(*stats);
+                stats_->publish(worker->statsSlot, *stats);
             }
         }
-      
+    }
+    if (cache_)
+        cache_->count(numHits, batch.reads.size() - numHits);
+}
+
+// write stage: whichever thread finds the next batch of a sample ready writes
+// it, and any after it, while the others go back to classifying
+void Classifier::writeBatch(const boost::shared_ptr<ReadBatch>& batch)
+{
+    ThreadStats *stats = stats_ ? &workerState().stats : NULL;
+    Sample& sample = *batch->sample;
+
+    PhaseTimer lockTimer(stats, PHASE_OUTPUT_LOCK);
+    boost::mutex::scoped_lock lock(sample.outputMutex);
+    lockTimer.stop();
+    sample.ready[batch->index] = batch;
+    if (sample.writing)
+        return;
+
+    sample.writing = true;
+    unsigned int numWritten = 0;
+    while (!sample.ready.empty() && sample.ready.begin()->first == sample.nextBatch)
+    {
+        boost::shared_ptr<ReadBatch> next = sample.ready.begin()->second;
+        sample.ready.erase(sample.ready.begin());
+        lock.unlock();
+
+        PhaseTimer writeTimer(stats, PHASE_OUTPUT_WRITE);
+        if (writeReads_)
+        {
+            sample.output->write(next->output.data(), next->output.size());
+            // passed on as they come, for whatever reads the output in a pipeline
+            if (sample.output == &std::cout)
+                sample.output->flush();
+        }
+        for (size_t i=0; i<next->results.size(); i++)
+            sample.summary.add(next->results[i].score, next->results[i].annotationIds, next->results[i].bootstraps, next->reads[i].number, summary_);
+        writeTimer.stop();
+        next.reset();
+        numWritten++;
+
+        lock.lock();
+        sample.nextBatch++;
+    }
+    sample.writing = false;
+    bool finished = sample.finish();
+    lock.unlock();
+
+    if (finished)
+    {
         boost::mutex::scoped_lock lock(mutex_);
-        std::cout << s.str();
+        finishSample(sample);
+    }
+
+    // only once the sample is finished with, so that a checkpoint finds it done
+    releaseBatches(numWritten);
+}
+
+// the sample to read from, opening it when first reached, or NULL once all
+// have been read. Called only from the read stage, one at a time, so only a
+// few files are open at once
+Sample *Classifier::nextSample()
+{
+    while (currentSample_ < samples_.size())
+    {
+        Sample &sample = *samples_[currentSample_];
+        if (!sample.opened())
+        {
+            try {
+                if (interleaved_)
+                    sample.pairs.reset(new PairReader(sample.files.inputFilename, ""));
+                else
+                    sample.reader.reset(new FastaReader(sample.files.inputFilename));
+
+                // carrying on from a checkpoint, appending to the results it recorded
+                bool resuming = resuming_ && currentSample_ == resumeFrom_.sample;
+                bool append = resuming && resumeFrom_.outputBytes;
+                if (resuming)
+                    resumeSample(sample);
+                if (writeReads_)
+                {
+                    int fd = append ? open(sample.files.outputFilename.c_str(), O_WRONLY) : -1;
+                    bool truncated = fd >= 0 && truncateOutput(fd, resumeFrom_.outputBytes);
+                    if (fd >= 0)
+                        close(fd);
+                    if (append && !truncated)
+                        throw FileOpenException("Could not resume " + sample.files.outputFilename + " from the checkpoint");
+                    sample.file.reset(new std::ofstream(sample.files.outputFilename.c_str(),
+                                                        append ? std::ios::binary | std::ios::app : std::ios::binary));
+                    if (!sample.file->is_open())
+                        throw FileOpenException("Could not open " + sample.files.outputFilename);
+                    sample.output = sample.file.get();
+                    if (binaryOutput_ && !append)
+                        writeResultsHeader(*sample.output, referenceData_, binaryFlags_);
+                }
+            }
+            catch (FileOpenException &e) {
+                std::cerr << "\nError: " << e.what() << std::endl;
+                sample.reader.reset();
+                sample.pairs.reset();
+                currentSample_++;
+                boost::mutex::scoped_lock lock(mutex_);
+                numFailed_++;
+                continue;
+            }
+        }
+        if (!summary_.fileName.empty() && sample.summary.empty())
+            sample.summary.reset(referenceData_.numLevels(), referenceData_.numAnnotations());
+        return &sample;
     }
+    return NULL;
+}
+
+// called once the last batch of a sample has been written, holding mutex_
+void Classifier::finishSample(Sample &sample)
+{
+    if (!sample.opened())
+        return;
+
+    bool failed = false;
+    if (!sample.files.summaryFilename.empty())
+    {
+        if (sample.files.summaryFilename == "-")
+        {
+            sample.summary.write(std::cout, referenceData_, summary_);
+        }
+        else
+        {
+            std::ofstream summary(sample.files.summaryFilename.c_str());
+            sample.summary.write(summary, referenceData_, summary_);
+            summary.close();
+            if (summary.fail())
+            {
+                std::cerr << "\nError: Could not write " << sample.files.summaryFilename << std::endl;
+                failed = true;
+            }
+        }
+    }
+
+    if (sample.file)
+    {
+        sample.file->close();
+        if (sample.file->fail())
+        {
+            std::cerr << "\nError: Could not write " << sample.files.outputFilename << std::endl;
+            failed = true;
+        }
+    }
+
+    if (failed)
+        numFailed_++;
+
+    // single input to stdout, reported by classify()
+    if (sample.output == &std::cout)
+        return;
+
+    if (!failed)
+    {
+        std::cerr << sample.files.inputFilename << ": " << sample.numRead() << sample.unit();
+        if (sample.file)
+            std::cerr << " written to " << sample.files.outputFilename;
+        if (!sample.files.summaryFilename.empty())
+            std::cerr << (sample.file ? ", summary to " : " summarised to ") << sample.files.summaryFilename;
+        std::cerr << std::endl;
+    }
+
+    // free the buffers while the remaining samples are classified
+    sample.file.reset();
+    sample.reader.reset();
+    sample.pairs.reset();
+    sample.summary = AbundanceTable();
+}
+
+// record how far the run has got. Called from the read stage, holding mutex_
+// with no batches in flight, or once the run is over
+void Classifier::writeCheckpoint()
+{
+    Checkpoint checkpoint;
+    checkpoint.settings = settings_;
+    checkpoint.numSamples = samples_.size();
+    checkpoint.sample = currentSample_;
+    if (currentSample_ < samples_.size())
+    {
+        Sample& sample = *samples_[currentSample_];
+        checkpoint.inputFilename = sample.files.inputFilename;
+        if (sample.opened())
+        {
+            if (sample.reader)
+                checkpoint.offset = sample.reader->offset();
+            else
+                sample.pairs->offsets(checkpoint.offset, checkpoint.mateOffset);
+            checkpoint.numRead = sample.numRead();
+            if (writeReads_)
+                checkpoint.outputBytes = syncOutput(sample);
+            checkpoint.hasSummary = !sample.summary.empty();
+            checkpoint.summary = sample.summary;
+        }
+    }
+    checkpoint.write(checkpointFilename_);
+}
+
+// read the checkpoint to resume from, false if there is none yet. Exits if
+// it was taken by a run with other settings or inputs
+bool Classifier::loadCheckpoint()
+{
+    if (!resumeFrom_.read(checkpointFilename_))
+    {
+        std::cerr << "No checkpoint in " << checkpointFilename_ << ", starting from the beginning" << std::endl;
+        return false;
+    }
+    if (resumeFrom_.settings != settings_ || resumeFrom_.numSamples != samples_.size() ||
+        (resumeFrom_.sample < samples_.size() && resumeFrom_.inputFilename != samples_[resumeFrom_.sample]->files.inputFilename))
+    {
+        throw std::runtime_error("the checkpoint in " + checkpointFilename_ + " was taken by a different run");
+    }
+    resuming_ = true;
+    return true;
+}
+
+// move the input of the sample being resumed on to the checkpoint, with the
+// summary of the reads before it. Reads keep their numbers, and so their seeds
+void Classifier::resumeSample(Sample& sample)
+{
+    if (sample.reader)
+        sample.reader->seek(resumeFrom_.offset, resumeFrom_.numRead);
+    else
+        sample.pairs->seek(resumeFrom_.offset, resumeFrom_.mateOffset, resumeFrom_.numRead);
+    if (resumeFrom_.hasSummary)
+        sample.summary = resumeFrom_.summary;
+    std::cerr << "Resuming " << sample.files.inputFilename << " after " << resumeFrom_.numRead << sample.unit() << std::endl;
 }
 
 // bootstrapping
-std::vector<float> Classifier::getBootstrap(const KmerSequence& querySeq, RandomGen &generator, const searchHit& hit)
+std::vector<float> Classifier::getBootstrap(const KmerSequence& querySeq, RandomGen &generator, const searchHit& hit, unsigned int numBootstrap, unsigned int subsample, ThreadStats *stats) const
 {
     KmerSequence bootstrap;
     std::vector<kmerSize_t>kmers = querySeq.kmers;
     std::vector<float> counts(referenceData_.numLevels(), 0.f);
-    int bootstrap_size = kmers.size() / subsampleSize_;
+    int bootstrap_size = kmers.size() / subsample;
     
-    for (unsigned int bs=0; bs<numBootstrap_; bs++)
+    for (unsigned int bs=0; bs<numBootstrap; bs++)
     {
         std::random_shuffle(kmers.begin(), kmers.end(), generator);
         bootstrap.kmers = std::vector<kmerSize_t>(kmers.begin(), kmers.begin() + bootstrap_size);
-        searchHit bsHit = referenceData_.search(bootstrap);
+        searchHit bsHit = referenceData_.search(bootstrap, stats);
         
         for (unsigned int i=0; i<referenceData_.numLevels(); i++)
         {
@@ -174,24 +967,220 @@ std::vector<float> Classifier::getBootstrap(const KmerSequence& querySeq, Random
     std::vector<float> retVec;
     for (unsigned int i=0; i<referenceData_.numLevels(); i++)
     {
-        retVec.push_back(counts[i] / static_cast<float>(numBootstrap_));
+        retVec.push_back(counts[i] / static_cast<float>(numBootstrap));
     }
 
     return retVec;
 }
 
 
+// start the worker threads, once, when there is first work for them
+void Classifier::startThreads()
+{
+    if (!scheduler_)
+        scheduler_.reset(new TaskScheduler(numThreads_, pinThreads_));
+}
+
+// run the worker threads over the samples
+void Classifier::run()
+{
+    currentSample_ = resuming_ ? resumeFrom_.sample : 0;
+    numFailed_ = 0;
+    numInFlight_ = 0;
+    readWaiting_ = false;
+    nextCheckpoint_ = statsNow() + checkpointInterval_;
+
+    if (stats_)
+        stats_->start();
+
+    startThreads();
+    workers_.assign(scheduler_->numThreads() + 1, boost::shared_ptr<WorkerState>());
+    scheduler_->submit(boost::bind(&Classifier::readBatch, this));
+    scheduler_->wait();
+    resuming_ = false;
+
+    if (cache_)
+    {
+        cache_->flush();
+        std::cerr << "Result cache " << cache_->report() << std::endl;
+    }
+
+    // so that resuming a completed run finds nothing left to do
+    if (!checkpointFilename_.empty() && !numFailed_)
+        writeCheckpoint();
+
+    if (stats_)
+    {
+        for (std::vector<boost::shared_ptr<WorkerState> >::iterator it=workers_.begin(); it!=workers_.end(); ++it)
+        {
+            if (!*it)
+                continue;
+            (*it)->perf.read((*it)->stats);
+            stats_->publish((*it)->statsSlot, (*it)->stats);
+        }
+        stats_->finish();
+    }
+    workers_.clear();
+}
+
 // classify sequences from queryFileName
-void Classifier::classify(const std::string& queryFileName)
+unsigned int Classifier::classify(const std::string& queryFileName)
 {
     ScopedTimer tim;
     std::cerr << "Classifying sequences....\n";
-  
+
+    boost::shared_ptr<Sample> sample(new Sample);
+    sample->files.inputFilename = queryFileName;
+    sample->files.summaryFilename = summary_.fileName;
+    samples_.assign(1, sample);
+    if (resume_ && loadCheckpoint() && resumeFrom_.sample == 1)
+    {
+        std::cerr << queryFileName << " was already classified, as recorded in " << checkpointFilename_ << std::endl;
+        resuming_ = false;
+        samples_.clear();
+        return 0;
+    }
+
+    if (interleaved_ || !mateFilename_.empty())
+        sample->pairs.reset(new PairReader(queryFileName, mateFilename_));
+    else
+        sample->reader.reset(new FastaReader(queryFileName));
+    sample->output = &std::cout;
+
+    // results so far are kept in the file stdout appends to
+    bool append = resuming_ && resumeFrom_.outputBytes;
+    if (resuming_)
+        resumeSample(*sample);
+    if (!checkpointFilename_.empty() && writeReads_ && !truncateOutput(STDOUT_FILENO, append ? resumeFrom_.outputBytes : 0, !resuming_))
+    {
+        std::string msg = "with --checkpoint, results must be written to a file";
+        msg += resuming_ ? ", appending with >>" : "";
+        msg += append ? ", holding the results recorded in the checkpoint" : "";
+        throw std::runtime_error(msg);
+    }
+    if (binaryOutput_ && writeReads_ && !append)
+        writeResultsHeader(std::cout, referenceData_, binaryFlags_);
+
+    run();
+    samples_.clear();
+
+    std::cerr << sample->numRead() << sample->unit() << " processed.";
+    return numFailed_;
+}
+
+// classify each sample into its own output file
+unsigned int Classifier::classify(const std::vector<SampleFiles>& samples)
+{
+    ScopedTimer tim;
+    std::cerr << "Classifying " << samples.size() << " sample" << (samples.size() > 1 ? "s" : "") << "....\n";
+
+    samples_.clear();
+    for (std::vector<SampleFiles>::const_iterator it=samples.begin(); it!=samples.end(); ++it)
+    {
+        boost::shared_ptr<Sample> sample(new Sample);
+        sample->files = *it;
+        samples_.push_back(sample);
+    }
+    if (resume_ && loadCheckpoint() && resumeFrom_.sample)
+        std::cerr << "The first " << resumeFrom_.sample << " samples were already classified, as recorded in " << checkpointFilename_ << std::endl;
+
+    run();
+    samples_.clear();
+
+    std::cerr << samples.size() - numFailed_ << " of " << samples.size() << " samples processed.";
+    return numFailed_;
+}
+
+
+// classify the reads first to last - 1
+void Classifier::calibrateBatch(const std::vector<DnaSequence>& reads, std::vector<Classification>& results, size_t first, size_t last) const
+{
+    for (size_t i=first; i<last; i++)
+        classifySequence(reads[i].sequence.data(), reads[i].sequence.size(), reads[i].qualities(), reads[i].number,
+                         numBootstrap_, subsampleSize_, results[i]);
+}
+
+// classify the reads with the current search settings, returns the seconds taken
+double Classifier::calibrationPass(const std::vector<DnaSequence>& reads, std::vector<Classification>& results)
+{
+    startThreads();
+    uint64_t start = statsNow();
+    for (size_t first=0; first<reads.size(); first+=readBatchSize)
+        scheduler_->submit(boost::bind(&Classifier::calibrateBatch, this, boost::cref(reads), boost::ref(results),
+                                       first, std::min(first + readBatchSize, reads.size())));
+    scheduler_->wait();
+    return (statsNow() - start) / 1e9;
+}
+
+void Classifier::calibrate(const std::string& queryFileName, unsigned int sampleSize, const ApproximateOptions& approximate)
+{
+    ScopedTimer tim;
+    std::cerr << "Calibrating approximate search on " << sampleSize << " reads....\n";
+
+    // reservoir sample, so the whole input is never held. The seed is fixed
+    // so that settings are compared on the same reads from run to run
     FastaReader reader(queryFileName);
-    for (unsigned int i=0; i<numThreads_; i++)
-        threads_.create_thread(boost::bind(&Classifier::runThread, this, boost::ref(reader)));
+    std::vector<DnaSequence> reads;
+    boost::mt19937 randGen(calibrationSeed);
+    DnaSequence seq;
+    while ((seq = reader.readSequence()))
+    {
+        if (reads.size() < sampleSize)
+        {
+            reads.push_back(seq);
+            continue;
+        }
+        boost::uniform_int<long> position(0, seq.number - 1);
+        long i = position(randGen);
+        if (i < static_cast<long>(sampleSize))
+            reads[i] = seq;
+    }
 
-    threads_.join_all();
+    std::vector<Classification> exact(reads.size()), approx(reads.size());
+    referenceData_.setApproximate(ApproximateOptions());
+    double exactSeconds = calibrationPass(reads, exact);
+    referenceData_.setApproximate(approximate);
+    double approxSeconds = calibrationPass(reads, approx);
 
-    std::cerr << reader.numRead() << " sequences processed.";
+    // agreement at each level, numbered as in the output. A confident call is
+    // a single annotation with bootstrap support at the summary threshold
+    unsigned int numLevels = referenceData_.numLevels();
+    std::vector<size_t> agree(numLevels, 0), confident(numLevels, 0), confidentAgree(numLevels, 0);
+    std::vector<double> bootstrapDiff(numLevels, 0.0);
+    double scoreDiff = 0.0;
+    for (size_t r=0; r<reads.size(); r++)
+    {
+        scoreDiff += std::fabs(exact[r].score - approx[r].score);
+        for (unsigned int level=0; level<numLevels; level++)
+        {
+            unsigned int i = numLevels - 1 - level;
+            const std::vector<unsigned int>& e = exact[r].annotationIds[i];
+            const std::vector<unsigned int>& a = approx[r].annotationIds[i];
+            bool same = e.size() == 1 ? (a.size() == 1 && a[0] == e[0]) : a.size() != 1;
+            agree[level] += same;
+            bootstrapDiff[level] += std::fabs(exact[r].bootstraps[i] - approx[r].bootstraps[i]);
+            if (e.size() == 1 && exact[r].bootstraps[i] >= summary_.threshold)
+            {
+                confident[level]++;
+                confidentAgree[level] += same && approx[r].bootstraps[i] >= summary_.threshold;
+            }
+        }
+    }
+
+    double n = reads.empty() ? 1.0 : static_cast<double>(reads.size());
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "# %lu of %ld reads, common kmers %g, sampled kmers %g\n",
+             static_cast<unsigned long>(reads.size()), reader.numRead(), approximate.commonKmers, approximate.sampleKmers);
+    std::cout << buffer;
+    snprintf(buffer, sizeof(buffer), "exact_seconds\t%.2f\napproximate_seconds\t%.2f\nspeedup\t%.2f\nscore_difference\t%.4f\n",
+             exactSeconds, approxSeconds, approxSeconds > 0 ? exactSeconds / approxSeconds : 0.0, scoreDiff / n);
+    std::cout << buffer;
+
+    std::cout << "level\tagreement\tconfident_agreement\tbootstrap_difference\n";
+    for (unsigned int level=0; level<numLevels; level++)
+    {
+        snprintf(buffer, sizeof(buffer), "%u\t%.2f\t%.2f\t%.4f\n", level + 1, 100.0 * agree[level] / n,
+                 confident[level] ? 100.0 * confidentAgree[level] / confident[level] : 100.0, bootstrapDiff[level] / n);
+        std::cout << buffer;
+    }
 }
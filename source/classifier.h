@@ -25,23 +25,87 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "database.h"
 #include "fasta.h"
 #include "common.h"
+#include "stats.h"
+#include "summary.h"
+#include "checkpoint.h"
+#include "scheduler.h"
+
+//======================================================================
+// SampleFiles struct
+// an input file and the file its results are written to
+//======================================================================
+struct SampleFiles
+{
+    std::string inputFilename;
+    std::string outputFilename;
+    std::string summaryFilename;    // abundance summary, empty for none
+};
 
 // configuration options
 struct ClassifierOptions {
     int kmerSize;
     int numThreads;
+    bool pinThreads;                // pin each worker thread to a CPU
     int numBootstrap;
     int subsample;
     std::string dbFilename;
     std::string inputFilename;
+    std::vector<SampleFiles> samples;   // several samples to classify, empty for inputFilename to stdout
+    std::string mateFilename;       // second mates of the pairs in inputFilename, empty for none
+    bool interleaved;               // inputs hold the two mates of each pair one after the other
+    unsigned int minQuality;        // fastq bases below this phred quality are masked, 0 for none
+    std::string cacheFilename;      // results of earlier runs, added to as reads are classified, empty for none
+    bool seedBySequence;            // seed the bootstrap of each read from its bases rather than its position
+    std::string checkpointFilename; // where progress is recorded, empty for none
+    double checkpointInterval;      // seconds between checkpoints
+    bool resume;                    // carry on from the checkpoint, if there is one
     bool saveIndex;
     bool dumpAmbiguous;
+    bool writeReads;                // write a line per read, off when only the summary is wanted
+    bool binaryOutput;              // write results in the binary format, see results.h
+    bool binaryNames;               // store read names in binary results
+    SummaryOptions summary;
+    std::string statsFilename;      // profiling report, empty for none
+    double statsInterval;           // seconds between interim reports, 0 for none
+    bool statsPerf;                 // collect hardware counters
+    uint64_t maxMemory;             // memory budget in bytes, 0 for unlimited
+    bool exhaustive;                // search without pruning
+    bool hierarchical;              // search groups of references at the level above species first
+    SearchEngine engine;            // how the index is searched, see database.h
+    ApproximateOptions approximate; // search only some of the kmers of each query
+    unsigned int calibrate;         // reads to compare exact and approximate searches on, 0 to classify
+    std::string serveSocket;        // run as a server on this socket, empty for none
+    std::string serverSocket;       // classify using the server on this socket, empty for none
+    std::vector<std::string> shardSockets;  // search the index shards held by these servers, empty for none
+};
+
+// a sample being classified, the reads classified together, and the
+// state of each worker thread, see classifier.cpp
+struct Sample;
+struct ReadBatch;
+struct WorkerState;
+
+// results of earlier runs, see cache.h
+class ResultCache;
+
+//======================================================================
+// Classification struct
+// result of classifying a single query sequence
+//======================================================================
+struct Classification
+{
+    float score;                                            // similarity score of the best hit
+    std::vector<std::vector<unsigned int> > annotationIds;  // unique annotations per level
+    std::vector<float> bootstraps;                          // bootstrap support per level
 };
 
+
 class Classifier
 {
 private:
@@ -53,17 +117,94 @@ private:
     unsigned int numBootstrap_;
     unsigned int subsampleSize_;
     bool outputAmbiguous_;
+    bool writeReads_;
+    bool binaryOutput_;
+    unsigned int binaryFlags_;
+    SummaryOptions summary_;
+    std::string mateFilename_;
+    bool interleaved_;
+    unsigned int minQuality_;
+    std::string checkpointFilename_;
+    uint64_t checkpointInterval_;           // nanoseconds
+    uint64_t nextCheckpoint_;
+    std::string settings_;                  // recorded in checkpoints, to be matched on resuming
+    bool resume_;
+    bool resuming_;                         // resumeFrom_ has been read and applies to this run
+    Checkpoint resumeFrom_;
     
     boost::mutex mutex_;
-    boost::thread_group threads_;
+    boost::scoped_ptr<TaskScheduler> scheduler_;   // started by the first run, not by embedding callers
+    bool pinThreads_;
+    boost::scoped_ptr<StatsCollector> stats_;
+    boost::shared_ptr<ResultCache> cache_;
+    bool seedBySequence_;
+    std::vector<boost::shared_ptr<WorkerState> > workers_;
 
-    void runThread(FastaReader &reader);
-    std::vector<float> getBootstrap(const KmerSequence &querySeq, RandomGen &generator, const searchHit& hit);
+    // samples shared by the worker threads, read one after another
+    std::vector<boost::shared_ptr<Sample> > samples_;
+    size_t currentSample_;
+    unsigned int numFailed_;
+    uint64_t numInFlight_;          // batches read and not yet written
+    bool readWaiting_;              // the read stage is waiting for a batch to be written
+
+    void loadReferences(const ClassifierOptions& options);
+    void loadSignatures(const ClassifierOptions& options);
+    void startThreads();
+    void run();
+    WorkerState& workerState();
+    void readBatch();
+    void classifyBatch(ReadBatch& batch);
+    void writeBatch(const boost::shared_ptr<ReadBatch>& batch);
+    void releaseBatches(unsigned int numBatches);
+    Sample *nextSample();
+    void finishSample(Sample &sample);
+    void writeCheckpoint();
+    bool loadCheckpoint();
+    void resumeSample(Sample &sample);
+    void calibrateBatch(const std::vector<DnaSequence>& reads, std::vector<Classification>& results, size_t first, size_t last) const;
+    double calibrationPass(const std::vector<DnaSequence>& reads, std::vector<Classification>& results);
+    void classifyQuery(KmerSequence& fwdSeq, PhaseTimer& kmerTimer, unsigned long seed, unsigned int numBootstrap, unsigned int subsample,
+                       Classification& result, ThreadStats *stats) const;
+    std::vector<float> getBootstrap(const KmerSequence &querySeq, RandomGen &generator, const searchHit& hit, unsigned int numBootstrap, unsigned int subsample, ThreadStats *stats) const;
 
 public:
     Classifier( const ClassifierOptions &options );
 
-    void classify(const std::string &queryFileName);
+    // classify a sample, returns non-zero if it could not be read or written
+    unsigned int classify(const std::string &queryFileName);
+
+    // classify several samples, each written to its own file. Samples are read
+    // one after another, while the threads classify the batches already read.
+    // Returns the number of samples which could not be classified
+    unsigned int classify(const std::vector<SampleFiles> &samples);
+
+    // classify a random sample of sampleSize reads from queryFileName with
+    // exact and approximate searches, and report to stdout how well they
+    // agree at each level and the speedup
+    void calibrate(const std::string &queryFileName, unsigned int sampleSize, const ApproximateOptions& approximate);
+
+    // memory used by the index plus an estimate for the classification threads
+    MemoryEstimate memoryUsage() const;
+
+    // classify one sequence. The bootstrap is seeded from seed, the position of
+    // the sequence in its input (starting from 1), so results are reproducible
+    void classifySequence(const char *sequence, size_t length, unsigned long seed, Classification& result, ThreadStats *stats = NULL) const;
+
+    // as above, with bootstrap settings other than those the classifier was created with,
+    // and the phred+33 quality of each base (or NULL) for masking low quality kmers
+    void classifySequence(const char *sequence, size_t length, const char *quality, unsigned long seed,
+                          unsigned int numBootstrap, unsigned int subsample, Classification& result, ThreadStats *stats = NULL) const;
+
+    // classify a read pair, the kmers of both mates searched together with the
+    // second mate reverse complemented. The pair is seeded like a single read
+    void classifyPair(const DnaSequence& first, const DnaSequence& second, unsigned long seed,
+                      Classification& result, ThreadStats *stats = NULL) const;
+
+    // append a result in the tab separated output format
+    void formatResult(const std::string& header, const Classification& result, std::string& out, bool listAmbiguous) const;
+
+    const Database& database() const { return referenceData_; }
+    unsigned int numBootstrap() const { return numBootstrap_; }
 };
 
 #endif /* __CLASSIFIER_H__ */
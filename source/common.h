@@ -27,6 +27,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <cstring>
+#include <stdint.h>
 #include "boost/random.hpp"
 
 //======================================================================
@@ -81,6 +83,40 @@ struct RandomGen
 };
 
 
+//======================================================================
+// hashBytes
+// 64 bit hash of length bytes (MurmurHash64A), for keys which only
+// need to be compared, never decoded
+//======================================================================
+inline uint64_t hashBytes(const void *data, size_t length, uint64_t seed)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    uint64_t h = seed ^ (length * m);
+    for (; length >= 8; p += 8, length -= 8)
+    {
+        uint64_t k;
+        memcpy(&k, p, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (length)
+    {
+        for (size_t i=length; i>0; i--)
+            h ^= static_cast<uint64_t>(p[i - 1]) << (8 * (i - 1));
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+
 //======================================================================
 // older boost versions require this for serialization
 //======================================================================
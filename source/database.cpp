@@ -21,67 +21,272 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "database.h"
 #include "fasta.h"
 #include "common.h"
+#include "vregion.h"
+#include "server.h"
 #include <algorithm>
 #include <iostream>
+#include <fstream>
 #include <math.h>
+#include <map>
+#include <cstring>
+#include <cctype>
+#include <stdexcept>
+#include <boost/lexical_cast.hpp>
+
+// bases of kept reference sequences, anything else is stored as N
+static const char *sequenceAlphabet = "ACGTURYKMSWBDHVN";
+
+static std::string packSequence(const std::string& sequence)
+{
+    static signed char codes[256];
+    static bool ready = false;
+    if (!ready)
+    {
+        for (unsigned int c=0; c<256; c++)
+        {
+            const char *pos = strchr(sequenceAlphabet, toupper(c));
+            codes[c] = (c && pos) ? pos - sequenceAlphabet : 15;
+        }
+        ready = true;
+    }
+
+    std::string packed((sequence.size() + 1) / 2, '\0');
+    for (size_t i=0; i<sequence.size(); i++)
+        packed[i / 2] |= codes[static_cast<unsigned char>(sequence[i])] << ((i & 1) * 4);
+    return packed;
+}
+
+static std::string unpackSequence(const std::string& packed, uint32_t length)
+{
+    std::string sequence(length, 'N');
+    for (uint32_t i=0; i<length; i++)
+        sequence[i] = sequenceAlphabet[(static_cast<unsigned char>(packed[i / 2]) >> ((i & 1) * 4)) & 0xf];
+    return sequence;
+}
+
+
+// memory needed for the loaded index
+uint64_t IndexSummary::indexBytes(IndexLayout layout) const
+{
+    if (layout == INDEX_SPARSE)
+    {
+        // each posting may be of a kmer of its own, needing its kmer, its offset
+        // and no more than two directory entries
+        uint64_t numKmers = std::min(numPostings, numSlots);
+        return numKmers * (sizeof(kmerSize_t) + 3 * sizeof(uint32_t)) + numPostings * sizeof(unsigned int);
+    }
+    if (layout == INDEX_COMPACT)
+        return (numSlots + 1) * sizeof(uint32_t) + numPostings * sizeof(unsigned int);
+
+    return numSlots * sizeof(std::vector<unsigned int>) + numPostings * sizeof(unsigned int);
+}
+
+// peak memory needed while building the index from fasta
+uint64_t IndexSummary::buildBytes(IndexLayout layout) const
+{
+    if (layout == INDEX_COMPACT)
+    {
+        // the kmers of every reference are held until the postings are laid out
+        return indexBytes(INDEX_COMPACT) + numPostings * sizeof(kmerSize_t) + numSequences * sizeof(std::vector<kmerSize_t>);
+    }
+    if (layout == INDEX_SPARSE)
+    {
+        // as compact, while a copy of the kmers is sorted to find those which occur
+        return indexBytes(INDEX_SPARSE) + 2 * numPostings * sizeof(kmerSize_t) + numSequences * sizeof(std::vector<kmerSize_t>);
+    }
+
+    // allow for the spare capacity of growing vectors
+    return numSlots * sizeof(std::vector<unsigned int>) + numPostings * sizeof(unsigned int) * 3 / 2;
+}
+
+// memory needed for the annotation strings and per-reference annotation ids
+uint64_t IndexSummary::annotationTableBytes() const
+{
+    return annotationBytes + numSequences * numLevels * sizeof(unsigned int);
+}
+
+
+// upper bound on the index summary for a kmer size
+IndexSummary ReferenceScan::estimate(unsigned int kmerSize) const
+{
+    IndexSummary summary;
+    uint64_t possibleKmers = static_cast<uint64_t>(1) << (kmerSize << 1);
+    summary.kmerSize = kmerSize;
+    summary.numSequences = lengths.size();
+    summary.numLevels = numLevels;
+    summary.numSlots = possibleKmers + 1;
+    summary.annotationBytes = headerBytes + summary.numSequences * numLevels * sizeof(std::string);
+
+    // every position may start a different kmer
+    for (std::vector<uint32_t>::const_iterator it=lengths.begin(); it!=lengths.end(); ++it)
+        if (*it >= kmerSize)
+            summary.numPostings += std::min(static_cast<uint64_t>(*it - kmerSize + 1), possibleKmers);
+
+    return summary;
+}
+
+
+//======================================================================
+// LoadJob struct
+// references read a batch at a time, one batch after another, kmerized
+// in parallel and added to the index in the order they were read
+//======================================================================
+struct LoadJob
+{
+    struct Reference
+    {
+        KmerSequence kmers;
+        std::string packed;
+        uint32_t length;
+    };
+    typedef std::vector<Reference> Batch;
+
+    Database& db;
+    SequenceSource& reader;
+    const Kmerizer& kmerizer;
+    TaskScheduler& scheduler;
+    uint64_t numBatches;        // batches read so far
+    uint64_t nextBatch;         // the next batch to add to the index
+    bool adding;                // a worker is adding batches
+    std::map<uint64_t, boost::shared_ptr<Batch> > ready;   // kmerized, waiting on earlier batches
+    boost::mutex mutex;
+
+    LoadJob(Database& d, SequenceSource& r, const Kmerizer& k, TaskScheduler& s) :
+        db(d), reader(r), kmerizer(k), scheduler(s), numBatches(0), nextBatch(0), adding(false) {}
+
+    // only one read is queued at a time, so batches are numbered in input order.
+    // The next read is queued before this batch is kmerized, for an idle worker to take
+    void read()
+    {
+        static const unsigned int batchSize = 64;
+        std::vector<DnaSequence> seqs;
+        DnaSequence seq;
+        while (seqs.size() < batchSize && (seq = reader.readSequence()))
+            seqs.push_back(seq);
+        if (seqs.empty())
+            return;
+        uint64_t index = numBatches++;
+        if (seqs.size() == batchSize)
+            scheduler.submit(boost::bind(&LoadJob::read, this));
+
+        boost::shared_ptr<Batch> batch(new Batch(seqs.size()));
+        for (size_t i=0; i<seqs.size(); i++)
+        {
+            Reference& ref = (*batch)[i];
+            ref.kmers = kmerizer.kmerize(seqs[i]);
+            if (db.keepSequences_)
+                ref.packed = packSequence(seqs[i].sequence);
+            ref.length = seqs[i].sequence.size();
+        }
+        add(index, batch);
+    }
+
+    // whichever worker finds the next batch ready adds it, and any after it,
+    // while the others go back to reading and kmerizing
+    void add(uint64_t index, const boost::shared_ptr<Batch>& batch)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        ready[index] = batch;
+        if (adding)
+            return;
+        adding = true;
+        while (!ready.empty() && ready.begin()->first == nextBatch)
+        {
+            boost::shared_ptr<Batch> next = ready.begin()->second;
+            ready.erase(ready.begin());
+            nextBatch++;
+            lock.unlock();
+            for (Batch::iterator it=next->begin(); it!=next->end(); ++it)
+                db.addSequence(it->kmers, it->packed, it->length);
+            lock.lock();
+        }
+        adding = false;
+    }
+};
+
 
 // load the reference sequences and convert to kmer index
-bool Database::load(const std::string& fileName, const Kmerizer& kmerizer, const unsigned int numThreads)
+bool Database::load(const std::string& fileName, const Kmerizer& kmerizer, TaskScheduler& scheduler, IndexLayout layout)
+{
+    FastaReader reader(fileName);
+    return load(reader, fileName, kmerizer, scheduler, layout);
+}
+
+
+// convert sequences from any source to the kmer index
+bool Database::load(SequenceSource& reader, const std::string& name, const Kmerizer& kmerizer, TaskScheduler& scheduler, IndexLayout layout)
 {
     numSequences_ = 0;
     numLevels_ = 0;
+    kmerSize_ = kmerizer.kmerSize();
+    layout_ = layout;
     index_.clear();
-    
-    try {
-        index_.resize(kmerizer.numKmers() + 1);
+    offsets_.clear();
+    postings_.clear();
+    pending_.clear();
+    kmers_.clear();
+    directory_.clear();
+    weights_.clear();
+    sequences_.clear();
+    sequenceLengths_.clear();
+    segments_.clear();
+    segmentSequences_ = 0;
+    signatures_.reset();
+    groupMembers_.clear();
+    spill_.reset();
+
+    if (!spillDirectory_.empty())
+    {
+        spill_.reset(new KmerSpill(spillDirectory_, spillMemory_, kmerizer.numKmers() + 1, scheduler));
     }
-    catch(std::bad_alloc&) {
-        std::cerr << "\nError: Could not allocate memory for kmer size " << kmerizer.kmerSize() << std::endl;
-        exit(EXIT_FAILURE);
+    else if (layout_ == INDEX_DENSE)
+    {
+        try {
+            index_.resize(kmerizer.numKmers() + 1);
+        }
+        catch(std::bad_alloc&) {
+            throw std::runtime_error("Could not allocate memory for kmer size " + boost::lexical_cast<std::string>(kmerizer.kmerSize()));
+        }
     }
     
     annotations_.clear();
     annotationIds_.clear();
    
-    FastaReader reader(fileName);
     ScopedTimer tim;
-    std::cerr << "Loading reference database: " << fileName.c_str() << "\n";
+    std::cerr << "Loading reference database: " << name.c_str() << "\n";
     
     // read first entry separately, use it to define number of taxonomic levels
     DnaSequence seq = reader.readSequence();
     if(!seq)
     {
-        std::cerr << "\nError: incorrect database format";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("incorrect database format");
     }
     numLevels_ = std::count(seq.header.begin(), seq.header.end(), '\t');
 
     if (numLevels_ == 0)
     {
-        std::cerr << "\nError: No taxonomic levels defined";
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("No taxonomic levels defined");
     }
 
     annotationIds_.resize(numLevels_);
 
-    addSequence(kmerizer.kmerize(seq));
+    KmerSequence kmers = kmerizer.kmerize(seq);
+    addSequence(kmers, keepSequences_ ? packSequence(seq.sequence) : std::string(), seq.sequence.size());
 
     // now load up the rest of the reference sequences
-    for (unsigned int i=0; i<numThreads; i++)
-        threads_.create_thread(boost::bind(&Database::loadThread, this, boost::ref(reader), boost::ref(kmerizer)));
-
-    threads_.join_all();
+    LoadJob job(*this, reader, kmerizer, scheduler);
+    scheduler.submit(boost::bind(&LoadJob::read, &job));
+    scheduler.wait();
   
     // something wrong? 
     if(numSequences_ == 0)
     {
         std::ostringstream msg;
-        msg << "Could not read from database " << fileName;
+        msg << "Could not read from database " << name;
         throw FileOpenException(msg.str());
     }
     
-    // remove the index for k-mers containing non-ATGCU bases
-    index_[kmerizer.numKmers()].clear();
+    finishIndex(kmerizer.numKmers() + 1);
 
     // all done!
     std::cerr << numSequences_ << " reference sequences loaded ";
@@ -90,24 +295,343 @@ bool Database::load(const std::string& fileName, const Kmerizer& kmerizer, const
 
 
 // add a sequence to the database
-void Database::addSequence(const KmerSequence & seq)
+void Database::addSequence(KmerSequence& seq, const std::string& packed, uint32_t length)
 {
     boost::mutex::scoped_lock lock(mutex_);
     parseHeader(seq.header);
-    
-    for (std::vector<kmerSize_t>::const_iterator it=seq.kmers.begin(); it != seq.kmers.end(); ++it)
-        index_[*it].push_back(numSequences_);
+    if (keepSequences_)
+    {
+        sequences_.push_back(packed);
+        sequenceLengths_.push_back(length);
+    }
+    addKmers(seq.kmers);
+}
+
+
+// index the kmers of the next reference
+void Database::addKmers(std::vector<kmerSize_t>& kmers)
+{
+    if (spill_)
+    {
+        spill_->add(numSequences_, kmers);
+        std::vector<kmerSize_t>().swap(kmers);
+    }
+    else if (layout_ != INDEX_DENSE)
+    {
+        // laid out once all references are known
+        pending_.push_back(std::vector<kmerSize_t>());
+        pending_.back().swap(kmers);
+    }
+    else
+    {
+        for (std::vector<kmerSize_t>::const_iterator it=kmers.begin(); it != kmers.end(); ++it)
+            index_[*it].push_back(numSequences_);
+    }
     
     numSequences_ ++;
 }
 
 
+// lay out the compact index, or drop kmers with non-ACGTU bases from the dense one
+void Database::finishIndex(kmerSize_t numSlots)
+{
+    if (spill_)
+    {
+        spill_->finish();
+        if (layout_ != INDEX_DENSE && spill_->numPairs() > 0xffffffffULL)
+        {
+            throw std::runtime_error("Too many kmers for a compact index");
+        }
+    }
+    else if (layout_ != INDEX_DENSE)
+    {
+        try {
+            buildCompact(numSlots);
+        }
+        catch(std::bad_alloc&) {
+            throw std::runtime_error("Could not allocate memory for kmer size " + boost::lexical_cast<std::string>(kmerSize_));
+        }
+    }
+    else
+    {
+        // remove the index for k-mers containing non-ATGCU bases
+        index_[numSlots - 1].clear();
+    }
+}
+
+
+// counting sort of the pending reference kmers into a single postings array
+void Database::buildCompact(kmerSize_t numSlots)
+{
+    kmerSize_t ignored = numSlots - 1;  // kmers containing non-ACGTU bases
+
+    // the sparse layout holds only the kmers which occur, found by sorting a copy of them all
+    size_t numEntries = numSlots;
+    if (layout_ == INDEX_SPARSE)
+    {
+        std::vector<kmerSize_t> occurring;
+        size_t numKmers = 0;
+        for (std::vector<std::vector<kmerSize_t> >::const_iterator seq=pending_.begin(); seq!=pending_.end(); ++seq)
+            numKmers += seq->size();
+        occurring.reserve(numKmers);
+        for (std::vector<std::vector<kmerSize_t> >::const_iterator seq=pending_.begin(); seq!=pending_.end(); ++seq)
+            for (std::vector<kmerSize_t>::const_iterator it=seq->begin(); it!=seq->end(); ++it)
+                if (*it != ignored)
+                    occurring.push_back(*it);
+        std::sort(occurring.begin(), occurring.end());
+        std::vector<kmerSize_t>(occurring.begin(), std::unique(occurring.begin(), occurring.end())).swap(kmers_);
+        std::vector<kmerSize_t>().swap(occurring);
+        indexDirectory();
+        numEntries = kmers_.size();
+        ignored = numSlots;             // no kmer, as the directory finds none for the non-ACGTU slot
+    }
+
+    // count the references for each kmer
+    std::vector<uint32_t>(numEntries + 1, 0).swap(offsets_);
+    uint64_t total = 0;
+    for (std::vector<std::vector<kmerSize_t> >::const_iterator seq=pending_.begin(); seq!=pending_.end(); ++seq)
+    {
+        for (std::vector<kmerSize_t>::const_iterator it=seq->begin(); it!=seq->end(); ++it)
+        {
+            size_t entry = entryOf(*it);
+            if (*it != ignored && entry != numEntries)
+            {
+                offsets_[entry]++;
+                total++;
+            }
+        }
+    }
+
+    if (total > 0xffffffffULL)
+    {
+        throw std::runtime_error("Too many kmers for a compact index");
+    }
+
+    // offsets_[i] becomes the start of kmer i
+    uint32_t start = 0;
+    for (size_t i=0; i<numEntries; i++)
+    {
+        uint32_t count = offsets_[i];
+        offsets_[i] = start;
+        start += count;
+    }
+    offsets_[numEntries] = start;
+
+    // place references in id order so each postings list is sorted,
+    // releasing the pending kmers as we go. Afterwards offsets_[i] is the end of kmer i
+    std::vector<unsigned int>(total).swap(postings_);
+    for (unsigned int id=0; id<pending_.size(); id++)
+    {
+        for (std::vector<kmerSize_t>::const_iterator it=pending_[id].begin(); it!=pending_[id].end(); ++it)
+        {
+            size_t entry = entryOf(*it);
+            if (*it != ignored && entry != numEntries)
+                postings_[offsets_[entry]++] = id;
+        }
+        std::vector<kmerSize_t>().swap(pending_[id]);
+    }
+    std::vector<std::vector<kmerSize_t> >().swap(pending_);
+
+    // shift back so that offsets_[i] is the start of kmer i
+    for (size_t i=numEntries; i>0; i--)
+        offsets_[i] = offsets_[i - 1];
+    offsets_[0] = 0;
+}
+
+
+void Database::makeSparse()
+{
+    std::vector<uint32_t> offsets;
+    kmers_.clear();
+    for (size_t kmer=0; kmer+1<offsets_.size(); kmer++)
+    {
+        if (offsets_[kmer + 1] > offsets_[kmer])
+        {
+            kmers_.push_back(kmer);
+            offsets.push_back(offsets_[kmer]);
+        }
+    }
+    offsets.push_back(postings_.size());
+    offsets_.swap(offsets);
+    layout_ = INDEX_SPARSE;
+    indexDirectory();
+}
+
+
+// directory_[p] is the first of kmers_ with prefix p, the prefixes being
+// the kmers shifted down until there are about as many as kmers_
+void Database::indexDirectory()
+{
+    uint64_t numSlots = (static_cast<uint64_t>(1) << (2 * kmerSize_)) + 1;
+    directoryShift_ = 0;
+    while ((numSlots >> directoryShift_) > std::max(static_cast<uint64_t>(kmers_.size()), static_cast<uint64_t>(1)))
+        directoryShift_++;
+
+    uint64_t numPrefixes = ((numSlots - 1) >> directoryShift_) + 1;
+    std::vector<uint32_t>(numPrefixes + 1, 0).swap(directory_);
+    for (std::vector<kmerSize_t>::const_iterator it=kmers_.begin(); it!=kmers_.end(); ++it)
+        directory_[(*it >> directoryShift_) + 1]++;
+    for (uint64_t p=1; p<=numPrefixes; p++)
+        directory_[p] += directory_[p - 1];
+}
+
+
+// the kmers with postings in this index alone
+void Database::occupiedKmers(std::vector<kmerSize_t>& kmers) const
+{
+    if (layout_ == INDEX_SPARSE)
+    {
+        kmers.insert(kmers.end(), kmers_.begin(), kmers_.end());
+        return;
+    }
+    for (size_t kmer=0; kmer<numEntries(); kmer++)
+        if (entryPostings(kmer).size())
+            kmers.push_back(kmer);
+}
+
+
 // thread that actually does the loading
-void Database::loadThread(FastaReader &reader, const Kmerizer& kmerizer)
+// a kept reference sequence
+std::string Database::sequence(unsigned int id) const
 {
-    DnaSequence seq;
-    while(seq = reader.readSequence())
-        addSequence(kmerizer.kmerize(seq));
+    return unpackSequence(sequences_[id], sequenceLengths_[id]);
+}
+
+
+//======================================================================
+// RegionJob struct
+// the region of each reference of a full index, worked out in parallel
+//======================================================================
+struct RegionJob
+{
+    struct Reference
+    {
+        bool found;
+        std::vector<kmerSize_t> kmers;
+        std::string region;
+        Reference() : found(false) {}
+    };
+
+    const Database& full;
+    const RegionExtractor& extractor;
+    const Kmerizer& kmerizer;
+    std::vector<Reference> references;
+
+    RegionJob(const Database& f, const RegionExtractor& e, const Kmerizer& k) :
+        full(f), extractor(e), kmerizer(k), references(f.numSequences()) {}
+
+    // the references first to last - 1, a task of its own
+    void run(unsigned int first, unsigned int last)
+    {
+        for (unsigned int id=first; id<last; id++)
+        {
+            Reference& ref = references[id];
+            if (!extractor.extract(full.sequence(id), ref.region))
+                continue;
+            ref.found = true;
+            kmerizer.kmerize(ref.region.data(), ref.region.size()).kmers.swap(ref.kmers);
+        }
+    }
+};
+
+
+// build the index of the region of each reference in full
+void Database::deriveRegion(const Database& full, const RegionExtractor& extractor, const Kmerizer& kmerizer,
+                            TaskScheduler& scheduler, IndexLayout layout)
+{
+    if (!full.hasSequences())
+    {
+        throw std::runtime_error("the index has no reference sequences, rebuild it with --keep-sequences");
+    }
+
+    ScopedTimer tim;
+    std::cerr << "Deriving region index from " << full.numSequences() << " reference sequences\n";
+
+    numSequences_ = 0;
+    numLevels_ = full.numLevels_;
+    kmerSize_ = kmerizer.kmerSize();
+    layout_ = layout;
+    keepSequences_ = true;
+    index_.clear();
+    offsets_.clear();
+    postings_.clear();
+    pending_.clear();
+    kmers_.clear();
+    directory_.clear();
+    weights_.clear();
+    sequences_.clear();
+    sequenceLengths_.clear();
+    segments_.clear();
+    segmentSequences_ = 0;
+    signatures_.reset();
+    groupMembers_.clear();
+    spill_.reset();
+    annotations_ = full.annotations_;
+    annotationIds_.assign(numLevels_, std::vector<unsigned int>());
+
+    if (layout_ == INDEX_DENSE)
+    {
+        try {
+            index_.resize(kmerizer.numKmers() + 1);
+        }
+        catch(std::bad_alloc&) {
+            throw std::runtime_error("Could not allocate memory for kmer size " + boost::lexical_cast<std::string>(kmerizer.kmerSize()));
+        }
+    }
+
+    static const unsigned int batchSize = 64;
+    RegionJob job(full, extractor, kmerizer);
+    for (unsigned int first=0; first<job.references.size(); first+=batchSize)
+        scheduler.submit(boost::bind(&RegionJob::run, &job, first, std::min<unsigned int>(first + batchSize, job.references.size())));
+    scheduler.wait();
+
+    // references are identical if they share their annotations and region kmers
+    std::map<std::vector<uint32_t>, unsigned int> distinct;
+    unsigned int numFound = 0;
+    bool collapsed = false;
+    for (unsigned int id=0; id<job.references.size(); id++)
+    {
+        RegionJob::Reference& ref = job.references[id];
+        if (!ref.found)
+            continue;
+        numFound++;
+
+        std::vector<uint32_t> key;
+        for (unsigned int i=0; i<numLevels_; i++)
+            key.push_back(full.annotationIds_[i][id]);
+        key.insert(key.end(), ref.kmers.begin(), ref.kmers.end());
+        std::sort(key.begin() + numLevels_, key.end());
+
+        std::map<std::vector<uint32_t>, unsigned int>::iterator it = distinct.find(key);
+        if (it != distinct.end())
+        {
+            weights_[it->second] += full.weight(id);
+            collapsed = true;
+        }
+        else
+        {
+            distinct.insert(std::make_pair(key, numSequences_));
+            for (unsigned int i=0; i<numLevels_; i++)
+                annotationIds_[i].push_back(full.annotationIds_[i][id]);
+            weights_.push_back(full.weight(id));
+            sequences_.push_back(packSequence(ref.region));
+            sequenceLengths_.push_back(ref.region.size());
+            addKmers(ref.kmers);
+        }
+        std::vector<kmerSize_t>().swap(ref.kmers);
+        std::string().swap(ref.region);
+    }
+
+    if (numSequences_ == 0)
+    {
+        throw std::runtime_error("no reference sequence contained the region");
+    }
+    if (!collapsed && full.weights_.empty())
+        weights_.clear();
+
+    finishIndex(kmerizer.numKmers() + 1);
+
+    std::cerr << numFound << " contained the region, " << numSequences_ << " distinct references kept ";
 }
 
 
@@ -126,8 +650,7 @@ void Database::parseHeader(const std::string& header)
 
     if (tabPositions.size() != numLevels_)
     {
-        std::cerr << "\nError: Invalid sequence header - incorrect number of taxonomic levels\n" << header << std::endl;
-        exit(EXIT_FAILURE);
+        throw std::runtime_error("Invalid sequence header - incorrect number of taxonomic levels\n" + header);
     }
 
     for (unsigned int i=0; i<tabPositions.size(); ++i)
@@ -157,39 +680,872 @@ void Database::parseHeader(const std::string& header)
 }
 
 
-searchHit Database::search(const KmerSequence& query)
+// add one to the score of each reference in a postings list
+static inline void scoreList(const PostingsList& seqList, unsigned int *scores, unsigned int& topScore)
 {
-    std::vector<unsigned int> scores(numSequences_, 0);
-    
-    unsigned int topScore = 0;
+    for (const unsigned int *it = seqList.begin; it != seqList.end; ++it)
+    {
+        if(++scores[*it] > topScore)
+            topScore = scores[*it];
+    }
+}
+
+// count the kmers of query in each reference of this index alone
+void Database::addScores(const KmerSequence& query, unsigned int *scores, unsigned int& topScore, ThreadStats *stats) const
+{
+    for (std::vector<kmerSize_t>::const_iterator it=query.kmers.begin(); it != query.kmers.end(); ++it)
+    {
+        PostingsList seqList = postings(*it);
+        scoreList(seqList, scores, topScore);
+        if (stats)
+            stats->postingsScanned += seqList.size();
+    }
+}
+
+
+// pruning costs a pass over every reference to find the candidates, so is
+// only tried if the postings to scan are this many times the references
+static const size_t pruneRatio = 4;
+
+// hierarchical searches scan the postings of kmers held by fewer than this
+// fraction of the references rather than search them group by group
+static const size_t rareRatio = 8;
+
+// first position in [begin, end) not less than id, galloping from begin
+static const unsigned int *gallop(const unsigned int *begin, const unsigned int *end, unsigned int id)
+{
+    size_t step = 1;
+    const unsigned int *low = begin;
+    while (begin + step < end && begin[step] < id)
+    {
+        low = begin + step;
+        step <<= 1;
+    }
+    return std::lower_bound(low, std::min(begin + step, end), id);
+}
+
+// Exact pruned scoring, in the manner of MaxScore. The kmers of a query are
+// unique, so a reference gains at most one from each kmer not yet scored.
+// The rarer kmers are scored first. Once the kmers left are fewer than the
+// top score, a reference not yet seen can not reach it, so only the
+// references already seen which can still reach or tie the top score are
+// kept as candidates, and each remaining postings list is searched for them
+// rather than scanned. Candidates are dropped as soon as they fall out of
+// reach. The top score and the references reaching it are as addScores
+// finds them, while every other reference ends with a lower, partial score
+void Database::addScoresPruned(const KmerSequence& query, unsigned int *scores, unsigned int& topScore, ThreadStats *stats) const
+{
+    std::vector<std::pair<size_t, kmerSize_t> > rarest;
+    rarest.reserve(query.kmers.size());
+    size_t total = 0;
     for (std::vector<kmerSize_t>::const_iterator it=query.kmers.begin(); it != query.kmers.end(); ++it)
     {
-        std::vector<unsigned int>* seqList = &index_[*it];
-        for (std::vector<unsigned int>::iterator it2 = seqList->begin(); it2 != seqList->end(); ++it2)
+        rarest.push_back(std::make_pair(postings(*it).size(), *it));
+        total += rarest.back().first;
+    }
+    if (total <= numSequences_ * pruneRatio)
+    {
+        addScores(query, scores, topScore, stats);
+        return;
+    }
+
+    // at least half the kmers are always scored in full, so it is enough to
+    // split off the rarer half rather than sort them
+    std::nth_element(rarest.begin(), rarest.begin() + rarest.size() / 2, rarest.end());
+
+    size_t k = 0;
+    for (; k<rarest.size() && rarest.size() - k >= topScore; k++)
+    {
+        scoreList(postings(rarest[k].second), scores, topScore);
+        if (stats)
+            stats->postingsScanned += rarest[k].first;
+    }
+    if (k == rarest.size())
+        return;
+
+    std::vector<unsigned int> candidates;
+    for (unsigned int id=0; id<numSequences_; id++)
+        if (scores[id] && scores[id] + rarest.size() - k >= topScore)
+            candidates.push_back(id);
+
+    for (; k<rarest.size(); k++)
+    {
+        PostingsList seqList = postings(rarest[k].second);
+        if (seqList.size() <= candidates.size())
+        {
+            // searching for more candidates than the list holds would cost more
+            // than scanning it. References which are out of reach gain too, but
+            // can still not reach the top score
+            scoreList(seqList, scores, topScore);
+            if (stats)
+                stats->postingsScanned += seqList.size();
+            continue;
+        }
+
+        const unsigned int *pos = seqList.begin;
+        for (std::vector<unsigned int>::const_iterator it=candidates.begin(); it!=candidates.end() && pos!=seqList.end; ++it)
+        {
+            pos = gallop(pos, seqList.end, *it);
+            if (pos != seqList.end && *pos == *it && ++scores[*it] > topScore)
+                topScore = scores[*it];
+        }
+        if (stats)
+            stats->postingsScanned += candidates.size();
+
+        // keep those which can still reach the top score with the kmers left
+        size_t kmersLeft = rarest.size() - k - 1;
+        std::vector<unsigned int>::iterator kept = candidates.begin();
+        for (std::vector<unsigned int>::const_iterator it=candidates.begin(); it!=candidates.end(); ++it)
+            if (scores[*it] + kmersLeft >= topScore)
+                *kept++ = *it;
+        candidates.erase(kept, candidates.end());
+    }
+}
+
+
+// Hierarchical scoring. A group can score no more than the number of query
+// kmers held by any of its members, which the group postings count. Groups
+// are refined in order of this bound, scoring their members exactly, until
+// the bound falls below the top score, so no reference reaching or tying it
+// is missed. Rare kmers are cheaper to scan once for every reference than
+// to search for group by group, so only the common ones are left to the
+// refinement. References of groups never refined keep a partial score
+void Database::addScoresGrouped(const KmerSequence& query, unsigned int *scores, unsigned int& topScore, ThreadStats *stats) const
+{
+    std::vector<unsigned int> bounds(groupMembers_.size(), 0);
+    std::vector<PostingsList> common;
+    for (std::vector<kmerSize_t>::const_iterator it=query.kmers.begin(); it != query.kmers.end(); ++it)
+    {
+        PostingsList seqList = postings(*it);
+        if (seqList.size() * rareRatio <= numSequences_)
+        {
+            scoreList(seqList, scores, topScore);
+            if (stats)
+                stats->postingsScanned += seqList.size();
+            continue;
+        }
+        common.push_back(seqList);
+
+        // a common kmer always has an entry
+        size_t entry = entryOf(*it);
+        const unsigned int *begin = &groupPostings_[0];
+        for (const unsigned int *g = begin + groupOffsets_[entry]; g != begin + groupOffsets_[entry + 1]; ++g)
+            bounds[*g]++;
+        if (stats)
+            stats->postingsScanned += groupOffsets_[entry + 1] - groupOffsets_[entry];
+    }
+    if (common.empty())
+        return;
+
+    // the rare kmers may add to any group, by no more than they add to its best member
+    std::vector<unsigned int> rareBest(groupMembers_.size(), 0);
+    for (unsigned int id=0; id<numSequences_; id++)
+        if (scores[id] > rareBest[groupOf_[id]])
+            rareBest[groupOf_[id]] = scores[id];
+
+    std::vector<std::pair<unsigned int, unsigned int> > order;
+    for (unsigned int g=0; g<bounds.size(); g++)
+        if (bounds[g] + rareBest[g] >= topScore)
+            order.push_back(std::make_pair(bounds[g] + rareBest[g], g));
+    std::sort(order.begin(), order.end());
+
+    for (std::vector<std::pair<unsigned int, unsigned int> >::reverse_iterator group=order.rbegin(); group!=order.rend(); ++group)
+    {
+        if (group->first < topScore)
+            break;
+
+        const std::vector<unsigned int>& members = groupMembers_[group->second];
+        for (std::vector<PostingsList>::const_iterator list=common.begin(); list!=common.end(); ++list)
         {
-            if(++scores[*it2] > topScore)
-                topScore = scores[*it2];
+            const unsigned int *pos = list->begin;
+            for (std::vector<unsigned int>::const_iterator it=members.begin(); it!=members.end() && pos!=list->end; ++it)
+            {
+                pos = gallop(pos, list->end, *it);
+                if (pos != list->end && *pos == *it && ++scores[*it] > topScore)
+                    topScore = scores[*it];
+            }
         }
+        if (stats)
+            stats->postingsScanned += members.size() * common.size();
+    }
+}
+
+
+unsigned int Database::buildGroups(unsigned int level)
+{
+    groupMembers_.clear();
+    if (!numSequences_ || !segments_.empty())
+        return 0;
+
+    groupOf_.assign(numSequences_, 0);
+    std::map<unsigned int, unsigned int> groups;
+    for (unsigned int id=0; id<numSequences_; id++)
+    {
+        std::map<unsigned int, unsigned int>::iterator it = groups.insert(std::make_pair(annotationIds_[level][id], groups.size())).first;
+        if (it->second == groupMembers_.size())
+            groupMembers_.push_back(std::vector<unsigned int>());
+        groupMembers_[it->second].push_back(id);
+        groupOf_[id] = it->second;
+    }
+
+    // a kmer's postings are in reference order, so its groups are collected
+    // using the last kmer each group was seen for, then sorted
+    // the group postings are held for each kmer as the postings are, see entryOf
+    size_t numSlots = numEntries();
+    std::vector<size_t> lastSeen(groupMembers_.size(), numSlots);
+    groupOffsets_.clear();
+    groupPostings_.clear();
+    groupOffsets_.reserve(numSlots + 1);
+    for (size_t entry=0; entry<numSlots; entry++)
+    {
+        groupOffsets_.push_back(groupPostings_.size());
+        PostingsList seqList = entryPostings(entry);
+        for (const unsigned int *it = seqList.begin; it != seqList.end; ++it)
+        {
+            unsigned int g = groupOf_[*it];
+            if (lastSeen[g] != entry)
+            {
+                lastSeen[g] = entry;
+                groupPostings_.push_back(g);
+            }
+        }
+        std::sort(groupPostings_.begin() + groupOffsets_.back(), groupPostings_.end());
+    }
+    groupOffsets_.push_back(groupPostings_.size());
+    return groupMembers_.size();
+}
+
+
+void Database::setApproximate(const ApproximateOptions& options)
+{
+    approximate_ = options;
+    maxPostings_ = static_cast<size_t>(options.commonKmers * numSequences());
+    sampleThreshold_ = static_cast<uint64_t>(options.sampleKmers * 4294967296.0);
+}
+
+// the sampled kmers are the same for every query, so that a kmer is either
+// always searched or never, and scores stay comparable between queries
+void Database::reduceQuery(KmerSequence& query) const
+{
+    std::vector<kmerSize_t> kept;
+    kept.reserve(query.kmers.size());
+    for (std::vector<kmerSize_t>::const_iterator it=query.kmers.begin(); it != query.kmers.end(); ++it)
+    {
+        if (static_cast<uint32_t>(*it * 2654435761u) >= sampleThreshold_)
+            continue;
+
+        size_t count = postings(*it).size();
+        for (unsigned int s=0; s<segments_.size(); s++)
+            count += segments_[s]->postings(*it).size();
+        if (count <= maxPostings_)
+            kept.push_back(*it);
     }
+
+    if (!kept.empty())
+        query.kmers.swap(kept);
+}
+
+
+searchHit Database::search(const KmerSequence& query, ThreadStats *stats) const
+{
+    if (shards_)
+        return shards_->search(query, stats);
+    if (signatures_ && segments_.empty())
+        return searchSignatures(query, stats);
+
+    std::vector<unsigned int> scores(numSequences(), 0);
+    
+    // segments score into the part of scores following the references before them
+    unsigned int topScore = 0;
+    unsigned int start = numSequences_;
+    if (prune_ && segments_.empty() && !groupMembers_.empty())
+        addScoresGrouped(query, &scores[0], topScore, stats);
+    else if (prune_ && segments_.empty())
+        addScoresPruned(query, &scores[0], topScore, stats);
+    else
+        addScores(query, &scores[0], topScore, stats);
+    for (unsigned int s=0; s<segments_.size(); s++)
+    {
+        segments_[s]->addScores(query, &scores[start], topScore, stats);
+        start += segments_[s]->numSequences_;
+    }
+
     searchHit hit;
     hit.annotationIds.resize(numLevels_);
 
     std::vector<unsigned int>::iterator searchIt=scores.begin();
 
+    // the index or segment holding the current reference, and its first id
+    const Database *owner = this;
+    unsigned int segment = 0;
+    start = 0;
     while((searchIt = std::find(searchIt, scores.end(), topScore)) != scores.end())
     {
-        int id = std::distance(scores.begin(), searchIt);
+        unsigned int id = std::distance(scores.begin(), searchIt);
+        while (id >= start + owner->numSequences_)
+        {
+            start += owner->numSequences_;
+            owner = segments_[segment++].get();
+        }
+        id -= start;
         for(unsigned int i=0; i<numLevels_; i++)
-            hit.annotationIds[i].push_back(annotationIds_[i][id]);
+            hit.annotationIds[i].insert(hit.annotationIds[i].end(), owner->weight(id), owner->annotationIds_[i][id]);
         ++searchIt;
     }
 
+    hit.topScore = topScore;
     hit.score = static_cast<float>(topScore) / static_cast<float>(query.kmers.size());
+
+    if (stats)
+    {
+        stats->searches++;
+        stats->candidatesTouched += scores.size() - std::count(scores.begin(), scores.end(), 0);
+        stats->tieSizes.add(hit.annotationIds[0].size());
+    }
     return hit;
 }
 
 
+// as search, counting in the bit matrix
+searchHit Database::searchSignatures(const KmerSequence& query, ThreadStats *stats) const
+{
+    std::vector<unsigned int> best;
+    unsigned int topScore;
+    uint64_t touched;
+    signatures_->search(query.kmers, best, topScore, stats ? &touched : NULL);
+
+    searchHit hit;
+    hit.annotationIds.resize(numLevels_);
+    for (std::vector<unsigned int>::const_iterator it=best.begin(); it!=best.end(); ++it)
+        for(unsigned int i=0; i<numLevels_; i++)
+            hit.annotationIds[i].insert(hit.annotationIds[i].end(), weight(*it), annotationIds_[i][*it]);
+
+    hit.topScore = topScore;
+    hit.score = static_cast<float>(topScore) / static_cast<float>(query.kmers.size());
+
+    if (stats)
+    {
+        stats->searches++;
+        stats->candidatesTouched += touched;
+        stats->tieSizes.add(hit.annotationIds[0].size());
+    }
+    return hit;
+}
+
+
+SearchEngine parseSearchEngine(const std::string& name)
+{
+    if (name == "auto")
+        return ENGINE_AUTO;
+    if (name == "postings")
+        return ENGINE_POSTINGS;
+    if (name == "bitmatrix")
+        return ENGINE_BITMATRIX;
+    throw std::invalid_argument("unknown search engine " + name + ", expected auto, postings or bitmatrix");
+}
+
+std::string Database::signatureFileName(const std::string& fileName)
+{
+    return fileName + ".bits";
+}
+
+void Database::buildSignatures()
+{
+    uint64_t numSlots = summary().numSlots;
+    boost::shared_ptr<BitMatrix> signatures(new BitMatrix);
+    try {
+        signatures->reset(numSlots, numSequences_);
+    }
+    catch(std::bad_alloc&) {
+        throw std::runtime_error("Could not allocate memory for the bit matrix");
+    }
+
+    for (kmerSize_t kmer=0; kmer<numSlots; kmer++)
+    {
+        PostingsList seqList = postings(kmer);
+        for (const unsigned int *it = seqList.begin; it != seqList.end; ++it)
+            signatures->set(kmer, *it);
+    }
+    signatures_ = signatures;
+}
+
+// the matrix follows the summary and fingerprint of the index it was built from
+void Database::saveSignatures(const std::string& fileName) const
+{
+    std::ofstream ofs(fileName.c_str());
+    boost::archive::binary_oarchive oa(ofs);
+    uint32_t magic = SIGNATURE_FILE_MAGIC;
+    IndexSummary indexSummary = summary();
+    uint64_t indexFingerprint = fingerprint();
+    save_to(oa, magic);
+    save_to(oa, indexSummary);
+    save_to(oa, indexFingerprint);
+    save_to(oa, *signatures_);
+}
+
+bool Database::loadSignatures(const std::string& fileName)
+{
+    std::ifstream ifs(fileName.c_str());
+    if (!ifs.is_open())
+        return false;
+
+    try {
+        boost::archive::binary_iarchive ia(ifs);
+        uint32_t magic;
+        IndexSummary stored, current = summary();
+        ia >> magic;
+        if (magic != SIGNATURE_FILE_MAGIC)
+            return false;
+        ia >> stored;
+        if (stored.kmerSize != current.kmerSize || stored.numSequences != current.numSequences ||
+            stored.numSlots != current.numSlots || stored.numPostings != current.numPostings)
+            return false;
+
+        // the same counts can come from other references
+        uint64_t storedFingerprint;
+        ia >> storedFingerprint;
+        if (storedFingerprint != fingerprint())
+            return false;
+
+        boost::shared_ptr<BitMatrix> signatures(new BitMatrix);
+        ia >> *signatures;
+        signatures_ = signatures;
+    }
+    catch (boost::archive::archive_exception &) {
+        return false;
+    }
+    return true;
+}
+
+uint64_t Database::signatureBytes(const IndexSummary& summary)
+{
+    return BitMatrix::bytes(summary.numSlots, summary.numSequences);
+}
+
+bool Database::preferSignatures(const IndexSummary& summary)
+{
+    return summary.numSequences > 0 && signatureBytes(summary) <= 2 * summary.numPostings * sizeof(unsigned int);
+}
+
+
 const std::string& Database::annotationFromId(const unsigned int id) const
 {
     return annotations_[id];
 }
+
+
+// read a cached index
+void Database::loadIndex(const std::string& fileName, IndexLayout layout)
+{
+    std::ifstream ifs(fileName.c_str());
+    boost::archive::binary_iarchive ia(ifs);
+
+    IndexSummary fileSummary;
+    ia >> fileSummary;
+    if (fileSummary.magic != INDEX_FILE_MAGIC)
+        throw boost::archive::archive_exception(boost::archive::archive_exception::unsupported_version);
+
+    layout_ = layout;
+    signatures_.reset();
+    ia >> *this;
+}
+
+
+// write the index, preceded by its summary
+void Database::saveIndex(const std::string& fileName) const
+{
+    std::ofstream ofs(fileName.c_str());
+    boost::archive::binary_oarchive oa(ofs);
+    IndexSummary indexSummary = summary();
+    save_to(oa, indexSummary);
+    save_to(oa, *this);
+}
+
+
+// read only the summary from the start of an index file
+bool Database::readSummary(const std::string& fileName, IndexSummary& summary)
+{
+    try {
+        std::ifstream ifs(fileName.c_str());
+        boost::archive::binary_iarchive ia(ifs);
+        ia >> summary;
+    }
+    catch (boost::archive::archive_exception &) {
+        return false;
+    }
+    return summary.magic == INDEX_FILE_MAGIC;
+}
+
+
+// name of the nth delta segment of an index, counting from 1
+std::string Database::segmentFileName(const std::string& fileName, unsigned int segment)
+{
+    std::ostringstream s;
+    s << fileName << "." << segment;
+    return s.str();
+}
+
+
+// segments are numbered without gaps, so the first missing one ends them
+unsigned int Database::countSegments(const std::string& fileName)
+{
+    unsigned int count = 0;
+    while (std::ifstream(segmentFileName(fileName, count + 1).c_str()).good())
+        count++;
+    return count;
+}
+
+
+// add the sizes of an index's segments to its summary
+void Database::addSegmentSummaries(const std::string& fileName, IndexSummary& summary)
+{
+    unsigned int count = countSegments(fileName);
+    for (unsigned int n=1; n<=count; n++)
+    {
+        IndexSummary segment;
+        if (!readSummary(segmentFileName(fileName, n), segment))
+            continue;
+        summary.numSequences += segment.numSequences;
+        summary.numPostings += segment.numPostings;
+        summary.annotationBytes += segment.annotationBytes;
+
+        // each segment has its own kmer slots
+        summary.numSlots += segment.numSlots;
+    }
+}
+
+
+// load the segments of an index, mapping their annotations into this one's
+unsigned int Database::loadSegments(const std::string& fileName, IndexLayout layout)
+{
+    segments_.clear();
+    segmentSequences_ = 0;
+    signatures_.reset();
+    groupMembers_.clear();
+
+    std::map<std::string, unsigned int> annotationIds;
+    for (unsigned int id=0; id<annotations_.size(); id++)
+        annotationIds.insert(std::make_pair(annotations_[id], id));
+
+    unsigned int count = countSegments(fileName);
+    for (unsigned int n=1; n<=count; n++)
+    {
+        std::string segmentFile = segmentFileName(fileName, n);
+        boost::shared_ptr<Database> segment(new Database);
+        segment->setKeepSequences(keepSequences_);
+        segment->loadIndex(segmentFile, layout);
+
+        if (segment->kmerSize_ != kmerSize_ || segment->numLevels_ != numLevels_)
+        {
+            throw std::runtime_error("segment " + segmentFile + " does not match its index");
+        }
+
+        std::vector<unsigned int> mapping(segment->annotations_.size());
+        for (unsigned int id=0; id<mapping.size(); id++)
+        {
+            const std::string& annotation = segment->annotations_[id];
+            std::map<std::string, unsigned int>::iterator it = annotationIds.find(annotation);
+            if (it == annotationIds.end())
+            {
+                it = annotationIds.insert(std::make_pair(annotation, annotations_.size())).first;
+                annotations_.push_back(annotation);
+            }
+            mapping[id] = it->second;
+        }
+        for (unsigned int i=0; i<numLevels_; i++)
+            for (std::vector<unsigned int>::iterator it=segment->annotationIds_[i].begin(); it!=segment->annotationIds_[i].end(); ++it)
+                *it = mapping[*it];
+        std::vector<std::string>().swap(segment->annotations_);
+
+        segmentSequences_ += segment->numSequences_;
+        segments_.push_back(segment);
+    }
+    return count;
+}
+
+
+// search the shards of an index held by servers
+void Database::connectShards(const std::string& dbFilename, unsigned int kmerSize, const std::vector<std::string>& sockets)
+{
+    shards_.reset(new ShardClient(dbFilename, kmerSize, sockets));
+    kmerSize_ = kmerSize;
+    numLevels_ = shards_->numLevels();
+    numSequences_ = shards_->numSequences();
+    annotations_ = shards_->annotations();
+}
+
+
+// fold the loaded segments into this index
+void Database::compact()
+{
+    if (segments_.empty())
+        return;
+
+    bool sequences = hasSequences() || numSequences_ == 0;
+    bool weighted = !weights_.empty();
+    for (unsigned int s=0; s<segments_.size(); s++)
+    {
+        sequences = sequences && segments_[s]->hasSequences();
+        weighted = weighted || !segments_[s]->weights_.empty();
+    }
+    if (weighted)
+        weights_.resize(numSequences_, 1);
+    if (!sequences)
+    {
+        sequences_.clear();
+        sequenceLengths_.clear();
+    }
+
+    // the postings of each kmer, followed by those of each segment in turn. The
+    // sparse layout only visits the kmers which occur in the index or a segment
+    size_t numKmers = numEntries();
+    std::vector<kmerSize_t> occurring;
+    if (layout_ == INDEX_SPARSE)
+    {
+        occupiedKmers(occurring);
+        for (unsigned int s=0; s<segments_.size(); s++)
+            segments_[s]->occupiedKmers(occurring);
+        std::sort(occurring.begin(), occurring.end());
+        occurring.erase(std::unique(occurring.begin(), occurring.end()), occurring.end());
+        numKmers = occurring.size();
+    }
+
+    std::vector<uint32_t> offsets;
+    std::vector<unsigned int> merged;
+    if (layout_ != INDEX_DENSE)
+    {
+        uint64_t total = postings_.size();
+        for (unsigned int s=0; s<segments_.size(); s++)
+            total += segments_[s]->postings_.size();
+        if (total > 0xffffffffULL)
+        {
+            throw std::runtime_error("Too many kmers for a compact index");
+        }
+        offsets.reserve(numKmers + 1);
+        merged.reserve(total);
+    }
+
+    for (size_t i=0; i<numKmers; i++)
+    {
+        kmerSize_t kmer = layout_ == INDEX_SPARSE ? occurring[i] : i;
+        PostingsList list = postings(kmer);
+        if (layout_ != INDEX_DENSE)
+        {
+            offsets.push_back(merged.size());
+            merged.insert(merged.end(), list.begin, list.end);
+        }
+
+        unsigned int start = numSequences_;
+        for (unsigned int s=0; s<segments_.size(); s++)
+        {
+            PostingsList segmentList = segments_[s]->postings(kmer);
+            for (const unsigned int *it=segmentList.begin; it!=segmentList.end; ++it)
+            {
+                if (layout_ != INDEX_DENSE)
+                    merged.push_back(*it + start);
+                else
+                    index_[kmer].push_back(*it + start);
+            }
+            start += segments_[s]->numSequences_;
+        }
+    }
+    if (layout_ != INDEX_DENSE)
+    {
+        offsets.push_back(merged.size());
+        offsets_.swap(offsets);
+        postings_.swap(merged);
+    }
+    if (layout_ == INDEX_SPARSE)
+    {
+        kmers_.swap(occurring);
+        indexDirectory();
+    }
+
+    for (unsigned int s=0; s<segments_.size(); s++)
+    {
+        Database& segment = *segments_[s];
+        for (unsigned int i=0; i<numLevels_; i++)
+            annotationIds_[i].insert(annotationIds_[i].end(), segment.annotationIds_[i].begin(), segment.annotationIds_[i].end());
+        if (weighted)
+            for (unsigned int id=0; id<segment.numSequences_; id++)
+                weights_.push_back(segment.weight(id));
+        if (sequences)
+        {
+            sequences_.insert(sequences_.end(), segment.sequences_.begin(), segment.sequences_.end());
+            sequenceLengths_.insert(sequenceLengths_.end(), segment.sequenceLengths_.begin(), segment.sequenceLengths_.end());
+        }
+        numSequences_ += segment.numSequences_;
+        segments_[s].reset();
+    }
+    segments_.clear();
+    segmentSequences_ = 0;
+    signatures_.reset();
+    groupMembers_.clear();
+}
+
+
+// quick pass over a fasta database, recording only sequence lengths
+ReferenceScan Database::scanReferences(const std::string& fileName)
+{
+    FastaReader reader(fileName);
+    return scanReferences(reader);
+}
+
+ReferenceScan Database::scanReferences(SequenceSource& reader)
+{
+    ReferenceScan scan;
+    DnaSequence seq;
+    while(seq = reader.readSequence())
+    {
+        if (scan.lengths.empty())
+            scan.numLevels = std::count(seq.header.begin(), seq.header.end(), '\t');
+        scan.headerBytes += seq.header.size();
+        scan.lengths.push_back(seq.sequence.size());
+    }
+    return scan;
+}
+
+
+// pick the fastest layout which fits within the budget
+IndexLayout Database::chooseLayout(const IndexSummary& summary, uint64_t budget, uint64_t otherBytes, bool building)
+{
+    // the sparse layout is then also the smallest
+    if (preferSparse(summary))
+    {
+        uint64_t bytes = building ? summary.buildBytes(INDEX_SPARSE) : summary.indexBytes(INDEX_SPARSE);
+        return budget == 0 || bytes + summary.annotationTableBytes() + otherBytes <= budget ? INDEX_SPARSE : INDEX_NONE;
+    }
+    if (budget == 0)
+        return INDEX_DENSE;
+
+    static const IndexLayout layouts[] = {INDEX_DENSE, INDEX_COMPACT, INDEX_SPARSE};
+    for (unsigned int i=0; i<3; i++)
+    {
+        uint64_t bytes = building ? summary.buildBytes(layouts[i]) : summary.indexBytes(layouts[i]);
+        if (bytes + summary.annotationTableBytes() + otherBytes <= budget)
+            return layouts[i];
+    }
+    return INDEX_NONE;
+}
+
+
+bool Database::preferSparse(const IndexSummary& summary)
+{
+    return summary.numPostings * 4 < summary.numSlots;
+}
+
+// below this the dense slots take less than 24M
+bool Database::sparseCandidate(unsigned int kmerSize)
+{
+    return kmerSize >= 10;
+}
+
+
+uint64_t Database::fingerprint() const
+{
+    uint64_t counts[] = {kmerSize_, static_cast<uint64_t>(numSequences()), numLevels_};
+    uint64_t hash = hashBytes(counts, sizeof(counts), 0);
+    for (std::vector<std::string>::const_iterator it=annotations_.begin(); it!=annotations_.end(); ++it)
+        hash = hashBytes(it->data(), it->size(), hash);
+    for (std::vector<std::vector<unsigned int> >::const_iterator it=annotationIds_.begin(); it!=annotationIds_.end(); ++it)
+        if (!it->empty())
+            hash = hashBytes(&(*it)[0], it->size() * sizeof(unsigned int), hash);
+    if (!weights_.empty())
+        hash = hashBytes(&weights_[0], weights_.size() * sizeof(uint32_t), hash);
+    if (!sequenceLengths_.empty())
+        hash = hashBytes(&sequenceLengths_[0], sequenceLengths_.size() * sizeof(uint32_t), hash);
+
+    hash = hashPostings(hash);
+    for (std::vector<boost::shared_ptr<Database> >::const_iterator it=segments_.begin(); it!=segments_.end(); ++it)
+        hash = (*it)->hashPostings(hash);
+    return hash;
+}
+
+// each kmer which occurs and the references holding it, in kmer order
+uint64_t Database::hashPostings(uint64_t hash) const
+{
+    for (size_t entry=0; entry<numEntries(); entry++)
+    {
+        PostingsList list = entryPostings(entry);
+        if (!list.size())
+            continue;
+        kmerSize_t kmer = layout_ == INDEX_SPARSE ? kmers_[entry] : entry;
+        hash = hashBytes(&kmer, sizeof(kmer), hash);
+        hash = hashBytes(list.begin, list.size() * sizeof(unsigned int), hash);
+    }
+    return hash;
+}
+
+
+// sizes of the loaded index
+IndexSummary Database::summary() const
+{
+    IndexSummary summary;
+    summary.kmerSize = kmerSize_;
+    summary.layout = layout_;
+    summary.numSequences = numSequences_;
+    summary.numLevels = numLevels_;
+    if (spill_)
+    {
+        summary.numSlots = spill_->numSlots();
+        summary.numPostings = spill_->numPairs();
+    }
+    else if (layout_ == INDEX_SPARSE)
+    {
+        summary.numSlots = (static_cast<uint64_t>(1) << (2 * kmerSize_)) + 1;
+        summary.numPostings = postings_.size();
+    }
+    else if (layout_ == INDEX_COMPACT)
+    {
+        summary.numSlots = offsets_.empty() ? 0 : offsets_.size() - 1;
+        summary.numPostings = postings_.size();
+    }
+    else
+    {
+        summary.numSlots = index_.size();
+        for (std::deque<std::vector<unsigned int> >::const_iterator it=index_.begin(); it!=index_.end(); ++it)
+            summary.numPostings += it->size();
+    }
+    for (std::vector<std::string>::const_iterator it=annotations_.begin(); it!=annotations_.end(); ++it)
+        summary.annotationBytes += sizeof(std::string) + it->size();
+
+    return summary;
+}
+
+
+// measured memory use of the index and annotation tables
+MemoryEstimate Database::memoryUsage() const
+{
+    MemoryEstimate usage;
+    usage.index = index_.size() * sizeof(std::vector<unsigned int>);
+    for (std::deque<std::vector<unsigned int> >::const_iterator it=index_.begin(); it!=index_.end(); ++it)
+        usage.index += it->capacity() * sizeof(unsigned int);
+    usage.index += offsets_.capacity() * sizeof(uint32_t) + postings_.capacity() * sizeof(unsigned int);
+    usage.index += kmers_.capacity() * sizeof(kmerSize_t) + directory_.capacity() * sizeof(uint32_t);
+    if (spill_)
+        usage.index += spill_->memoryUsage();
+    if (signatures_)
+        usage.index += signatures_->memoryUsage();
+    usage.index += groupOffsets_.capacity() * sizeof(uint32_t) + (groupPostings_.capacity() + groupOf_.capacity()) * sizeof(unsigned int);
+    for (std::vector<std::vector<unsigned int> >::const_iterator it=groupMembers_.begin(); it!=groupMembers_.end(); ++it)
+        usage.index += it->capacity() * sizeof(unsigned int);
+
+    for (std::vector<std::string>::const_iterator it=annotations_.begin(); it!=annotations_.end(); ++it)
+        usage.annotations += sizeof(std::string) + it->capacity();
+    for (std::vector<std::vector<unsigned int> >::const_iterator it=annotationIds_.begin(); it!=annotationIds_.end(); ++it)
+        usage.annotations += it->capacity() * sizeof(unsigned int);
+    usage.annotations += weights_.capacity() * sizeof(uint32_t);
+
+    for (std::vector<std::string>::const_iterator it=sequences_.begin(); it!=sequences_.end(); ++it)
+        usage.annotations += sizeof(std::string) + it->capacity();
+    usage.annotations += sequenceLengths_.capacity() * sizeof(uint32_t);
+
+    for (std::vector<boost::shared_ptr<Database> >::const_iterator it=segments_.begin(); it!=segments_.end(); ++it)
+    {
+        MemoryEstimate segment = (*it)->memoryUsage();
+        usage.index += segment.index;
+        usage.annotations += segment.annotations;
+    }
+
+    return usage;
+}
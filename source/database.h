@@ -24,24 +24,67 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // STL includes
 #include <vector>
 #include <deque>
+#include <algorithm>
+#include <string>
+#include <stdint.h>
 
 // support files
 #include "kmerizer.h"
 #include "fasta.h"
+#include "stats.h"
+#include "memory.h"
+#include "bitmatrix.h"
+#include "scheduler.h"
+#include "spill.h"
+
+class RegionExtractor;
+class ShardClient;
 
 // serialization support
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/serialization/vector.hpp>
 #include <boost/serialization/deque.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/split_member.hpp>
 
 // threading
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
 
 // increment this if the database format changes
-#define DATABASE_FILE_VERSION 1
+#define DATABASE_FILE_VERSION 4
+
+// oldest format that can still be read
+#define DATABASE_FILE_MIN_VERSION 2
+
+// identifies the summary block at the start of an index file
+#define INDEX_FILE_MAGIC 0x53504958
+
+// in-memory representation of the kmer index
+enum IndexLayout
+{
+    INDEX_NONE = -1,        // no layout fits the memory budget
+    INDEX_DENSE = 0,        // one growable vector per kmer
+    INDEX_COMPACT = 1,      // single postings array with per-kmer offsets
+    INDEX_SPARSE = 2        // as compact, with offsets for the kmers which occur only
+};
+
+// search engine for a loaded index
+enum SearchEngine
+{
+    ENGINE_AUTO,            // the bit matrix if the index is dense enough, see Database::preferSignatures
+    ENGINE_POSTINGS,        // walk the postings lists
+    ENGINE_BITMATRIX        // count in the bit matrix, see bitmatrix.h
+};
+
+// parse "auto", "postings" or "bitmatrix", throws std::invalid_argument
+SearchEngine parseSearchEngine(const std::string& name);
+
+// identifies a bit matrix file, holding the fingerprint of its index
+#define SIGNATURE_FILE_MAGIC 0x5350424e
 
 //======================================================================
 // searchHit struct
@@ -50,10 +93,96 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 struct searchHit
 {
     float score;                            // similarity score
+    unsigned int topScore;                  // kmers shared with the best hits
     std::vector<std::vector<unsigned int> > annotationIds;  // annotations associated with this hit
 };
 
 
+//======================================================================
+// ApproximateOptions struct
+// settings for approximate searches, which trade some accuracy for speed
+// by searching only some of the kmers of each query
+//======================================================================
+struct ApproximateOptions
+{
+    double commonKmers;     // skip kmers found in more than this fraction of the references
+    double sampleKmers;     // fraction of the remaining kmers searched, picked by hashing the kmer
+
+    ApproximateOptions() : commonKmers(1.0), sampleKmers(1.0) {}
+    bool enabled() const { return commonKmers < 1.0 || sampleKmers < 1.0; }
+};
+
+
+//======================================================================
+// PostingsList struct
+// the references containing a single kmer, in ascending order
+//======================================================================
+struct PostingsList
+{
+    const unsigned int *begin;
+    const unsigned int *end;
+
+    size_t size() const { return end - begin; }
+};
+
+
+//======================================================================
+// IndexSummary struct
+// sizes describing an index, stored at the start of each index file
+// so that memory requirements are known before it is loaded
+//======================================================================
+struct IndexSummary
+{
+    uint32_t magic;
+    uint32_t kmerSize;
+    int32_t layout;
+    uint64_t numSequences;
+    uint64_t numLevels;
+    uint64_t numSlots;              // kmer slots, including the non-ACGTU slot
+    uint64_t numPostings;           // total references over all kmers
+    uint64_t annotationBytes;       // total length of the annotation strings
+
+    IndexSummary() : magic(INDEX_FILE_MAGIC), kmerSize(0), layout(INDEX_DENSE), numSequences(0),
+                     numLevels(0), numSlots(0), numPostings(0), annotationBytes(0) {}
+
+    // memory needed once loaded, and while being built from fasta
+    uint64_t indexBytes(IndexLayout layout) const;
+    uint64_t buildBytes(IndexLayout layout) const;
+    uint64_t annotationTableBytes() const;
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+        ar & magic;
+        ar & kmerSize;
+        ar & layout;
+        ar & numSequences;
+        ar & numLevels;
+        ar & numSlots;
+        ar & numPostings;
+        ar & annotationBytes;
+    }
+};
+
+
+//======================================================================
+// ReferenceScan struct
+// a quick pass over a fasta database, used to estimate the cost of
+// indexing it at any kmer size without building the index
+//======================================================================
+struct ReferenceScan
+{
+    uint64_t numLevels;
+    uint64_t headerBytes;
+    std::vector<uint32_t> lengths;  // length of each reference sequence
+
+    ReferenceScan() : numLevels(0), headerBytes(0) {}
+
+    // upper bound on the index summary for a kmer size
+    IndexSummary estimate(unsigned int kmerSize) const;
+};
+
+
 //======================================================================
 // Database class
 // searchable database indexed by kmer
@@ -63,51 +192,418 @@ class Database
 private:
     unsigned int numSequences_;                 // total number of sequences in the database
     unsigned int numLevels_;                    // number of taxonomic levels
+    unsigned int kmerSize_;                     // kmer size used to build the index
+    IndexLayout layout_;                        // representation of the kmer index
 
     void parseHeader(const std::string& header);// parse and store sequence header
 
-    std::deque<std::vector<unsigned int> > index_; // main kmer index
+    std::deque<std::vector<unsigned int> > index_; // main kmer index (dense layout)
+
+    std::vector<uint32_t> offsets_;             // start of each kmer's postings (compact and sparse layouts)
+    std::vector<unsigned int> postings_;        // concatenated postings (compact and sparse layouts)
+    std::vector<std::vector<kmerSize_t> > pending_; // kmers awaiting a compact or sparse build
+
+    // the kmers which occur, in order, whose offsets the sparse layout holds,
+    // and the first of them with each prefix of the kmer, see indexDirectory
+    std::vector<kmerSize_t> kmers_;
+    std::vector<uint32_t> directory_;
+    unsigned int directoryShift_;
     
     std::vector<std::string> annotations_;
     std::vector<std::vector<unsigned int> > annotationIds_;
+
+    // references standing for several identical ones, empty if there are none
+    std::vector<uint32_t> weights_;
+
+    // reference sequences, packed two bases to a byte, if kept
+    bool keepSequences_;
+    std::vector<std::string> sequences_;
+    std::vector<uint32_t> sequenceLengths_;
+
+    // delta segments added to this index, searched along with it. Their
+    // references follow this index's, and their annotation ids are mapped
+    // into this index's annotation table when they are loaded
+    std::vector<boost::shared_ptr<Database> > segments_;
+    unsigned int segmentSequences_;
+
+    // shard servers searched instead of a loaded index, if connected
+    boost::shared_ptr<ShardClient> shards_;
+
+    // the kmers of an index built on disk, merged into its postings only as
+    // it is saved. Set up by load if a directory is given for them
+    boost::shared_ptr<KmerSpill> spill_;
+    std::string spillDirectory_;
+    uint64_t spillMemory_;
    
     // serialization
     friend class boost::serialization::access;
     template<class Archive>
-    void serialize(Archive & ar, const unsigned int version)
+    void save(Archive & ar, const unsigned int version) const
     {
-        if(version != DATABASE_FILE_VERSION)
+        int32_t layout = layout_;
+        ar & kmerSize_;
+        ar & layout;
+        ar & numSequences_;
+        ar & numLevels_;
+        ar & annotations_;
+        ar & annotationIds_;
+
+        if (spill_ && layout_ == INDEX_COMPACT)
+        {
+            spill_->saveCompact(ar);
+        }
+        else if (spill_ && layout_ == INDEX_SPARSE)
+        {
+            spill_->saveSparse(ar);
+        }
+        else if (layout_ == INDEX_COMPACT)
+        {
+            ar & offsets_;
+            ar & postings_;
+        }
+        else if (layout_ == INDEX_SPARSE)
+        {
+            ar & kmers_;
+            ar & offsets_;
+            ar & postings_;
+        }
+        else
+        {
+            // one slot at a time so that it can be loaded as either layout
+            uint64_t numPostings = summary().numPostings;
+            uint64_t numSlots = spill_ ? spill_->numSlots() : index_.size();
+            ar & numPostings;
+            ar & numSlots;
+            if (spill_)
+                spill_->saveDense(ar);
+            else
+                for (uint64_t i=0; i<numSlots; i++)
+                    ar & index_[i];
+        }
+
+        ar & weights_;
+        ar & sequenceLengths_;
+        ar & sequences_;
+    }
+
+    template<class Archive>
+    void load(Archive & ar, const unsigned int version)
+    {
+        if(version < DATABASE_FILE_MIN_VERSION || version > DATABASE_FILE_VERSION)
             throw boost::archive::archive_exception(boost::archive::archive_exception::unsupported_version); 
 
+        int32_t storedLayout;
+        ar & kmerSize_;
+        ar & storedLayout;
         ar & numSequences_;
         ar & numLevels_;
         ar & annotations_;
         ar & annotationIds_;
-        ar & index_;
+
+        index_.clear();
+        offsets_.clear();
+        postings_.clear();
+        kmers_.clear();
+        directory_.clear();
+
+        if (storedLayout == INDEX_COMPACT)
+        {
+            // never expanded, a compact index is kept compact unless made sparse
+            ar & offsets_;
+            ar & postings_;
+            if (layout_ == INDEX_SPARSE)
+                makeSparse();
+            else
+                layout_ = INDEX_COMPACT;
+        }
+        else if (storedLayout == INDEX_SPARSE)
+        {
+            // and likewise a sparse one sparse
+            layout_ = INDEX_SPARSE;
+            ar & kmers_;
+            ar & offsets_;
+            ar & postings_;
+            indexDirectory();
+        }
+        else
+        {
+            uint64_t numPostings, numSlots;
+            ar & numPostings;
+            ar & numSlots;
+            if (layout_ == INDEX_DENSE)
+            {
+                index_.resize(numSlots);
+                for (uint64_t i=0; i<numSlots; i++)
+                    ar & index_[i];
+            }
+            else
+            {
+                // convert to compact or sparse as we go, so the dense form is never held in memory
+                if (layout_ == INDEX_COMPACT)
+                    offsets_.reserve(numSlots + 1);
+                postings_.reserve(numPostings);
+                std::vector<unsigned int> slot;
+                for (uint64_t i=0; i<numSlots; i++)
+                {
+                    ar & slot;
+                    if (layout_ == INDEX_SPARSE)
+                    {
+                        if (slot.empty())
+                            continue;
+                        kmers_.push_back(i);
+                    }
+                    offsets_.push_back(postings_.size());
+                    postings_.insert(postings_.end(), slot.begin(), slot.end());
+                }
+                offsets_.push_back(postings_.size());
+                if (layout_ == INDEX_SPARSE)
+                    indexDirectory();
+            }
+        }
+
+        weights_.clear();
+        sequenceLengths_.clear();
+        sequences_.clear();
+        if (version >= 3)
+        {
+            ar & weights_;
+
+            // the sequences are last, so are simply not read unless wanted
+            if (keepSequences_)
+            {
+                ar & sequenceLengths_;
+                ar & sequences_;
+            }
+        }
     }
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
     
-    // threading
+    // threading, see LoadJob in database.cpp
     boost::mutex mutex_;
-    boost::thread_group threads_;
-    void loadThread(FastaReader& reader, const Kmerizer& kmerizer);
-    void addSequence(const KmerSequence& seq);
+    friend struct LoadJob;
+    void addSequence(KmerSequence& seq, const std::string& packed, uint32_t length);
+    void addKmers(std::vector<kmerSize_t>& kmers);
+
+    // build the index from the references' kmers once they are all added
+    void finishIndex(kmerSize_t numSlots);
+
+    // convert pending_ into the compact or sparse layout
+    void buildCompact(kmerSize_t numSlots);
+
+    // drop the offsets of the kmers which do not occur from the compact layout
+    void makeSparse();
+
+    // index kmers_ by the top bits of each, so that a kmer is found by searching
+    // only those sharing its prefix, of which there is about one
+    void indexDirectory();
+
+    // where the postings of a kmer are held, which is the kmer itself unless
+    // the layout is sparse. numEntries() for a kmer the sparse layout does not hold
+    size_t entryOf(kmerSize_t kmer) const
+    {
+        if (layout_ != INDEX_SPARSE)
+            return kmer;
+        const kmerSize_t *base = kmers_.empty() ? NULL : &kmers_[0];
+        const kmerSize_t *first = base + directory_[kmer >> directoryShift_];
+        const kmerSize_t *last = base + directory_[(kmer >> directoryShift_) + 1];
+        const kmerSize_t *found = std::lower_bound(first, last, kmer);
+        return found != last && *found == kmer ? found - base : kmers_.size();
+    }
+    size_t numEntries() const { return layout_ == INDEX_DENSE ? index_.size() : offsets_.size() - 1; }
+
+    PostingsList entryPostings(size_t entry) const
+    {
+        PostingsList list;
+        if (layout_ == INDEX_DENSE)
+        {
+            const std::vector<unsigned int>& slot = index_[entry];
+            list.begin = slot.empty() ? NULL : &slot[0];
+            list.end = list.begin + slot.size();
+        }
+        else
+        {
+            const unsigned int *base = postings_.empty() ? NULL : &postings_[0];
+            list.begin = base + offsets_[entry];
+            list.end = base + offsets_[entry + 1];
+        }
+        return list;
+    }
+
+    // add the kmers with postings in this index alone to kmers
+    void occupiedKmers(std::vector<kmerSize_t>& kmers) const;
+    uint64_t hashPostings(uint64_t hash) const;
+
+    // count the kmers of query in each reference of this index alone
+    void addScores(const KmerSequence& query, unsigned int *scores, unsigned int& topScore, ThreadStats *stats) const;
+
+    // as addScores, but only exact for the references tied for the top score,
+    // which is all the search needs. See database.cpp
+    void addScoresPruned(const KmerSequence& query, unsigned int *scores, unsigned int& topScore, ThreadStats *stats) const;
+    bool prune_;
+
+    // references grouped by annotation for hierarchical searches, and the
+    // groups holding each kmer, in the compact layout. Empty if not built
+    std::vector<std::vector<unsigned int> > groupMembers_;
+    std::vector<unsigned int> groupOf_;
+    std::vector<uint32_t> groupOffsets_;
+    std::vector<unsigned int> groupPostings_;
+
+    // as addScoresPruned, scoring the references of the most promising groups only
+    void addScoresGrouped(const KmerSequence& query, unsigned int *scores, unsigned int& topScore, ThreadStats *stats) const;
+
+    // the index as a bit matrix, searched instead of the postings if built
+    boost::shared_ptr<BitMatrix> signatures_;
+    searchHit searchSignatures(const KmerSequence& query, ThreadStats *stats) const;
+
+    // approximate search settings, and the limits they give for this index
+    ApproximateOptions approximate_;
+    size_t maxPostings_;
+    uint64_t sampleThreshold_;
 
 public:
-    Database() : numSequences_(0) {}
+    Database() : numSequences_(0), numLevels_(0), kmerSize_(0), layout_(INDEX_DENSE), directoryShift_(0), keepSequences_(false), segmentSequences_(0),
+                 spillMemory_(0), prune_(true), maxPostings_(0), sampleThreshold_(0) {}
     ~Database() {}
     
-    // load database from file
-    bool load(const std::string& fileName, const Kmerizer& kmerizer, const unsigned int numThreads);
+    // load database from file. References are numbered in the order they are read
+    bool load(const std::string& fileName, const Kmerizer& kmerizer, TaskScheduler& scheduler, IndexLayout layout = INDEX_DENSE);
+    bool load(SequenceSource& reader, const std::string& name, const Kmerizer& kmerizer, TaskScheduler& scheduler, IndexLayout layout = INDEX_DENSE);
+
+    // read / write a cached index. loadIndex throws boost::archive::archive_exception
+    // if the file is missing or in an old format. A sparse index file is always loaded
+    // as sparse, and a compact one as compact unless layout is INDEX_SPARSE. A dense
+    // one is converted if layout is either
+    void loadIndex(const std::string& fileName, IndexLayout layout = INDEX_DENSE);
+    void saveIndex(const std::string& fileName) const;
+    static bool readSummary(const std::string& fileName, IndexSummary& summary);
+
+    // delta segments of an index are stored alongside it as INDEX.1, INDEX.2, ...
+    // each an index file of its own, holding only the references added to it
+    static std::string segmentFileName(const std::string& fileName, unsigned int segment);
+    static unsigned int countSegments(const std::string& fileName);
+
+    // add the sizes of an index's segments to its summary
+    static void addSegmentSummaries(const std::string& fileName, IndexSummary& summary);
+
+    // load the segments of the index this was loaded from, returns how many
+    unsigned int loadSegments(const std::string& fileName, IndexLayout layout = INDEX_DENSE);
+    unsigned int numSegments() const { return segments_.size(); }
+
+    // search the shards DATABASE.shard1 ... of an index, each held by the
+    // server on the corresponding socket, instead of loading an index
+    void connectShards(const std::string& dbFilename, unsigned int kmerSize, const std::vector<std::string>& sockets);
+
+    // fold the loaded segments into this index. The reference sequences are
+    // kept only if this index and every segment have them
+    void compact();
+
+    // build the index from fasta on disk rather than in memory, as sorted runs of its
+    // kmers in directory holding no more than memory bytes of them at once. The
+    // postings are only merged from the runs as the index is saved, so it can be
+    // saved but not searched
+    void setExternalBuild(const std::string& directory, uint64_t memory) { spillDirectory_ = directory; spillMemory_ = memory; }
+    bool builtExternally() const { return spill_.get() != NULL; }
+    unsigned int numRuns() const { return spill_ ? spill_->numRuns() : 0; }
+
+    // keep the reference sequences when building or loading, so that
+    // region indexes can later be derived from this one
+    void setKeepSequences(bool keep) { keepSequences_ = keep; }
+    bool hasSequences() const { return !sequences_.empty(); }
+    std::string sequence(unsigned int id) const;
+
+    // replace this index with one of the region of each reference in full,
+    // which must have its sequences. References identical within the region
+    // and in their annotations become one, weighted by how many it replaces
+    void deriveRegion(const Database& full, const RegionExtractor& extractor, const Kmerizer& kmerizer,
+                      TaskScheduler& scheduler, IndexLayout layout = INDEX_DENSE);
+
+    // quick scan of a fasta database for memory estimates
+    static ReferenceScan scanReferences(const std::string& fileName);
+    static ReferenceScan scanReferences(SequenceSource& reader);
+
+    // pick the fastest layout that fits within budget, once otherBytes are accounted for.
+    // The sparse layout is picked whatever the budget if most kmers can not occur
+    static IndexLayout chooseLayout(const IndexSummary& summary, uint64_t budget, uint64_t otherBytes, bool building);
+
+    // the sparse layout is preferred while the references have fewer kmers than a
+    // quarter of the kmer slots, as then at least three in four are empty. Only
+    // the larger kmer sizes have enough slots for references to be scanned for this
+    static bool preferSparse(const IndexSummary& summary);
+    static bool sparseCandidate(unsigned int kmerSize);
+
+    // sizes of the loaded index, and measured memory use
+    IndexSummary summary() const;
+    MemoryEstimate memoryUsage() const;
+
+    // hash of the annotations and lengths of the references, and of the references
+    // holding each kmer in the index and its segments. The same whatever the layout
+    uint64_t fingerprint() const;
+    IndexLayout layout() const { return layout_; }
+    unsigned int kmerSize() const { return kmerSize_; }
 
     // get number of sequences in the database
-    const int numSequences() { return numSequences_; }
+    const int numSequences() const { return numSequences_ + segmentSequences_; }
+
+    // number of references a collapsed reference stands for
+    unsigned int weight(unsigned int id) const { return weights_.empty() ? 1 : weights_[id]; }
+
+    // references containing a kmer
+    PostingsList postings(kmerSize_t kmer) const
+    {
+        if (layout_ != INDEX_SPARSE)
+            return entryPostings(kmer);
+        size_t entry = entryOf(kmer);
+        if (entry == kmers_.size())
+        {
+            PostingsList none = {NULL, NULL};
+            return none;
+        }
+        return entryPostings(entry);
+    }
+
+    // skip references which can no longer reach the top score while searching,
+    // on by default, and search groups first if they are built. The results
+    // are the same either way
+    void setPruning(bool prune) { prune_ = prune; }
+
+    // group the references by their annotation at level, so that searches
+    // score the groups first and then only the references of those which
+    // can reach the best score. The results are the same. Not used with
+    // segments, and returns the number of groups
+    unsigned int buildGroups(unsigned int level);
+    unsigned int numGroups() const { return groupMembers_.size(); }
+
+    // the bit matrix of an index is stored alongside it as INDEX.bits. It is
+    // searched instead of the postings, which are still kept for everything
+    // else, but not with segments. load returns false if the file is missing
+    // or was built from a different index
+    static std::string signatureFileName(const std::string& fileName);
+    void buildSignatures();
+    bool loadSignatures(const std::string& fileName);
+    void saveSignatures(const std::string& fileName) const;
+    bool hasSignatures() const { return signatures_.get() != NULL; }
+
+    // the bit matrix is preferred while it is no more than twice the size of the
+    // postings lists, which is when they hold on average at least 1 in 64 of the references
+    static bool preferSignatures(const IndexSummary& summary);
+    static uint64_t signatureBytes(const IndexSummary& summary);
+
+    // search only some of the kmers of each query, see ApproximateOptions.
+    // Set once the index is loaded, as the limits depend on its size
+    void setApproximate(const ApproximateOptions& options);
+    const ApproximateOptions& approximate() const { return approximate_; }
+
+    // drop the kmers of query an approximate search skips. The query is left
+    // whole if none would be left. Scores are then over the kmers searched
+    void reduceQuery(KmerSequence& query) const;
 
-    // search the database
-    searchHit search(const KmerSequence& query);
+    // search the database, optionally counting the work done into stats
+    searchHit search(const KmerSequence& query, ThreadStats *stats = NULL) const;
 
     // get annotation string from id
     const std::string& annotationFromId(const unsigned int id) const;
     const unsigned int & numLevels() const { return numLevels_; }
+    unsigned int numAnnotations() const { return annotations_.size(); }
 };
 
 BOOST_CLASS_VERSION(Database, DATABASE_FILE_VERSION)
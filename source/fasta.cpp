@@ -18,21 +18,33 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 =============================================================================*/
 
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+
 #include "fasta.h"
 #include "common.h"
 
-// construct and open the fasta file
-FastaReader::FastaReader(const std::string& filename) : numRead_(0)
+// construct and open the fasta file, '-' for stdin
+FastaReader::FastaReader(const std::string& filename, bool keepEmpty) :
+    fileName_(filename == "-" ? "stdin" : filename), numRead_(0), fastq_(false), keepEmpty_(keepEmpty), offset_(0), headerOffset_(0)
 {
     curSeq_.header = curSeq_.sequence = "";
     numRead_ = 0;
-    input_.open(filename.c_str());
+    input_.open(filename == "-" ? "/dev/stdin" : filename.c_str());
     if(!input_.is_open())
     {
         std::ostringstream msg;
         msg << "Could not open " << filename;
         throw FileOpenException(msg.str());
     }
+    while (isspace(input_.peek()))
+    {
+        input_.get();
+        offset_++;
+    }
+    fastq_ = input_.peek() == '@';
 }
 
 
@@ -44,22 +56,29 @@ FastaReader::~FastaReader()
 }
 
 // read a sequence from the fasta file
-DnaSequence FastaReader::readSequence()
+DnaSequence FastaReader::readSequence(ThreadStats *stats)
 {
     std::string line;
     DnaSequence seq;
+    PhaseTimer lockTimer(stats, PHASE_READER_LOCK);
     scoped_lock lock(mutex_);
-    while(std::getline( input_, line ))
+    lockTimer.stop();
+    PhaseTimer parseTimer(stats, PHASE_PARSE);
+    if (fastq_)
+        return readFastq();
+
+    for (uint64_t start = offset_; nextLine(line); start = offset_)
     {
         if (line[0] == '>')
         {
+            headerOffset_ = start;
             if (!curSeq_.header.empty())
             {
                 seq.header = curSeq_.header;
                 seq.sequence = curSeq_.sequence;
                 curSeq_.header = line.substr(1);
                 curSeq_.sequence = "";
-                numRead_ ++;
+                seq.number = ++numRead_;
                 return seq;
             }
             else
@@ -80,7 +99,7 @@ DnaSequence FastaReader::readSequence()
         seq.sequence = curSeq_.sequence;
         curSeq_.header = "";
         curSeq_.sequence = "";
-        numRead_ ++;
+        seq.number = ++numRead_;
         return seq;
     }
 
@@ -88,6 +107,59 @@ DnaSequence FastaReader::readSequence()
 }
 
 
+// read a fastq record: the header, sequence lines up to the + line, then
+// quality lines until there is a quality for each base. Quality lines may
+// start with @, so they are counted rather than searched for the next header.
+// Records without bases are skipped, as an empty sequence ends the input,
+// unless the reader keeps them
+DnaSequence FastaReader::readFastq()
+{
+    std::string line;
+    DnaSequence seq;
+    do
+    {
+        line.clear();
+        while (line.empty())
+        {
+            if (!nextLine(line))
+                return DnaSequence();
+        }
+        if (line[0] != '@')
+        {
+            std::ostringstream msg;
+            msg << "expected a fastq header after record " << numRead_ << " of " << fileName_;
+            throw std::runtime_error(msg.str());
+        }
+        seq.header = line.substr(1);
+        seq.sequence.clear();
+        seq.quality.clear();
+
+        bool separated = false;
+        while (nextLine(line))
+        {
+            if (!line.empty() && line[0] == '+')
+            {
+                separated = true;
+                break;
+            }
+            seq.sequence.append(line);
+        }
+        while (separated && seq.quality.size() < seq.sequence.size() && nextLine(line))
+            seq.quality.append(line);
+
+        if (seq.quality.size() != seq.sequence.size())
+        {
+            std::ostringstream msg;
+            msg << "the bases and qualities of fastq record " << numRead_ + 1 << " of " << fileName_ << " differ in length";
+            throw std::runtime_error(msg.str());
+        }
+    }
+    while (seq.sequence.empty() && !keepEmpty_);
+    seq.number = ++numRead_;
+    return seq;
+}
+
+
 // get the number of sequences read so far
 long FastaReader::numRead()
 {
@@ -95,4 +167,97 @@ long FastaReader::numRead()
     return numRead_;
 }
 
+// a line of the input, counting the bytes read through
+bool FastaReader::nextLine(std::string& line)
+{
+    if (!std::getline(input_, line))
+        return false;
+    offset_ += line.size() + !input_.eof();
+    return true;
+}
 
+// the position of the first sequence not yet returned, which is the header
+// already read for fasta
+uint64_t FastaReader::offset()
+{
+    scoped_lock lock(mutex_);
+    return fastq_ || curSeq_.header.empty() ? offset_ : headerOffset_;
+}
+
+// continue from a position given by offset(), numRead sequences into the file
+void FastaReader::seek(uint64_t offset, long numRead)
+{
+    scoped_lock lock(mutex_);
+    input_.clear();
+    if (!input_.seekg(offset))
+    {
+        std::ostringstream msg;
+        msg << "Could not seek to byte " << offset << " of " << fileName_;
+        throw FileOpenException(msg.str());
+    }
+    curSeq_ = DnaSequence();
+    offset_ = offset;
+    numRead_ = numRead;
+}
+
+
+PairReader::PairReader(const std::string& fileName, const std::string& mateFileName) : numRead_(0)
+{
+    first_.reset(new FastaReader(fileName, true));
+    if (mateFileName.empty())
+    {
+        name_ = first_->name();
+    }
+    else
+    {
+        second_.reset(new FastaReader(mateFileName, true));
+        name_ = first_->name() + " and " + second_->name();
+    }
+}
+
+// read both mates of the next pair, either of which may have no bases
+bool PairReader::readPair(DnaSequence& first, DnaSequence& second, ThreadStats *stats)
+{
+    scoped_lock lock(mutex_);
+    first = first_->readSequence(stats);
+    second = second_ ? second_->readSequence(stats) : first_->readSequence(stats);
+    if (first.header.empty() && second.header.empty())
+        return false;
+    if (first.header.empty() || second.header.empty())
+    {
+        std::ostringstream msg;
+        msg << "the mate of pair " << numRead_ + 1 << " is missing from " << name_;
+        throw PairingException(msg.str());
+    }
+    first.number = second.number = ++numRead_;
+    return true;
+}
+
+// get the number of pairs read so far
+long PairReader::numRead()
+{
+    scoped_lock lock(mutex_);
+    return numRead_;
+}
+
+void PairReader::offsets(uint64_t& offset, uint64_t& mateOffset)
+{
+    scoped_lock lock(mutex_);
+    offset = first_->offset();
+    mateOffset = second_ ? second_->offset() : 0;
+}
+
+void PairReader::seek(uint64_t offset, uint64_t mateOffset, long numRead)
+{
+    scoped_lock lock(mutex_);
+    if (second_)
+    {
+        first_->seek(offset, numRead);
+        second_->seek(mateOffset, numRead);
+    }
+    else
+    {
+        first_->seek(offset, 2 * numRead);
+    }
+    numRead_ = numRead;
+}
@@ -23,7 +23,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <string>
 #include <fstream>
+#include <stdexcept>
 #include <boost/thread/mutex.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "stats.h"
 
 /* Fasta file handling */
 
@@ -35,28 +38,101 @@ struct DnaSequence
 {
     std::string header;
     std::string sequence;
+    std::string quality;    // phred+33 quality of each base from fastq, empty from fasta
+    long number;            // position in the input file, starting from 1
+
+    DnaSequence() : number(0) {}
 
     operator bool() const { return !header.empty() && !sequence.empty(); }
+    const char *qualities() const { return quality.empty() ? NULL : quality.data(); }
+};
+
+//======================================================================
+// SequenceSource class
+// Anything that hands out sequences one at a time to several threads
+//======================================================================
+class SequenceSource
+{
+public:
+    virtual ~SequenceSource() {}
+    virtual DnaSequence readSequence(ThreadStats *stats = NULL) = 0;
 };
 
 //======================================================================
 // FastaReader class
-// Reads sequences one at a time from the specified fasta file
+// Reads sequences one at a time from the specified fasta file, or fastq
+// file if its first record starts with @. The file may be a pipe, or '-'
+// for stdin, as it is only read through once
 //======================================================================
-class FastaReader
+class FastaReader : public SequenceSource
 {
 private:
     typedef boost::mutex::scoped_lock scoped_lock;
     boost::mutex mutex_;
     std::ifstream input_;
+    std::string fileName_;
     DnaSequence curSeq_;
     long numRead_;
+    bool fastq_;
+    bool keepEmpty_;                // return fastq records without bases
+    uint64_t offset_;               // bytes read through
+    uint64_t headerOffset_;         // start of the header held in curSeq_
+
+    bool nextLine(std::string& line);
+    DnaSequence readFastq();
 
 public:
-    FastaReader(const std::string& filename);
+    // fastq records without bases are skipped unless keepEmpty is set, in
+    // which case the end of the input is a sequence without a header
+    FastaReader(const std::string& filename, bool keepEmpty = false);
     ~FastaReader();
-    DnaSequence readSequence();
+    DnaSequence readSequence(ThreadStats *stats = NULL);
     long numRead();
+    const std::string& name() const { return fileName_; }
+
+    // where the next sequence starts, and moving to such a position to carry
+    // on from it after numRead sequences. Not for pipes
+    uint64_t offset();
+    void seek(uint64_t offset, long numRead);
+};
+
+//======================================================================
+// PairingException class
+// Raised when one mate of a pair is missing
+//======================================================================
+class PairingException : public std::runtime_error
+{
+public:
+    PairingException(const std::string &message) : std::runtime_error(message) {}
+};
+
+//======================================================================
+// PairReader class
+// Reads the mates of paired-end reads, from two files in step or from
+// one file holding the two mates of each pair one after the other.
+// Pairs are numbered by their position, starting from 1
+//======================================================================
+class PairReader
+{
+private:
+    typedef boost::mutex::scoped_lock scoped_lock;
+    boost::mutex mutex_;
+    boost::scoped_ptr<FastaReader> first_;
+    boost::scoped_ptr<FastaReader> second_;     // NULL when interleaved
+    std::string name_;
+    long numRead_;
+
+public:
+    // mateFileName empty for an interleaved file
+    PairReader(const std::string& fileName, const std::string& mateFileName);
+
+    // false at the end of the input, throws PairingException if a mate is missing
+    bool readPair(DnaSequence& first, DnaSequence& second, ThreadStats *stats = NULL);
+    long numRead();
+
+    // as for FastaReader, mateOffset being 0 when interleaved
+    void offsets(uint64_t& offset, uint64_t& mateOffset);
+    void seek(uint64_t offset, uint64_t mateOffset, long numRead);
 };
 
 #endif /* __FASTA_H__ */
@@ -0,0 +1,99 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: format.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "format.h"
+
+// largest magnitude converted directly, beyond this printf is used
+static const double maxDirect = 1e15;
+
+// classify a float from its bits
+static void inspect(float value, bool& negative, bool& nan, bool& infinite)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    negative = (bits >> 31) != 0;
+    bool maxExponent = ((bits >> 23) & 0xff) == 0xff;
+    nan = maxExponent && (bits & 0x7fffff);
+    infinite = maxExponent && !(bits & 0x7fffff);
+}
+
+bool toHundredths(float value, uint64_t& hundredths, bool& negative)
+{
+    bool nan, infinite;
+    inspect(value, negative, nan, infinite);
+    if (nan || infinite)
+        return false;
+
+    // a float has a 24 bit mantissa, so multiplying by 100 in double precision
+    // is exact and the only rounding is to the nearest integer. printf rounds
+    // the exact value, ties to even
+    double scaled = std::fabs(static_cast<double>(value) * 100.0);
+    double whole = std::floor(scaled);
+    double fraction = scaled - whole;
+    hundredths = static_cast<uint64_t>(whole);
+    if (fraction > 0.5 || (fraction == 0.5 && (hundredths & 1)))
+        hundredths++;
+    return true;
+}
+
+void appendFixed2(std::string& out, float value)
+{
+    uint64_t hundredths = 0;
+    bool negative, nan, infinite;
+    inspect(value, negative, nan, infinite);
+    if (negative)
+        out += '-';
+    if (nan || infinite)
+    {
+        out += nan ? "nan" : "inf";
+        return;
+    }
+
+    if (std::fabs(value) > maxDirect)
+    {
+        char text[64];
+        snprintf(text, sizeof(text), "%.2f", std::fabs(static_cast<double>(value)));
+        out += text;
+        return;
+    }
+
+    toHundredths(value, hundredths, negative);
+    appendUnsigned(out, hundredths / 100);
+    out += '.';
+    out += static_cast<char>('0' + (hundredths % 100) / 10);
+    out += static_cast<char>('0' + hundredths % 10);
+}
+
+void appendUnsigned(std::string& out, uint64_t value)
+{
+    char digits[20];
+    unsigned int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    while (n)
+        out += digits[--n];
+}
@@ -0,0 +1,39 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: format.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __FORMAT_H__
+#define __FORMAT_H__
+
+#include <string>
+#include <stdint.h>
+
+/* Text formatting without iostreams or locales */
+
+// value rounded to two decimal places, in hundredths, exactly as printf("%.2f")
+// rounds it. Returns false for nan and infinity. Only for values up to 1e15
+bool toHundredths(float value, uint64_t& hundredths, bool& negative);
+
+// append value as printf("%.2f") would print it
+void appendFixed2(std::string& out, float value);
+
+// append an unsigned integer
+void appendUnsigned(std::string& out, uint64_t value);
+
+#endif /* __FORMAT_H__ */
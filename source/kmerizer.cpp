@@ -42,17 +42,38 @@ void Kmerizer::setKmerSize(kmerSize_t size)
 // convert a DNA sequence into a kmer sequence
 KmerSequence Kmerizer::kmerize(const DnaSequence& sequence) const
 {
-    kmerSize_t seqlen = sequence.sequence.length();
-    assert(seqlen >= kmerSize_);
+    KmerSequence kmerseq = kmerize(sequence.sequence.data(), sequence.sequence.length());
+    kmerseq.header = sequence.header;
+    return kmerseq;
+}
+
+// convert a raw DNA string into a kmer sequence. Kmers spanning a base
+// below minQuality are discarded like those with a non ACGTU base
+KmerSequence Kmerizer::kmerize(const char *sequence, size_t length, const char *quality, unsigned int minQuality) const
+{
+    kmerSize_t seqlen = length;
     assert(numKmers_ > 0);
-    kmerSize_t numKmersInSeq = seqlen - kmerSize_;
 
     KmerSequence kmerseq;
-    kmerseq.header = sequence.header;
+    if (seqlen < kmerSize_)
+        return kmerseq;     // too short to contain any kmers
+    kmerSize_t numKmersInSeq = seqlen - kmerSize_;
+
+    // kmers starting before this span a low quality base
+    kmerSize_t clearFrom = 0;
+    bool masking = quality && minQuality;
+    if (masking)
+    {
+        for (kmerSize_t j=0; j + 1 < kmerSize_; ++j)
+            if (lowQuality(quality[j], minQuality))
+                clearFrom = j + 1;
+    }
 
     for(kmerSize_t i=0; i <= numKmersInSeq; ++i)
     {
-        kmerSize_t idx = kmerIndex(sequence.sequence.substr(i, kmerSize_));
+        if (masking && lowQuality(quality[i + kmerSize_ - 1], minQuality))
+            clearFrom = i + kmerSize_;
+        kmerSize_t idx = i < clearFrom ? numKmers_ : kmerIndex(sequence + i);
         if(std::find(kmerseq.kmers.begin(), kmerseq.kmers.end(), idx) == kmerseq.kmers.end())
             kmerseq.kmers.push_back(idx);
     }
@@ -60,11 +81,28 @@ KmerSequence Kmerizer::kmerize(const DnaSequence& sequence) const
     return kmerseq;
 }
 
-// convert a kmer to its associated index
-kmerSize_t Kmerizer::kmerIndex( const std::string& kmer ) const
+// kmers of the first mate, then those of the reverse complemented second
+// mate which the first does not have
+KmerSequence Kmerizer::kmerizePair(const char *first, size_t firstLength, const char *second, size_t secondLength,
+                                   const char *firstQuality, const char *secondQuality, unsigned int minQuality) const
 {
-    assert(kmer.length() == kmerSize_);
+    KmerSequence kmerseq = kmerize(first, firstLength, firstQuality, minQuality);
+    KmerSequence mate = kmerize(second, secondLength, secondQuality, minQuality);
+
+    std::vector<kmerSize_t> seen(kmerseq.kmers);
+    std::sort(seen.begin(), seen.end());
+    for(std::vector<kmerSize_t>::const_iterator it = mate.kmers.begin(); it != mate.kmers.end(); ++it)
+    {
+        kmerSize_t idx = revCompIndex(*it);
+        if(!std::binary_search(seen.begin(), seen.end(), idx))
+            kmerseq.kmers.push_back(idx);
+    }
+    return kmerseq;
+}
 
+// convert a kmer to its associated index
+kmerSize_t Kmerizer::kmerIndex( const char *kmer ) const
+{
     kmerSize_t kmerId = 0;
 
     for(kmerSize_t i = 0; i < kmerSize_; i++)
@@ -52,7 +52,7 @@ class Kmerizer
 private:
     kmerSize_t kmerSize_;
     kmerSize_t numKmers_;
-    kmerSize_t kmerIndex( const std::string& kmer ) const;
+    kmerSize_t kmerIndex( const char *kmer ) const;
     kmerSize_t revCompIndex( const kmerSize_t& idx ) const;
 
 public:
@@ -61,9 +61,20 @@ public:
     
     void setKmerSize(kmerSize_t size);
     KmerSequence kmerize(const DnaSequence& sequence) const;
+
+    // with phred+33 qualities, kmers spanning a base below minQuality go to the discarded slot
+    KmerSequence kmerize(const char *sequence, size_t length, const char *quality = NULL, unsigned int minQuality = 0) const;
+
+    // the kmers of a read pair, those of the first mate and of the reverse
+    // complement of the second, so that both are on the same strand
+    KmerSequence kmerizePair(const char *first, size_t firstLength, const char *second, size_t secondLength,
+                             const char *firstQuality = NULL, const char *secondQuality = NULL, unsigned int minQuality = 0) const;
     kmerSize_t numKmers() const { return numKmers_; }
     kmerSize_t kmerSize() const { return kmerSize_; }
 
+    // a base whose kmers are masked
+    static bool lowQuality(char quality, unsigned int minQuality) { return static_cast<unsigned char>(quality) < 33 + minQuality; }
+
     KmerSequence revComp(const KmerSequence &kmerSeq) const;  // reverse complement the sequence
 };
 
@@ -18,9 +18,14 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 =============================================================================*/
 
+#include <algorithm>
+#include <set>
+#include <fstream>
 #include <boost/program_options.hpp>
 #include "common.h"
 #include "classifier.h"
+#include "server.h"
+#include "results.h"
 
 // version
 static const std::string versionString("Version 1.3");
@@ -43,12 +48,107 @@ static const int defaultThreads = 1;
 static const int minSubsample = 1;
 static const bool defaultWriteIndex = false;
 static const bool defaultAmbiguousOutput = false;
+static const double defaultStatsInterval = 0.0;
+static const bool defaultStatsPerf = false;
+static const double defaultCheckpointInterval = 300.0;
+static const int defaultSummaryLevel = 0;
+static const double defaultSimilarity = 0.5;
+static const double defaultThreshold = 0.8;
+static const double defaultCommonKmers = 0.5;
+static const double defaultSampleKmers = 1.0;
 
 
+// extension of sample output files
+static const std::string sampleOutputExtension(".spingo.txt");
+static const std::string binaryOutputExtension(".spingo.bin");
+static const std::string summaryExtension(".summary");
+
+
+// output file for an input when none is given
+SampleFiles sampleFiles(const std::string& inputFilename, const std::string& outputDir, const std::string& extension)
+{
+    SampleFiles files;
+    files.inputFilename = inputFilename;
+    if (outputDir.empty())
+    {
+        files.outputFilename = inputFilename + extension;
+    }
+    else
+    {
+        size_t slash = inputFilename.rfind('/');
+        std::string name = slash == std::string::npos ? inputFilename : inputFilename.substr(slash + 1);
+        files.outputFilename = outputDir + "/" + name + extension;
+    }
+    return files;
+}
+
+// read a manifest: one sample per line, the input file optionally followed by
+// the output file. Blank lines and lines starting with # are skipped
+void readManifest(const std::string& fileName, const std::string& outputDir, const std::string& extension, std::vector<SampleFiles>& samples)
+{
+    namespace po = boost::program_options;
+    std::ifstream manifest(fileName.c_str());
+    if (!manifest.is_open())
+        throw po::error("could not open manifest " + fileName);
+
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+        std::istringstream fields(line);
+        std::string input, output, extra;
+        if (!(fields >> input) || input[0] == '#')
+            continue;
+
+        SampleFiles files = sampleFiles(input, outputDir, extension);
+        if (fields >> output)
+            files.outputFilename = output;
+        if (fields >> extra)
+            throw po::error("manifest line has too many fields: " + line);
+        samples.push_back(files);
+    }
+}
+
+// make sure no output overwrites an input or another output, and stdin is not a sample
+void checkSamples(const std::vector<SampleFiles>& samples)
+{
+    namespace po = boost::program_options;
+    if (samples.empty())
+        throw po::error("no samples to classify");
+
+    std::set<std::string> inputs, outputs;
+    for (std::vector<SampleFiles>::const_iterator it=samples.begin(); it!=samples.end(); ++it)
+        inputs.insert(it->inputFilename);
+    if (inputs.count("-"))
+        throw po::error("stdin ('-') can only be the single input, written to stdout");
+    for (std::vector<SampleFiles>::const_iterator it=samples.begin(); it!=samples.end(); ++it)
+    {
+        if (inputs.count(it->outputFilename))
+            throw po::error("output file " + it->outputFilename + " is also an input");
+        if (!outputs.insert(it->outputFilename).second)
+            throw po::error("output file " + it->outputFilename + " is used by more than one sample");
+    }
+}
+
+// binary result files to convert to text
+static std::vector<std::string> convertInputs;
+
+// set when the server socket came from $SPINGO_SERVER rather than --server
+static bool serverFromEnvironment = false;
+
+// approximate search settings compared by --calibrate
+static ApproximateOptions calibrateOptions;
+
 // process the command-line args
 ClassifierOptions parseCommandLine(int argc, char **argv)
 {
     ClassifierOptions options;
+    std::string maxMemory;
+    std::string engine;
+    ApproximateOptions approximate;
+    std::vector<std::string> inputs;
+    std::string manifest;
+    std::string outputDir;
+    std::vector<std::string> convertFiles;
     namespace po = boost::program_options;
     std::string title("SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.\n" + versionString + " " + archString);
     po::options_description desc("Available options");
@@ -81,6 +181,11 @@ ClassifierOptions parseCommandLine(int argc, char **argv)
             po::value<int>(&options.numThreads)->default_value(defaultThreads),
             "number of processor threads"
         )
+        (
+            "pin-threads",
+            po::value<bool>(&options.pinThreads)->zero_tokens()->default_value(false),
+            "if specified, each processor thread is kept on a CPU of its own, in turn (Linux only)"
+        )
         (
             "database,d",
             po::value<std::string>(&options.dbFilename),
@@ -88,8 +193,63 @@ ClassifierOptions parseCommandLine(int argc, char **argv)
         )
         (
             "input,i",
-            po::value<std::string>(&options.inputFilename),
-            "path to the fasta format input file"
+            po::value<std::vector<std::string> >(&inputs),
+            "path to the fasta or fastq format input file, '-' for stdin. Several files may be given"
+        )
+        (
+            "mates",
+            po::value<std::string>(&options.mateFilename),
+            "path to the second mates of paired-end reads, in the same order as the first mates in the input file. "
+            "Each pair is classified as one read"
+        )
+        (
+            "interleaved",
+            po::value<bool>(&options.interleaved)->zero_tokens()->default_value(false),
+            "if specified, each input file holds paired-end reads, the two mates of each pair one after the other. "
+            "Each pair is classified as one read"
+        )
+        (
+            "min-quality",
+            po::value<unsigned int>(&options.minQuality)->default_value(0),
+            "kmers spanning a base below this phred quality in fastq input are skipped. Default is none"
+        )
+        (
+            "manifest",
+            po::value<std::string>(&manifest),
+            "file listing samples to classify, one per line: input file, then optionally the output file"
+        )
+        (
+            "output-dir",
+            po::value<std::string>(&outputDir),
+            "directory for sample output files. Default is next to each input"
+        )
+        (
+            "cache",
+            po::value<std::string>(&options.cacheFilename),
+            "file of results kept between runs, so that sequences classified before with the same index and settings are not classified again. "
+            "The bootstrap of a read is seeded by its position in the input, so a read is only found again at the same position, unless --seed-by-sequence is given"
+        )
+        (
+            "seed-by-sequence",
+            po::value<bool>(&options.seedBySequence)->zero_tokens()->default_value(false),
+            "if specified, the bootstrap of each read is seeded from its bases rather than its position, "
+            "so that a read gives the same result wherever it is in the input and --cache finds it at any position"
+        )
+        (
+            "checkpoint",
+            po::value<std::string>(&options.checkpointFilename),
+            "record progress in this file, so that an interrupted run can be carried on with --resume"
+        )
+        (
+            "checkpoint-interval",
+            po::value<double>(&options.checkpointInterval)->default_value(defaultCheckpointInterval),
+            "seconds between checkpoints (requires --checkpoint)"
+        )
+        (
+            "resume",
+            po::value<bool>(&options.resume)->zero_tokens()->default_value(false),
+            "if specified, carry on from the --checkpoint file, appending to the results written before it. "
+            "Starts from the beginning if there is no checkpoint yet"
         )
         (
             "write-index,w",
@@ -100,6 +260,122 @@ ClassifierOptions parseCommandLine(int argc, char **argv)
             "ambiguous,a",
             po::value<bool>(&options.dumpAmbiguous)->zero_tokens()->default_value(defaultAmbiguousOutput),
             "if specified, species which lead to an ambiguous hit will be listed"
+        )
+        (
+            "stats",
+            po::value<std::string>(&options.statsFilename),
+            "write profiling statistics as JSON to this file ('-' for stderr) on exit"
+        )
+        (
+            "stats-interval",
+            po::value<double>(&options.statsInterval)->default_value(defaultStatsInterval),
+            "also write interim statistics every N seconds (requires --stats)"
+        )
+        (
+            "stats-perf",
+            po::value<bool>(&options.statsPerf)->zero_tokens()->default_value(defaultStatsPerf),
+            "if specified, hardware performance counters are included in the statistics"
+        )
+        (
+            "max-memory",
+            po::value<std::string>(&maxMemory),
+            "memory limit, e.g. 4G. A compact index is used if needed to stay within it"
+        )
+        (
+            "summary",
+            po::value<std::string>(&options.summary.fileName)->implicit_value("-"),
+            "write a per-taxon abundance summary to this file, default stdout. With several samples, each is summarised to OUTPUTFILE.summary"
+        )
+        (
+            "summary-level",
+            po::value<int>(&options.summary.level)->default_value(defaultSummaryLevel),
+            "level to summarise, 1 for the first level in the output. Default is all levels"
+        )
+        (
+            "similarity",
+            po::value<double>(&options.summary.similarity)->default_value(defaultSimilarity),
+            "similarity score threshold [0-1] for the summary"
+        )
+        (
+            "threshold",
+            po::value<double>(&options.summary.threshold)->default_value(defaultThreshold, "0.8"),
+            "bootstrap threshold [0-1] for the summary"
+        )
+        (
+            "percent",
+            po::value<bool>(&options.summary.percent)->zero_tokens()->default_value(false),
+            "if specified, the summary is given as percentages instead of read counts"
+        )
+        (
+            "no-reads",
+            "if specified, only the summary is written, not the result for each read"
+        )
+        (
+            "binary",
+            "if specified, results are written in the compact binary format. See --convert"
+        )
+        (
+            "no-names",
+            "if specified, binary results store the position of each read in the input instead of its name"
+        )
+        (
+            "convert",
+            po::value<std::vector<std::string> >(&convertFiles)->multitoken(),
+            "convert binary result files to the text format, written to stdout"
+        )
+        (
+            "exhaustive",
+            po::value<bool>(&options.exhaustive)->zero_tokens()->default_value(false),
+            "score every reference for every kmer, instead of skipping references which can no longer "
+            "reach the best score. The results are the same, this is for checking and timing"
+        )
+        (
+            "hierarchical",
+            po::value<bool>(&options.hierarchical)->zero_tokens()->default_value(false),
+            "if specified, groups of references sharing an annotation at the level above species are scored "
+            "first, and only the references of groups which can reach the best score after them. The results are the same"
+        )
+        (
+            "engine",
+            po::value<std::string>(&engine)->default_value("auto"),
+            "how the index is searched: postings walks the list of references holding each kmer, bitmatrix counts "
+            "in a matrix of one bit per kmer and reference, auto uses the bit matrix when the index is dense enough. "
+            "The results are the same"
+        )
+        (
+            "approximate",
+            "if specified, only some of the kmers of each query are searched, trading accuracy for speed. See --calibrate"
+        )
+        (
+            "common-kmers",
+            po::value<double>(&approximate.commonKmers)->default_value(defaultCommonKmers),
+            "approximate searches skip kmers found in more than this fraction [0-1] of the references"
+        )
+        (
+            "sample-kmers",
+            po::value<double>(&approximate.sampleKmers)->default_value(defaultSampleKmers),
+            "fraction [0-1] of the remaining kmers approximate searches use"
+        )
+        (
+            "calibrate",
+            po::value<unsigned int>(&options.calibrate)->default_value(0),
+            "instead of classifying, compare exact and approximate searches on a random sample of this many reads"
+        )
+        (
+            "serve",
+            po::value<std::string>(&options.serveSocket),
+            "run as a server on this Unix socket, keeping indexes loaded between runs"
+        )
+        (
+            "server",
+            po::value<std::string>(&options.serverSocket),
+            "classify using the server on this Unix socket. Default is $SPINGO_SERVER"
+        )
+        (
+            "shards",
+            po::value<std::vector<std::string> >(&options.shardSockets)->multitoken(),
+            "search the index shards DATABASE.shard1 ... DATABASE.shardN, built by spindex --shards, "
+            "each held by the server on the corresponding Unix socket"
         );
 
     po::positional_options_description p;
@@ -149,6 +425,78 @@ ClassifierOptions parseCommandLine(int argc, char **argv)
             throw po::error(msg.str());
         }
         
+        if(options.statsInterval < 0)
+        {
+            std::ostringstream msg;
+            msg << "stats-interval (--stats-interval) = " << options.statsInterval;
+            msg << ": value must be >= 0";
+            throw po::error(msg.str());
+        }
+
+        if((options.statsInterval > 0 || options.statsPerf) && !vm.count("stats"))
+            throw po::error("--stats-interval and --stats-perf require --stats");
+
+        if(options.checkpointInterval <= 0)
+            throw po::error("checkpoint-interval (--checkpoint-interval) must be > 0");
+        if((!vm["checkpoint-interval"].defaulted() || options.resume) && !vm.count("checkpoint"))
+            throw po::error("--checkpoint-interval and --resume require --checkpoint");
+        if(vm.count("cache") && (vm.count("serve") || vm.count("server") || vm.count("shards") || options.calibrate))
+            throw po::error("--cache cannot be used with --serve, --server, --shards or --calibrate");
+        if(options.seedBySequence && (vm.count("serve") || vm.count("server") || options.calibrate))
+            throw po::error("--seed-by-sequence cannot be used with --serve, --server or --calibrate");
+        if(vm.count("checkpoint") && (vm.count("serve") || vm.count("server") || options.calibrate))
+            throw po::error("--checkpoint cannot be used with --serve, --server or --calibrate");
+        if(vm.count("checkpoint") && (std::find(inputs.begin(), inputs.end(), "-") != inputs.end() || options.mateFilename == "-"))
+            throw po::error("--checkpoint cannot be used with stdin, which cannot be read again");
+
+        if(options.summary.level < 0)
+            throw po::error("summary-level (--summary-level) must be >= 0");
+
+        if(options.summary.similarity < 0 || options.summary.similarity > 1 || options.summary.threshold < 0 || options.summary.threshold > 1)
+            throw po::error("similarity (--similarity) and threshold (--threshold) must be in the range [0,1]");
+
+        if((vm.count("no-reads") || !vm["summary-level"].defaulted() || !vm["similarity"].defaulted() ||
+            !vm["threshold"].defaulted() || options.summary.percent) && !vm.count("summary"))
+            throw po::error("--no-reads, --summary-level, --similarity, --threshold and --percent require --summary");
+
+        options.writeReads = !vm.count("no-reads");
+
+        if(approximate.commonKmers <= 0 || approximate.commonKmers > 1 || approximate.sampleKmers <= 0 || approximate.sampleKmers > 1)
+            throw po::error("common-kmers (--common-kmers) and sample-kmers (--sample-kmers) must be in the range (0,1]");
+
+        if((!vm["common-kmers"].defaulted() || !vm["sample-kmers"].defaulted()) && !vm.count("approximate") && !options.calibrate)
+            throw po::error("--common-kmers and --sample-kmers require --approximate or --calibrate");
+
+        if(vm.count("approximate") || options.calibrate)
+        {
+            if(vm.count("serve") || vm.count("server") || vm.count("shards"))
+                throw po::error("--approximate and --calibrate cannot be used with --serve, --server or --shards");
+            if(options.calibrate && (vm.count("summary") || vm.count("binary") || vm.count("manifest") || inputs.size() > 1))
+                throw po::error("--calibrate takes a single input file and cannot be used with --summary or --binary");
+        }
+
+        bool paired = vm.count("mates") || options.interleaved;
+        if(vm.count("mates") && options.interleaved)
+            throw po::error("--mates and --interleaved cannot be used together");
+        if(vm.count("mates") && (inputs.size() > 1 || vm.count("manifest") || vm.count("output-dir")))
+            throw po::error("--mates takes a single input file, use --interleaved for several samples");
+        if(vm.count("mates") && options.mateFilename == "-" && !inputs.empty() && inputs[0] == "-")
+            throw po::error("the input file and --mates cannot both be stdin");
+        if(paired && (vm.count("serve") || vm.count("server") || options.calibrate))
+            throw po::error("--mates and --interleaved cannot be used with --serve, --server or --calibrate");
+        if(options.minQuality && (vm.count("serve") || vm.count("server")))
+            throw po::error("--min-quality cannot be used with --serve or --server");
+        if(options.minQuality > 93)
+            throw po::error("--min-quality must be 93 or less");
+
+        // calibration compares against these, but searches exactly otherwise
+        if(vm.count("approximate"))
+            options.approximate = approximate;
+        calibrateOptions = approximate;
+
+        if(vm.count("server") && vm.count("summary"))
+            throw po::error("--summary cannot be used with --server");
+
         if(!vm.count("subsample"))
             options.subsample = options.kmerSize;
         else if (options.subsample < 1)
@@ -159,11 +507,106 @@ ClassifierOptions parseCommandLine(int argc, char **argv)
             throw po::error(msg.str());
         }
 
+        options.maxMemory = 0;
+        if(vm.count("max-memory"))
+        {
+            try {
+                options.maxMemory = parseMemorySize(maxMemory);
+            }
+            catch(std::invalid_argument& e) {
+                throw po::error(std::string("max-memory (--max-memory): ") + e.what());
+            }
+        }
+
+        // conversion needs nothing else
+        if(vm.count("convert"))
+        {
+            options.inputFilename.clear();
+            options.samples.clear();
+            convertInputs = convertFiles;
+            return options;
+        }
+
+        options.binaryOutput = vm.count("binary");
+        options.binaryNames = !vm.count("no-names");
+        if(vm.count("no-names") && !vm.count("binary"))
+            throw po::error("--no-names requires --binary");
+        if(vm.count("binary") && (vm.count("server") || vm.count("serve")))
+            throw po::error("--binary cannot be used with --serve or --server");
+
+        if(vm.count("serve") && vm.count("server"))
+            throw po::error("--serve and --server cannot be used together");
+
+        if(vm.count("server") && vm.count("stats"))
+            throw po::error("--stats cannot be used with --server");
+
+        if(options.hierarchical && (vm.count("server") || vm.count("shards")))
+            throw po::error("--hierarchical cannot be used with --server or --shards, give it to the servers");
+
+        try {
+            options.engine = parseSearchEngine(engine);
+        }
+        catch(std::invalid_argument& e) {
+            throw po::error(std::string("engine (--engine): ") + e.what());
+        }
+        if(!vm["engine"].defaulted() && (vm.count("server") || vm.count("shards")))
+            throw po::error("--engine cannot be used with --server or --shards, give it to the servers");
+        if(options.engine == ENGINE_BITMATRIX && options.hierarchical)
+            throw po::error("--engine bitmatrix cannot be used with --hierarchical");
+
+        if(vm.count("shards") && (vm.count("serve") || vm.count("server") || options.saveIndex))
+            throw po::error("--shards cannot be used with --serve, --server or --write-index");
+
+        // a server only needs a database to preload
+        if(vm.count("serve"))
+        {
+            if(vm.count("input") || vm.count("manifest"))
+                throw po::error("input files cannot be used with --serve");
+            if(vm.count("stats") || vm.count("summary"))
+                throw po::error("--stats and --summary cannot be used with --serve");
+            return options;
+        }
+
         if(!vm.count("database"))
             throw po::error("database not specified");
 
-        if(!vm.count("input"))
+        if(!vm.count("input") && !vm.count("manifest"))
             throw po::error("input file not specified");
+
+        // several samples, each to its own output file
+        if(inputs.size() > 1 || vm.count("manifest") || vm.count("output-dir"))
+        {
+            const std::string& extension = options.binaryOutput ? binaryOutputExtension : sampleOutputExtension;
+            if(vm.count("manifest"))
+                readManifest(manifest, outputDir, extension, options.samples);
+            for(std::vector<std::string>::const_iterator it=inputs.begin(); it!=inputs.end(); ++it)
+                options.samples.push_back(sampleFiles(*it, outputDir, extension));
+
+            // each sample is summarised next to its output
+            if(vm.count("summary"))
+            {
+                if(options.summary.fileName != "-")
+                    throw po::error("a summary file name cannot be given with several samples");
+                for(std::vector<SampleFiles>::iterator it=options.samples.begin(); it!=options.samples.end(); ++it)
+                    it->summaryFilename = it->outputFilename + summaryExtension;
+            }
+            checkSamples(options.samples);
+
+            if(vm.count("server"))
+                throw po::error("--server cannot be used to classify several samples");
+            return options;
+        }
+        options.inputFilename = inputs[0];
+
+        // scripts can use a running server without changes
+        const char *server = getenv("SPINGO_SERVER");
+        if(!vm.count("server") && !vm.count("shards") && !vm.count("stats") && !vm.count("summary") && !vm.count("binary") &&
+           !vm.count("approximate") && !options.calibrate && !options.hierarchical && !paired && !options.minQuality && !vm.count("checkpoint") && !vm.count("cache") && !options.seedBySequence &&
+           vm["engine"].defaulted() && server && *server)
+        {
+            options.serverSocket = server;
+            serverFromEnvironment = true;
+        }
     }
     catch(po::error& e)
     {
@@ -179,6 +622,65 @@ int main(int argc, char **argv)
 {
     // parse command line
     ClassifierOptions options = parseCommandLine(argc, argv);
+
+    // binary results back to text
+    if (!convertInputs.empty())
+    {
+        for (std::vector<std::string>::const_iterator it=convertInputs.begin(); it!=convertInputs.end(); ++it)
+        {
+            std::ifstream input(it->c_str(), std::ios::binary);
+            try {
+                if (!input.is_open())
+                    throw FileOpenException("Could not open " + *it);
+                convertResults(input, std::cout);
+            }
+            catch (std::exception &e) {
+                std::cerr << "OOPS! " << *it << ": " << e.what() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        return 0;
+    }
+
+    // server mode
+    if (!options.serveSocket.empty())
+    {
+        try {
+            runServer(options, options.serveSocket);
+        }
+        catch (std::exception &e) {
+            std::cerr << "OOPS! " << e.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    // client mode, falling back to classifying here if $SPINGO_SERVER is not running
+    if (!options.serverSocket.empty())
+    {
+        int fd = connectServer(options.serverSocket);
+        if (fd >= 0)
+        {
+            std::cerr << "Using server at " << options.serverSocket << " with kmer size " << options.kmerSize;
+            std::cerr << ", " << options.numBootstrap << " bootstrap samples";
+            std::cerr << " and subsample size 1/" << options.subsample << std::endl;
+            try {
+                runClient(options, fd);
+            }
+            catch (std::exception &e) {
+                std::cerr << "OOPS! " << e.what() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            return 0;
+        }
+
+        if (!serverFromEnvironment)
+        {
+            std::cerr << "OOPS! No server is listening on " << options.serverSocket << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cerr << "No server is listening on " << options.serverSocket << ", classifying locally" << std::endl;
+    }
     
     std::cerr << "Using " << options.numThreads << " thread" << (options.numThreads > 1 ? "s" : "");
     std::cerr << " with kmer size " << options.kmerSize;
@@ -188,12 +690,23 @@ int main(int argc, char **argv)
     // run the classifier
     try {
         Classifier classifier(options);
-        classifier.classify(options.inputFilename);
+        if (options.calibrate)
+        {
+            classifier.calibrate(options.inputFilename, options.calibrate, calibrateOptions);
+        }
+        else if (options.samples.empty() ? classifier.classify(options.inputFilename) : classifier.classify(options.samples))
+        {
+            exit(EXIT_FAILURE);
+        }
     }
     catch (FileOpenException &e) {
         std::cerr << "OOPS! " << e.what() << std::endl;
         exit(EXIT_FAILURE);
     }
+    catch (std::exception &e) {
+        std::cerr << "\nError: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
     
     return 0;
 }
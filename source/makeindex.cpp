@@ -19,9 +19,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 =============================================================================*/
 
 #include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <fstream>
+#include <cstdio>
 #include "common.h"
 #include "database.h"
+#include "memory.h"
+#include "rdp.h"
+#include "vregion.h"
 
 // version
 static const std::string versionString("Version 1.3");
@@ -39,6 +44,8 @@ static const int maxKmerSize = 15;
 static const int defaultKmerSize = 8;
 static const int minThreads = 1;
 static const int defaultThreads = 1;
+static const uint64_t defaultRunMemory = 1ULL << 30;
+static const uint64_t minRunMemory = 16ULL << 20;
 
 
 // somewhere to store the program options
@@ -46,6 +53,20 @@ struct ProgramOptions {
     int kmerSize;
     std::string dbFilename;
     int numThreads;
+    bool pinThreads;
+    uint64_t maxMemory;
+    bool external;
+    std::string tempDir;
+    bool estimate;
+    std::vector<std::string> rdpFiles;
+    std::string taxonomyFile;
+    RegionOptions region;
+    bool keepSequences;
+    std::string fromIndex;
+    std::string addFile;
+    bool compact;
+    unsigned int numShards;
+    SearchEngine engine;
 };
 
 
@@ -54,6 +75,9 @@ ProgramOptions parseCommandLine(int argc, char **argv)
 {
     // parse command line options
     ProgramOptions options;
+    std::string maxMemory;
+    std::string engine;
+    std::vector<unsigned int> sizes, positions;
     namespace po = boost::program_options;
     std::string title("SPINDEX - SPINGO index creator.\n" + versionString + " " + archString);
     po::options_description desc("Available options");
@@ -80,6 +104,115 @@ ProgramOptions parseCommandLine(int argc, char **argv)
             "processors,p",
             po::value<int>(&options.numThreads)->default_value(defaultThreads),
             "number of processor threads"
+        )
+        (
+            "pin-threads",
+            po::value<bool>(&options.pinThreads)->zero_tokens()->default_value(false),
+            "if specified, each processor thread is kept on a CPU of its own, in turn (Linux only)"
+        )
+        (
+            "max-memory",
+            po::value<std::string>(&maxMemory),
+            "memory limit, e.g. 4G. A compact index is built if needed to stay within it, "
+            "or the index is built on disk if even that would not fit"
+        )
+        (
+            "external",
+            po::value<bool>(&options.external)->zero_tokens()->default_value(false),
+            "build the index on disk, through sorted runs of its kmers in --temp-dir, "
+            "holding no more than --max-memory of them (1G if not given) at once"
+        )
+        (
+            "temp-dir",
+            po::value<std::string>(&options.tempDir),
+            "where the runs of an index built on disk are written, by default alongside the index"
+        )
+        (
+            "estimate",
+            po::value<bool>(&options.estimate)->zero_tokens()->default_value(false),
+            "report the estimated memory needed for each kmer size, without building an index"
+        )
+        (
+            "rdp",
+            po::value<std::vector<std::string> >(&options.rdpFiles)->multitoken(),
+            "build from RDP fasta files (may be gzipped) instead of the database fasta. "
+            "The index is named after --database"
+        )
+        (
+            "taxonomy",
+            po::value<std::string>(&options.taxonomyFile),
+            "taxonomy map selecting and labelling the RDP sequences used with --rdp"
+        )
+        (
+            "primers",
+            po::value<std::string>(&options.region.primerFile),
+            "index only the variable region between these primers, as vripper would extract it. "
+            "The index is named DATABASE.PRIMERS.idx_K, after the primer file"
+        )
+        (
+            "region",
+            po::value<std::vector<unsigned int> >(&positions)->multitoken(),
+            "index only positions START to END of each reference, instead of using primers. "
+            "The index is named DATABASE.START-END.idx_K"
+        )
+        (
+            "keep-sequences",
+            po::value<bool>(&options.keepSequences)->zero_tokens()->default_value(false),
+            "store the reference sequences in the index, so that region indexes can be derived from it"
+        )
+        (
+            "from-index",
+            po::value<std::string>(&options.fromIndex),
+            "derive the --primers or --region index from this index, built with --keep-sequences, "
+            "instead of from sequence files"
+        )
+        (
+            "add",
+            po::value<std::string>(&options.addFile),
+            "add the references in this fasta file to the existing index, as a new segment, "
+            "instead of rebuilding it"
+        )
+        (
+            "shards",
+            po::value<unsigned int>(&options.numShards)->default_value(0),
+            "build the index as this many shards, DATABASE.shard1.idx_K and so on, "
+            "each holding an equal share of the references. See spingo --shards"
+        )
+        (
+            "compact",
+            po::value<bool>(&options.compact)->zero_tokens()->default_value(false),
+            "fold the segments added to the index into it"
+        )
+        (
+            "engine",
+            po::value<std::string>(&engine)->default_value("auto"),
+            "bitmatrix also writes a bit matrix of the index, INDEX.bits, for spingo --engine bitmatrix to load. "
+            "auto writes it when the index is dense enough, postings never does"
+        )
+        (
+            "trim",
+            po::value<std::string>(&options.region.trim),
+            "with --primers, the primers to cut off: 'fr', 'f' or 'r'"
+        )
+        (
+            "require",
+            po::value<std::string>(&options.region.require),
+            "with --primers, the primers a reference must contain: 'fr', 'f' or 'r'"
+        )
+        (
+            "sizes",
+            po::value<std::vector<unsigned int> >(&sizes)->multitoken(),
+            "with --primers, min and max lengths of the region"
+        )
+        (
+            "mismatch",
+            po::value<bool>(&options.region.mismatch)->zero_tokens()->default_value(false),
+            "with --primers, allow a single substitution, insertion or deletion in each primer"
+        )
+        (
+            "badchars",
+            po::value<int>(&options.region.badchars)->default_value(-1),
+            "with --primers, the most ambiguous bases allowed in a reference (-1 for any)"
         );
 
     po::variables_map vm;
@@ -118,8 +251,77 @@ ProgramOptions parseCommandLine(int argc, char **argv)
             throw po::error(msg.str());
         }
 
+        options.maxMemory = 0;
+        if(vm.count("max-memory"))
+        {
+            try {
+                options.maxMemory = parseMemorySize(maxMemory);
+            }
+            catch(std::invalid_argument& e) {
+                throw po::error(std::string("max-memory (--max-memory): ") + e.what());
+            }
+        }
+
+        try {
+            options.engine = parseSearchEngine(engine);
+        }
+        catch(std::invalid_argument& e) {
+            throw po::error(std::string("engine (--engine): ") + e.what());
+        }
+
         if(!vm.count("database"))
             throw po::error("database not specified");
+
+        if(vm.count("rdp") != vm.count("taxonomy"))
+            throw po::error("--rdp and --taxonomy must be used together");
+
+        if(vm.count("region"))
+        {
+            if (positions.size() != 2 || positions[0] < 1 || positions[1] < positions[0])
+                throw po::error("region (--region) needs a start and end position, counting from 1");
+            if (vm.count("primers"))
+                throw po::error("--region and --primers can not be used together");
+            options.region.regionStart = positions[0];
+            options.region.regionEnd = positions[1];
+        }
+
+        if(vm.count("from-index"))
+        {
+            if (!vm.count("primers") && !vm.count("region"))
+                throw po::error("--from-index needs --primers or --region");
+            if (vm.count("rdp") || options.estimate)
+                throw po::error("--from-index can not be used with --rdp or --estimate");
+        }
+
+        if(options.external && (vm.count("from-index") || options.estimate || options.compact))
+            throw po::error("--external can not be used with --from-index, --estimate or --compact");
+
+        if(options.external && options.engine == ENGINE_BITMATRIX)
+            throw po::error("--external can not be used with --engine bitmatrix");
+
+        if(vm.count("add") && (vm.count("rdp") || vm.count("from-index") || options.estimate))
+            throw po::error("--add can not be used with --rdp, --from-index or --estimate");
+
+        if(options.compact && (vm.count("add") || vm.count("rdp") || vm.count("from-index") || options.estimate))
+            throw po::error("--compact can not be used with --add, --rdp, --from-index or --estimate");
+
+        if(!vm["shards"].defaulted() && (options.numShards < 1 || vm.count("add") || options.compact || vm.count("from-index") || options.estimate))
+            throw po::error("--shards must be at least 1, and can not be used with --add, --compact, --from-index or --estimate");
+
+        if(vm.count("trim") && !validPrimerChoice(options.region.trim))
+            throw po::error("trim (--trim) must be one of fr, f or r");
+
+        if(vm.count("require") && !validPrimerChoice(options.region.require))
+            throw po::error("require (--require) must be one of fr, f or r");
+
+        if(vm.count("sizes"))
+        {
+            if (sizes.size() != 2)
+                throw po::error("sizes (--sizes) needs a min and max length");
+            options.region.filterSizes = true;
+            options.region.minSize = std::min(sizes[0], sizes[1]);
+            options.region.maxSize = std::max(sizes[0], sizes[1]);
+        }
     }
     catch(po::error& e)
     {
@@ -131,27 +333,480 @@ ProgramOptions parseCommandLine(int argc, char **argv)
     return options;
 }
 
+//======================================================================
+// References struct
+// The reference sequences to index: a fasta database or RDP files,
+// cut down to a variable region if primers are given
+//======================================================================
+struct References
+{
+    boost::scoped_ptr<FastaReader> fasta;
+    boost::scoped_ptr<RdpReader> rdp;
+    boost::scoped_ptr<RegionExtractor> extractor;
+    boost::scoped_ptr<RegionReader> region;
+    SequenceSource *source;
+    std::string name;
+
+    References(const ProgramOptions& options)
+    {
+        if (options.rdpFiles.empty())
+        {
+            name = options.addFile.empty() ? options.dbFilename : options.addFile;
+            fasta.reset(new FastaReader(name));
+            source = fasta.get();
+        }
+        else
+        {
+            // no intermediate fasta, the RDP records are converted as they are indexed
+            rdp.reset(new RdpReader(options.rdpFiles, options.taxonomyFile));
+            source = rdp.get();
+            name = "RDP files";
+        }
+
+        if (!options.region.primerFile.empty() || options.region.regionStart)
+        {
+            extractor.reset(new RegionExtractor(options.region));
+            region.reset(new RegionReader(*source, *extractor));
+            source = region.get();
+        }
+    }
+
+    // what was read and kept, once loaded
+    void report() const
+    {
+        if (rdp)
+            std::cerr << "(" << rdp->numKept() << " of " << rdp->numRead() << " RDP sequences in the taxonomy map)" << std::endl;
+        if (region)
+            std::cerr << "(" << region->numKept() << " of " << region->numRead() << " references contained the region)" << std::endl;
+    }
+};
+
+//======================================================================
+// ShardReader class
+// passes on only the references numbered first to last - 1, counting
+// from 0, of another source. The source is read under a lock so that
+// references are counted in the same order for every shard
+//======================================================================
+class ShardReader : public SequenceSource
+{
+private:
+    SequenceSource& source_;
+    uint64_t first_;
+    uint64_t last_;
+    uint64_t next_;
+    boost::mutex mutex_;
+
+public:
+    ShardReader(SequenceSource& source, uint64_t first, uint64_t last) :
+        source_(source), first_(first), last_(last), next_(0) {}
+
+    DnaSequence readSequence(ThreadStats *stats = NULL)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        DnaSequence seq;
+        while (next_ < last_ && (seq = source_.readSequence(stats)))
+        {
+            if (next_++ >= first_)
+                return seq;
+        }
+        return DnaSequence();
+    }
+};
+
+// name of the index file, which identifies the region and shard if there are any
+std::string indexFileName(const ProgramOptions& options, unsigned int shard = 0)
+{
+    std::stringstream s;
+    s << options.dbFilename;
+    if (!options.region.primerFile.empty())
+    {
+        std::string primers = options.region.primerFile.substr(options.region.primerFile.find_last_of('/') + 1);
+        s << "." << primers.substr(0, primers.find('.'));
+    }
+    else if (options.region.regionStart)
+    {
+        s << "." << options.region.regionStart << "-" << options.region.regionEnd;
+    }
+    if (shard)
+        s << ".shard" << shard;
+    s << ".idx_" << options.kmerSize;
+    return s.str();
+}
+
+// write the bit matrix of an index alongside it if the engine asks for one
+void writeSignatures(Database& db, const std::string& indexFile, const ProgramOptions& options)
+{
+    // any older matrix is out of date with the index
+    std::string fileName = Database::signatureFileName(indexFile);
+    remove(fileName.c_str());
+
+    IndexSummary summary = db.summary();
+    if (options.engine == ENGINE_POSTINGS || (options.engine == ENGINE_AUTO && !Database::preferSignatures(summary)))
+        return;
+    if (db.builtExternally())
+    {
+        // the postings were never held in memory to lay the matrix out from
+        if (options.engine == ENGINE_BITMATRIX)
+            std::cerr << "\n(no bit matrix written, the index was built on disk)";
+        return;
+    }
+    if (options.maxMemory > 0 && db.memoryUsage().total() + Database::signatureBytes(summary) > options.maxMemory)
+    {
+        if (options.engine == ENGINE_AUTO)
+            return;
+        std::cerr << "\nError: the bit matrix needs an estimated " << formatMemorySize(Database::signatureBytes(summary));
+        std::cerr << " more, which exceeds the memory limit of " << formatMemorySize(options.maxMemory) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    ScopedTimer tim;
+    std::cerr << "Writing bit matrix to " << fileName << "....";
+    db.buildSignatures();
+    db.saveSignatures(fileName);
+    std::cerr << "done. ";
+}
+
+// the layout that takes the least memory for an index
+IndexLayout smallestLayout(const IndexSummary& summary)
+{
+    return Database::preferSparse(summary) ? INDEX_SPARSE : INDEX_COMPACT;
+}
+
+// fold the segments of the index into it, replacing the index file
+void compactIndex(const ProgramOptions& options)
+{
+    std::string indexFile = indexFileName(options);
+    IndexSummary summary;
+    if (!Database::readSummary(indexFile, summary))
+    {
+        std::cerr << "\nError: Could not read index " << indexFile << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // the compacted index is laid out while the segments are still held. A dense
+    // index becomes sparse if, with its segments, most kmers still do not occur
+    Database::addSegmentSummaries(indexFile, summary);
+    IndexLayout layout = static_cast<IndexLayout>(summary.layout);
+    if (layout == INDEX_DENSE)
+        layout = Database::chooseLayout(summary, 0, 0, true);
+    if (options.maxMemory > 0)
+    {
+        IndexLayout fits = Database::chooseLayout(summary, options.maxMemory, 0, true);
+        if (fits == INDEX_NONE)
+        {
+            std::cerr << "\nError: compacting " << indexFile << " needs an estimated ";
+            std::cerr << formatMemorySize(summary.buildBytes(smallestLayout(summary)) + summary.annotationTableBytes());
+            std::cerr << " which exceeds the memory limit of " << formatMemorySize(options.maxMemory) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (fits != INDEX_DENSE)
+            layout = fits;
+    }
+
+    Database db;
+    unsigned int segments;
+    {
+        ScopedTimer tim;
+        std::cerr << "Loading index " << indexFile << "....";
+        db.setKeepSequences(true);
+        db.loadIndex(indexFile, layout);
+        segments = db.loadSegments(indexFile, layout);
+        std::cerr << "done, " << segments << " segment" << (segments == 1 ? "" : "s") << ". ";
+    }
+    if (segments == 0)
+    {
+        std::cerr << "\nNothing to compact" << std::endl;
+        return;
+    }
+
+    bool sequences = db.hasSequences();
+    db.compact();
+    if (sequences && !db.hasSequences())
+        std::cerr << "\n(reference sequences dropped, not every segment has them)";
+    std::cerr << "\n" << db.numSequences() << " reference sequences\nMemory: " << db.memoryUsage() << std::endl;
+
+    // written alongside and then moved over the index, so it is never left half written
+    {
+        ScopedTimer tim;
+        std::string tempFile = indexFile + ".tmp";
+        std::cerr << "Writing index to " << indexFile << "....";
+        db.saveIndex(tempFile);
+        if (rename(tempFile.c_str(), indexFile.c_str()) != 0)
+        {
+            std::cerr << "\nError: Could not replace index " << indexFile << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned int n=segments; n>0; n--)
+            remove(Database::segmentFileName(indexFile, n).c_str());
+        std::cerr << "done. ";
+    }
+    writeSignatures(db, indexFile, options);
+}
+
+// the layout an index can be built in within the memory limit. If it can only
+// be built on disk, external is set and the layout is the one it is written in
+IndexLayout buildLayout(const IndexSummary& summary, const ProgramOptions& options, bool& external)
+{
+    if (!external)
+    {
+        IndexLayout layout = Database::chooseLayout(summary, options.maxMemory, 0, true);
+        if (layout == INDEX_COMPACT)
+            std::cerr << "Building compact index to stay within " << formatMemorySize(options.maxMemory) << std::endl;
+        if (layout == INDEX_SPARSE)
+            std::cerr << "Building sparse index, as most kmers of size " << options.kmerSize << " do not occur" << std::endl;
+        if (layout != INDEX_NONE)
+            return layout;
+        if (!options.fromIndex.empty())
+        {
+            std::cerr << "\nError: kmer size " << options.kmerSize << " needs an estimated ";
+            std::cerr << formatMemorySize(summary.buildBytes(smallestLayout(summary)) + summary.annotationTableBytes());
+            std::cerr << " to build, which exceeds the memory limit of " << formatMemorySize(options.maxMemory) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        external = true;
+    }
+
+    // written dense, unless only compact would fit once loaded within the limit or it is sparse
+    IndexLayout layout = Database::chooseLayout(summary, options.maxMemory, 0, false);
+    if (layout == INDEX_NONE)
+        layout = smallestLayout(summary);
+    std::cerr << "Building " << (layout == INDEX_COMPACT ? "compact " : layout == INDEX_SPARSE ? "sparse " : "") << "index on disk";
+    if (options.maxMemory > 0)
+        std::cerr << " to stay within " << formatMemorySize(options.maxMemory);
+    std::cerr << std::endl;
+    return layout;
+}
+
+// memory left for the runs of an index built on disk, once its annotations are held
+uint64_t runMemory(const IndexSummary& summary, const ProgramOptions& options)
+{
+    if (options.maxMemory == 0)
+        return defaultRunMemory;
+    uint64_t other = summary.annotationTableBytes();
+    return options.maxMemory > other + minRunMemory ? options.maxMemory - other : minRunMemory;
+}
+
+// the runs of an index built on disk go alongside it unless told otherwise
+std::string runDirectory(const ProgramOptions& options)
+{
+    if (!options.tempDir.empty())
+        return options.tempDir;
+    std::string::size_type slash = options.dbFilename.find_last_of('/');
+    return slash == std::string::npos ? std::string(".") : options.dbFilename.substr(0, slash + (slash == 0));
+}
+
+// report how an index built on disk was spilled
+void reportRuns(const Database& db)
+{
+    if (db.builtExternally())
+        std::cerr << "(" << db.summary().numPostings << " kmers spilled in " << db.numRuns() << " sorted run" << (db.numRuns() == 1 ? "" : "s") << ")" << std::endl;
+}
+
+// quick pass over the reference sequences
+ReferenceScan scanReferences(const ProgramOptions& options)
+{
+    References references(options);
+    return Database::scanReferences(*references.source);
+}
+
+// print the estimated memory requirements for every kmer size
+void printEstimates(const ProgramOptions& options)
+{
+    ReferenceScan scan = scanReferences(options);
+    std::cout << "# " << scan.lengths.size() << " reference sequences\n";
+    std::cout << "#k\tpostings\tdense\tcompact\tdense_build\tcompact_build\tbitmatrix\tsparse\tsparse_build\n";
+    for (int k=minKmerSize; k<=maxKmerSize; k++)
+    {
+        IndexSummary summary = scan.estimate(k);
+        uint64_t annotations = summary.annotationTableBytes();
+        std::cout << k << "\t" << summary.numPostings;
+        std::cout << "\t" << formatMemorySize(summary.indexBytes(INDEX_DENSE) + annotations);
+        std::cout << "\t" << formatMemorySize(summary.indexBytes(INDEX_COMPACT) + annotations);
+        std::cout << "\t" << formatMemorySize(summary.buildBytes(INDEX_DENSE) + annotations);
+        std::cout << "\t" << formatMemorySize(summary.buildBytes(INDEX_COMPACT) + annotations);
+        std::cout << "\t" << formatMemorySize(Database::signatureBytes(summary)) << (Database::preferSignatures(summary) ? "*" : "");
+        std::cout << "\t" << formatMemorySize(summary.indexBytes(INDEX_SPARSE) + annotations) << (Database::preferSparse(summary) ? "*" : "");
+        std::cout << "\t" << formatMemorySize(summary.buildBytes(INDEX_SPARSE) + annotations) << "\n";
+    }
+}
+
+// build the index as shards of consecutive references, one at a time,
+// so that no more than one shard is ever held in memory
+void buildShards(const ProgramOptions& options, TaskScheduler& scheduler)
+{
+    ReferenceScan scan = scanReferences(options);
+    uint64_t numReferences = scan.lengths.size();
+    if (numReferences < options.numShards)
+    {
+        std::cerr << "\nError: " << options.numShards << " shards requested but there are only ";
+        std::cerr << numReferences << " reference sequences" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    Kmerizer kizer(options.kmerSize);
+    for (unsigned int shard=0; shard<options.numShards; shard++)
+    {
+        uint64_t first = numReferences * shard / options.numShards;
+        uint64_t last = numReferences * (shard + 1) / options.numShards;
+        std::cerr << "Shard " << shard + 1 << " of " << options.numShards << ": references ";
+        std::cerr << first + 1 << " to " << last << std::endl;
+
+        ReferenceScan part;
+        part.numLevels = scan.numLevels;
+        part.headerBytes = scan.headerBytes * (last - first) / numReferences;
+        part.lengths.assign(scan.lengths.begin() + first, scan.lengths.begin() + last);
+        IndexSummary summary = part.estimate(options.kmerSize);
+
+        bool external = options.external;
+        IndexLayout layout = buildLayout(summary, options, external);
+
+        References references(options);
+        ShardReader reader(*references.source, first, last);
+        Database db;
+        db.setKeepSequences(options.keepSequences);
+        if (external)
+            db.setExternalBuild(runDirectory(options), runMemory(summary, options));
+        db.load(reader, references.name, kizer, scheduler, layout);
+        reportRuns(db);
+        std::cerr << "Memory: " << db.memoryUsage() << std::endl;
+
+        std::string indexFile = indexFileName(options, shard + 1);
+        {
+            ScopedTimer tim;
+            std::cerr << "Writing index to " << indexFile << "....";
+            db.saveIndex(indexFile);
+            std::cerr << "done. ";
+        }
+        writeSignatures(db, indexFile, options);
+    }
+}
+
 int main(int argc, char **argv)
 {
     ProgramOptions options = parseCommandLine(argc, argv);
     
     try {
+        if (options.estimate)
+        {
+            printEstimates(options);
+            return 0;
+        }
+
+        if (options.compact)
+        {
+            compactIndex(options);
+            return 0;
+        }
+
+        // shared by every stage that runs in parallel
+        TaskScheduler scheduler(options.numThreads, options.pinThreads);
+
+        if (options.numShards)
+        {
+            buildShards(options, scheduler);
+            return 0;
+        }
+
+        // pick a layout that can be built within the memory limit, or build on disk.
+        // The larger kmer sizes are checked for the sparse layout whatever the limit
+        IndexLayout layout = INDEX_DENSE;
+        bool external = options.external;
+        uint64_t runBytes = defaultRunMemory;
+        if (options.maxMemory > 0 || Database::sparseCandidate(options.kmerSize))
+        {
+            IndexSummary summary;
+            if (options.fromIndex.empty())
+            {
+                summary = scanReferences(options).estimate(options.kmerSize);
+            }
+            else
+            {
+                // the region index is no larger than the full one, less the sequences
+                // it is derived from, which are held at the same time
+                if (!Database::readSummary(options.fromIndex, summary))
+                    throw boost::archive::archive_exception(boost::archive::archive_exception::unsupported_version);
+                summary.numSlots = (static_cast<uint64_t>(1) << (2 * options.kmerSize)) + 1;
+            }
+            layout = buildLayout(summary, options, external);
+            runBytes = runMemory(summary, options);
+        }
+        else if (external)
+        {
+            layout = buildLayout(IndexSummary(), options, external);
+        }
+
+        // a new segment has an index file and annotation table of its own
+        std::string indexFile = indexFileName(options);
+        IndexSummary baseSummary;
+        if (!options.addFile.empty() && !Database::readSummary(indexFile, baseSummary))
+        {
+            std::cerr << "\nError: Could not read index " << indexFile << ", build it before adding to it" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
         Kmerizer kizer(options.kmerSize);
         Database db;
-        db.load(options.dbFilename, kizer, options.numThreads);
+        if (!options.fromIndex.empty())
+        {
+            Database full;
+            full.setKeepSequences(true);
+            {
+                ScopedTimer tim;
+                std::cerr << "Loading index " << options.fromIndex << "....";
+                full.loadIndex(options.fromIndex, INDEX_COMPACT);
+                std::cerr << "done. ";
+            }
+            if (full.loadSegments(options.fromIndex, INDEX_COMPACT))
+                full.compact();
+            RegionExtractor extractor(options.region);
+            db.deriveRegion(full, extractor, kizer, scheduler, layout);
+        }
+        else
+        {
+            References references(options);
+            db.setKeepSequences(options.keepSequences);
+            if (external)
+                db.setExternalBuild(runDirectory(options), runBytes);
+            db.load(*references.source, references.name, kizer, scheduler, layout);
+            references.report();
+            reportRuns(db);
+        }
+
+        if (!options.addFile.empty())
+        {
+            if (baseSummary.numLevels != db.numLevels())
+            {
+                std::cerr << "\nError: " << options.addFile << " has " << db.numLevels() << " taxonomic levels but the index has ";
+                std::cerr << baseSummary.numLevels << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            indexFile = Database::segmentFileName(indexFile, Database::countSegments(indexFile) + 1);
+        }
+        std::cerr << "Memory: " << db.memoryUsage() << std::endl;
         
-        ScopedTimer tim;
-        std::stringstream s;
-        s << options.dbFilename << ".idx_" << options.kmerSize;
-        std::cerr << "Writing index to " << s.str() << "....";
-        std::ofstream ofs(s.str().c_str());
-        boost::archive::binary_oarchive oa(ofs);
-        //oa << db;
-        save_to(oa, db);
-        std::cerr << "done. ";
+        {
+            ScopedTimer tim;
+            std::cerr << "Writing index to " << indexFile << "....";
+            db.saveIndex(indexFile);
+            std::cerr << "done. ";
+        }
+
+        // spingo searches the postings of an index with segments
+        if (options.addFile.empty())
+            writeSignatures(db, indexFile, options);
+        else
+            remove(Database::signatureFileName(indexFileName(options)).c_str());
+    }
+    catch (FileOpenException &e) {
+        std::cerr << "\nError: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    catch (boost::archive::archive_exception &) {
+        std::cerr << "\nError: Could not read index " << options.fromIndex << std::endl;
+        exit(EXIT_FAILURE);
     }
-    catch (FileOpenException &) {
-        std::cerr << "\nError: Could not read from file" << std::endl;
+    catch (std::exception &e) {
+        std::cerr << "\nError: " << e.what() << std::endl;
         exit(EXIT_FAILURE);
     }
     
@@ -0,0 +1,98 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: memory.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <cstdlib>
+
+#include "memory.h"
+
+std::ostream& operator<<(std::ostream& os, const MemoryEstimate& estimate)
+{
+    os << "index " << formatMemorySize(estimate.index);
+    os << ", annotations " << formatMemorySize(estimate.annotations);
+    os << ", thread scratch " << formatMemorySize(estimate.threadScratch);
+    os << ", in flight " << formatMemorySize(estimate.inFlight);
+    os << ", total " << formatMemorySize(estimate.total());
+    return os;
+}
+
+// parse a size such as "512M" or "16G"
+uint64_t parseMemorySize(const std::string& size)
+{
+    char *end = NULL;
+    double value = strtod(size.c_str(), &end);
+    if (end == size.c_str() || value < 0)
+        throw std::invalid_argument("invalid memory size '" + size + "'");
+
+    std::string suffix(end);
+    double multiplier = 1;
+    if (suffix.empty() || suffix == "B" || suffix == "b")
+        multiplier = 1;
+    else if (suffix == "K" || suffix == "k")
+        multiplier = 1024.0;
+    else if (suffix == "M" || suffix == "m")
+        multiplier = 1024.0 * 1024.0;
+    else if (suffix == "G" || suffix == "g")
+        multiplier = 1024.0 * 1024.0 * 1024.0;
+    else if (suffix == "T" || suffix == "t")
+        multiplier = 1024.0 * 1024.0 * 1024.0 * 1024.0;
+    else
+        throw std::invalid_argument("invalid memory size '" + size + "'");
+
+    return static_cast<uint64_t>(value * multiplier);
+}
+
+// human readable size
+std::string formatMemorySize(uint64_t bytes)
+{
+    static const char *units[] = {"B", "K", "M", "G", "T"};
+    double value = static_cast<double>(bytes);
+    unsigned int unit = 0;
+    while (value >= 1024.0 && unit < 4)
+    {
+        value /= 1024.0;
+        unit++;
+    }
+
+    std::ostringstream s;
+    s << std::setprecision(unit ? 1 : 0) << std::fixed << value << units[unit];
+    return s.str();
+}
+
+// peak resident set size, read from /proc on Linux
+uint64_t peakResidentMemory()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            std::istringstream s(line.substr(6));
+            uint64_t kb = 0;
+            s >> kb;
+            return kb * 1024;
+        }
+    }
+    return 0;
+}
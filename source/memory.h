@@ -0,0 +1,63 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: memory.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __MEMORY_H__
+#define __MEMORY_H__
+
+#include <string>
+#include <ostream>
+#include <stdint.h>
+
+/* Memory accounting */
+
+// allowance for per-thread buffers which do not scale with the database
+static const uint64_t threadScratchOverhead = 256 * 1024;
+
+// allowance for the query sequence and output line held by each thread
+static const uint64_t inFlightPerThread = 64 * 1024;
+
+
+//======================================================================
+// MemoryEstimate struct
+// Breakdown of the memory used (or expected to be used) by a run
+//======================================================================
+struct MemoryEstimate
+{
+    uint64_t index;             // kmer index
+    uint64_t annotations;       // annotation strings and per-reference ids
+    uint64_t threadScratch;     // search buffers, all threads
+    uint64_t inFlight;          // sequences and output held by all threads
+
+    MemoryEstimate() : index(0), annotations(0), threadScratch(0), inFlight(0) {}
+    uint64_t total() const { return index + annotations + threadScratch + inFlight; }
+};
+
+std::ostream& operator<<(std::ostream& os, const MemoryEstimate& estimate);
+
+// parse a size such as "512M" or "16G", throws std::invalid_argument
+uint64_t parseMemorySize(const std::string& size);
+
+// human readable size, e.g. "1.5G"
+std::string formatMemorySize(uint64_t bytes);
+
+// peak resident set size of this process, 0 if unknown
+uint64_t peakResidentMemory();
+
+#endif /* __MEMORY_H__ */
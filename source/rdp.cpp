@@ -0,0 +1,263 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: rdp.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <cstdlib>
+#include <cctype>
+#include <unistd.h>
+
+#include "rdp.h"
+#include "common.h"
+
+// amount of decompressed data read at a time
+static const size_t bufferSize = 1 << 20;
+
+// whitespace as stripped by python
+static const char *whitespace = " \t\n\r\f\v";
+
+static std::string strip(const std::string& s)
+{
+    size_t first = s.find_first_not_of(whitespace);
+    if (first == std::string::npos)
+        return std::string();
+    size_t last = s.find_last_not_of(whitespace);
+    return s.substr(first, last - first + 1);
+}
+
+
+// check every input can be opened and load the taxonomy
+RdpReader::RdpReader(const std::vector<std::string>& fileNames, const std::string& taxonomyFile) :
+    filter_(!taxonomyFile.empty()), fileNames_(fileNames), nextFile_(0), file_(NULL), buffer_(bufferSize), pos_(0), end_(0), pending_(false), numRead_(0), numKept_(0)
+{
+    for (std::vector<std::string>::const_iterator it=fileNames_.begin(); it!=fileNames_.end(); ++it)
+    {
+        if (*it == "-")
+            continue;
+        gzFile f = gzopen(it->c_str(), "rb");
+        if (!f)
+        {
+            std::ostringstream msg;
+            msg << "Could not open " << *it;
+            throw FileOpenException(msg.str());
+        }
+        gzclose(f);
+    }
+    if (filter_)
+        loadTaxonomy(taxonomyFile);
+}
+
+
+RdpReader::~RdpReader()
+{
+    if (file_)
+        gzclose(file_);
+}
+
+
+// each line is an RDP id followed by its taxonomic levels, tab separated
+void RdpReader::loadTaxonomy(const std::string& fileName)
+{
+    std::ifstream input(fileName.c_str());
+    if (!input.is_open())
+    {
+        std::ostringstream msg;
+        msg << "Could not open " << fileName;
+        throw FileOpenException(msg.str());
+    }
+
+    std::string line;
+    while (std::getline(input, line))
+    {
+        std::vector<std::string> fields;
+        size_t start = 0, tab;
+        do {
+            tab = line.find('\t', start);
+            fields.push_back(strip(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start)));
+            start = tab + 1;
+        } while (tab != std::string::npos);
+
+        std::string taxonomy;
+        for (unsigned int i=1; i<fields.size(); i++)
+            taxonomy += (i > 1 ? "\t" : "") + fields[i];
+        taxonomy_[fields[0]] = taxonomy;
+    }
+}
+
+
+// start reading the next input file, false once they are all read
+bool RdpReader::openNext()
+{
+    if (nextFile_ == fileNames_.size())
+        return false;
+
+    const std::string& fileName = fileNames_[nextFile_++];
+    file_ = fileName == "-" ? gzdopen(dup(STDIN_FILENO), "rb") : gzopen(fileName.c_str(), "rb");
+    if (!file_)
+    {
+        throw FileOpenException("Could not open " + fileName);
+    }
+    gzbuffer(file_, bufferSize);
+    return true;
+}
+
+
+// refill the buffer from the current file, false at its end
+bool RdpReader::fill()
+{
+    if (!file_)
+        return false;
+
+    int n = gzread(file_, &buffer_[0], buffer_.size());
+    if (n < 0)
+    {
+        int error;
+        throw std::runtime_error("Could not read " + fileNames_[nextFile_ - 1] + ": " + gzerror(file_, &error));
+    }
+    if (n == 0)
+    {
+        gzclose(file_);
+        file_ = NULL;
+        return false;
+    }
+
+    pos_ = 0;
+    end_ = n;
+    return true;
+}
+
+
+// next line without its newline. The end of a file always ends a line
+bool RdpReader::readLine(std::string& line)
+{
+    line.clear();
+    while (true)
+    {
+        if (pos_ == end_ && !fill())
+        {
+            if (!line.empty())
+                return true;
+            if (!openNext())
+                return false;
+            continue;
+        }
+
+        const char *start = &buffer_[pos_];
+        const char *newline = static_cast<const char *>(memchr(start, '\n', end_ - pos_));
+        if (newline)
+        {
+            line.append(start, newline - start);
+            pos_ += newline - start + 1;
+            return true;
+        }
+        line.append(start, end_ - pos_);
+        pos_ = end_;
+    }
+}
+
+
+// the next record as it appears in the input, header stripped of '>'
+// and sequence lines stripped of whitespace
+bool RdpReader::readRecord(DnaSequence& seq)
+{
+    std::string line;
+    while (!pending_)
+    {
+        if (!readLine(line))
+            return false;
+        if (!line.empty() && line[0] == '>')
+        {
+            pendingHeader_ = strip(line).substr(1);
+            pending_ = true;
+        }
+    }
+
+    seq.header.swap(pendingHeader_);
+    seq.sequence.clear();
+    pending_ = false;
+    while (readLine(line))
+    {
+        if (!line.empty() && line[0] == '>')
+        {
+            pendingHeader_ = strip(line).substr(1);
+            pending_ = true;
+            break;
+        }
+        seq.sequence += strip(line);
+    }
+    seq.number = ++numRead_;
+    return true;
+}
+
+
+// the next record with a taxonomy, if there is one. Reading is serialised,
+// the lookup and case conversion are done by the calling thread
+DnaSequence RdpReader::readSequence(ThreadStats *stats)
+{
+    DnaSequence seq;
+    while (true)
+    {
+        {
+            PhaseTimer lockTimer(stats, PHASE_READER_LOCK);
+            scoped_lock lock(mutex_);
+            lockTimer.stop();
+            PhaseTimer parseTimer(stats, PHASE_PARSE);
+            if (!readRecord(seq))
+                return DnaSequence();
+
+            // without a taxonomy records are passed on unchanged, numbered as returned
+            if (!filter_)
+            {
+                if (!seq)
+                    continue;
+                seq.number = ++numKept_;
+                return seq;
+            }
+        }
+
+        // the id is the first word of the header
+        std::string id = seq.header.substr(0, seq.header.find_first_of(whitespace));
+        std::map<std::string, std::string>::const_iterator it = taxonomy_.find(id);
+        if (id.empty() || it == taxonomy_.end() || seq.sequence.empty())
+            continue;
+
+        seq.header = id + "\t" + it->second;
+        std::transform(seq.sequence.begin(), seq.sequence.end(), seq.sequence.begin(), ::toupper);
+
+        scoped_lock lock(mutex_);
+        numKept_++;
+        return seq;
+    }
+}
+
+
+long RdpReader::numRead()
+{
+    scoped_lock lock(mutex_);
+    return numRead_;
+}
+
+
+long RdpReader::numKept()
+{
+    scoped_lock lock(mutex_);
+    return numKept_;
+}
@@ -0,0 +1,81 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: rdp.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __RDP_H__
+#define __RDP_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <boost/thread/mutex.hpp>
+
+#include "fasta.h"
+
+/* Reference sequences read directly from the RDP release files */
+
+//======================================================================
+// RdpReader class
+// Reads RDP fasta files, gzipped or not, keeping only the sequences
+// listed in a taxonomy map. Each sequence is returned as a database
+// record, exactly as make_database.py writes it: the RDP id and its
+// taxonomy separated by tabs, with the sequence in upper case.
+// Without a taxonomy map every record is returned as it is read, so
+// it also serves as a reader for any fasta, compressed or on stdin ("-")
+//======================================================================
+class RdpReader : public SequenceSource
+{
+private:
+    typedef boost::mutex::scoped_lock scoped_lock;
+    boost::mutex mutex_;
+    bool filter_;                                   // only records in the taxonomy
+    std::map<std::string, std::string> taxonomy_;   // RDP id to tab separated taxonomy
+
+    // input files, read one after another
+    std::vector<std::string> fileNames_;
+    unsigned int nextFile_;
+    gzFile file_;
+
+    // decompressed data not yet split into lines
+    std::vector<char> buffer_;
+    size_t pos_, end_;
+
+    std::string pendingHeader_;                     // header line read ahead of its record
+    bool pending_;
+    long numRead_;                                  // records read from the RDP files
+    long numKept_;                                  // records returned
+
+    void loadTaxonomy(const std::string& fileName);
+    bool openNext();
+    bool fill();
+    bool readLine(std::string& line);
+    bool readRecord(DnaSequence& seq);
+
+public:
+    RdpReader(const std::vector<std::string>& fileNames, const std::string& taxonomyFile);
+    ~RdpReader();
+
+    DnaSequence readSequence(ThreadStats *stats = NULL);
+    long numRead();
+    long numKept();
+    size_t taxonomySize() const { return taxonomy_.size(); }
+};
+
+#endif /* __RDP_H__ */
@@ -0,0 +1,242 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: results.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <cstring>
+#include <vector>
+
+#include "results.h"
+#include "format.h"
+
+static const char resultsMagic[4] = {'S', 'P', 'G', 'R'};
+
+// codes for values which are not numbers
+static const unsigned int VALUE_NAN = 0;
+static const unsigned int VALUE_NEGATIVE_NAN = 1;
+static const unsigned int VALUE_OFFSET = 2;
+
+
+static void putVarint(std::string& buffer, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        buffer += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buffer += static_cast<char>(value);
+}
+
+static void putString(std::string& buffer, const char *data, size_t length)
+{
+    putVarint(buffer, length);
+    buffer.append(data, length);
+}
+
+// a value as printed with two decimal places, in hundredths
+static unsigned int encodeValue(float value)
+{
+    uint64_t hundredths;
+    bool negative;
+    if (!toHundredths(value, hundredths, negative))
+        return negative ? VALUE_NEGATIVE_NAN : VALUE_NAN;
+    return hundredths + VALUE_OFFSET;
+}
+
+
+void writeResultsHeader(std::ostream& s, const Database& db, unsigned int flags)
+{
+    std::string buffer(resultsMagic, sizeof(resultsMagic));
+    buffer += static_cast<char>(RESULTS_FORMAT_VERSION);
+    buffer += static_cast<char>(flags);
+    buffer += static_cast<char>(db.numLevels());
+    buffer += '\0';
+
+    putVarint(buffer, db.numAnnotations());
+    for (unsigned int id=0; id<db.numAnnotations(); id++)
+    {
+        const std::string& annotation = db.annotationFromId(id);
+        putString(buffer, annotation.data(), annotation.size());
+    }
+    s.write(buffer.data(), buffer.size());
+}
+
+void encodeResult(std::string& buffer, long record, const std::string& header, const Classification& result, unsigned int flags)
+{
+    putVarint(buffer, record);
+    if (flags & RESULTS_NAMES)
+    {
+        size_t tab = header.find('\t');
+        putString(buffer, header.data(), tab == std::string::npos ? header.size() : tab);
+    }
+
+    putVarint(buffer, encodeValue(result.score));
+    for (unsigned int i=0; i<result.annotationIds.size(); i++)
+    {
+        const std::vector<unsigned int>& ids = result.annotationIds[i];
+        putVarint(buffer, ids.size() == 1 ? ids[0] + 1 : 0);
+        putVarint(buffer, encodeValue(result.bootstraps[i]));
+    }
+
+    const std::vector<unsigned int>& first = result.annotationIds[0];
+    if ((flags & RESULTS_AMBIGUOUS) && first.size() != 1)
+    {
+        putVarint(buffer, first.size());
+        for (std::vector<unsigned int>::const_iterator it=first.begin(); it!=first.end(); ++it)
+            putVarint(buffer, *it);
+    }
+}
+
+
+//======================================================================
+// ResultsReader class
+// reads the fields of a binary result stream
+//======================================================================
+class ResultsReader
+{
+private:
+    std::istream& in_;
+
+public:
+    ResultsReader(std::istream& in) : in_(in) {}
+
+    // false at the end of the stream, throws part way through a value
+    bool varint(uint64_t& value, bool endAllowed = false)
+    {
+        value = 0;
+        for (unsigned int shift=0; shift<64; shift+=7)
+        {
+            int c = in_.get();
+            if (c == EOF)
+            {
+                if (endAllowed && shift == 0)
+                    return false;
+                throw ResultsFormatException("truncated result file");
+            }
+            value |= static_cast<uint64_t>(c & 0x7f) << shift;
+            if (!(c & 0x80))
+                return true;
+        }
+        throw ResultsFormatException("invalid result file");
+    }
+
+    uint64_t varint()
+    {
+        uint64_t value;
+        varint(value);
+        return value;
+    }
+
+    void string(std::string& value)
+    {
+        uint64_t length = varint();
+        if (length > (1 << 24))
+            throw ResultsFormatException("invalid result file");
+        value.resize(length);
+        if (length && !in_.read(&value[0], length))
+            throw ResultsFormatException("truncated result file");
+    }
+};
+
+// write an encoded value as the text output does
+static void writeValue(std::ostream& out, uint64_t value)
+{
+    if (value == VALUE_NAN)
+    {
+        out << "nan";
+    }
+    else if (value == VALUE_NEGATIVE_NAN)
+    {
+        out << "-nan";
+    }
+    else
+    {
+        std::string text;
+        value -= VALUE_OFFSET;
+        appendUnsigned(text, value / 100);
+        text += '.';
+        text += static_cast<char>('0' + (value % 100) / 10);
+        text += static_cast<char>('0' + value % 10);
+        out << text;
+    }
+}
+
+uint64_t convertResults(std::istream& in, std::ostream& out)
+{
+    char header[8];
+    if (!in.read(header, sizeof(header)) || memcmp(header, resultsMagic, sizeof(resultsMagic)) != 0)
+        throw ResultsFormatException("not a spingo binary result file");
+    if (static_cast<unsigned char>(header[4]) != RESULTS_FORMAT_VERSION)
+        throw ResultsFormatException("unsupported result file version");
+    unsigned int flags = static_cast<unsigned char>(header[5]);
+    unsigned int numLevels = static_cast<unsigned char>(header[6]);
+
+    ResultsReader reader(in);
+    std::vector<std::string> annotations(reader.varint());
+    for (std::vector<std::string>::iterator it=annotations.begin(); it!=annotations.end(); ++it)
+        reader.string(*it);
+
+    std::vector<uint64_t> ids(numLevels), bootstraps(numLevels);
+    std::string name;
+    uint64_t record, numRecords = 0;
+    while (reader.varint(record, true))
+    {
+        if (flags & RESULTS_NAMES)
+        {
+            reader.string(name);
+            out << name;
+        }
+        else
+        {
+            out << record;
+        }
+
+        out << "\t";
+        writeValue(out, reader.varint());
+        for (unsigned int i=0; i<numLevels; i++)
+        {
+            ids[i] = reader.varint();
+            bootstraps[i] = reader.varint();
+            if (ids[i] > annotations.size())
+                throw ResultsFormatException("invalid annotation in result file");
+        }
+
+        unsigned int i = numLevels;
+        while (i--)
+        {
+            out << "\t" << (ids[i] ? annotations[ids[i] - 1] : "AMBIGUOUS") << "\t";
+            writeValue(out, bootstraps[i]);
+        }
+
+        if ((flags & RESULTS_AMBIGUOUS) && numLevels && !ids[0])
+        {
+            uint64_t count = reader.varint();
+            for (uint64_t n=0; n<count; n++)
+            {
+                uint64_t id = reader.varint();
+                if (id >= annotations.size())
+                    throw ResultsFormatException("invalid annotation in result file");
+                if (count > 1)
+                    out << (n ? "," : "\t") << annotations[id];
+            }
+        }
+        out << "\n";
+        numRecords++;
+    }
+    return numRecords;
+}
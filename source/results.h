@@ -0,0 +1,80 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: results.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __RESULTS_H__
+#define __RESULTS_H__
+
+#include <string>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "classifier.h"
+
+/* Binary result format
+ *
+ * Integers are unsigned LEB128 varints. Scores and bootstraps are stored
+ * as they appear in the text output, in hundredths plus 2, with 0 and 1
+ * standing for "nan" and "-nan".
+ *
+ * header:  "SPGR", format version, flags, number of levels, 0
+ *          annotation count, then each annotation as length and bytes
+ * record:  record number (position in the input, from 1)
+ *          read name as length and bytes           if RESULTS_NAMES
+ *          score
+ *          each level, in database order:
+ *              annotation id + 1, or 0 for AMBIGUOUS
+ *              bootstrap
+ *          count and ids of the ambiguous annotations at the first
+ *          database level                          if RESULTS_AMBIGUOUS
+ *                                                  and it is AMBIGUOUS
+ */
+
+static const unsigned int RESULTS_FORMAT_VERSION = 1;
+
+enum ResultsFlags
+{
+    RESULTS_NAMES = 1,          // read names are stored, otherwise only record numbers
+    RESULTS_AMBIGUOUS = 2       // ambiguous annotations are listed, as with -a
+};
+
+
+//======================================================================
+// ResultsFormatException class
+// Raised when a binary result file cannot be read
+//======================================================================
+class ResultsFormatException : public std::runtime_error
+{
+public:
+    ResultsFormatException(const std::string &message) : std::runtime_error(message) {}
+};
+
+
+// write the header and annotation dictionary
+void writeResultsHeader(std::ostream& s, const Database& db, unsigned int flags);
+
+// append one record to buffer
+void encodeResult(std::string& buffer, long record, const std::string& header, const Classification& result, unsigned int flags);
+
+// convert a binary result stream to the text format, returns the number of records
+uint64_t convertResults(std::istream& in, std::ostream& out);
+
+#endif /* __RESULTS_H__ */
@@ -0,0 +1,190 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: scheduler.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <stdexcept>
+#include <boost/bind.hpp>
+
+#include "scheduler.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+TaskScheduler::TaskScheduler(unsigned int numThreads, bool pinThreads) :
+    numQueued_(0), numPending_(0), nextWorker_(0), stopping_(false), failed_(false)
+{
+    if (numThreads < 1)
+        numThreads = 1;
+
+#ifdef __linux__
+    // the CPUs the process is allowed on, before any worker is pinned
+    cpu_set_t allowed;
+    if (pinThreads && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int cpu=0; cpu<CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                cpus_.push_back(cpu);
+    }
+#endif
+
+    for (unsigned int i=0; i<numThreads; i++)
+        workers_.push_back(boost::shared_ptr<Worker>(new Worker));
+    for (unsigned int i=0; i<numThreads; i++)
+        threads_.create_thread(boost::bind(&TaskScheduler::runWorker, this, i));
+}
+
+// queued tasks are run before the workers stop
+TaskScheduler::~TaskScheduler()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        stopping_ = true;
+        queued_.notify_all();
+    }
+    threads_.join_all();
+}
+
+unsigned int TaskScheduler::currentWorker() const
+{
+    const unsigned int *index = current_.get();
+    return index ? *index : numThreads();
+}
+
+void TaskScheduler::submit(const Task& task)
+{
+    unsigned int index = currentWorker();
+    {
+        // counted before it can be taken, so the counts never fall below zero
+        boost::mutex::scoped_lock lock(mutex_);
+        if (index == numThreads())
+            index = nextWorker_++ % numThreads();
+        numPending_++;
+        numQueued_++;
+    }
+    {
+        Worker& worker = *workers_[index];
+        boost::mutex::scoped_lock lock(worker.mutex);
+        worker.tasks.push_back(task);
+    }
+    queued_.notify_one();
+}
+
+void TaskScheduler::wait()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    while (numPending_)
+        idle_.wait(lock);
+    if (failed_)
+    {
+        std::string error;
+        error.swap(error_);
+        failed_ = false;
+        throw std::runtime_error(error);
+    }
+}
+
+// the newest task of the worker's own deque, or else the oldest of another's
+bool TaskScheduler::takeTask(unsigned int index, Task& task)
+{
+    bool found = false;
+    for (unsigned int n=0; n<workers_.size() && !found; n++)
+    {
+        Worker& worker = *workers_[(index + n) % workers_.size()];
+        boost::mutex::scoped_lock lock(worker.mutex);
+        if (worker.tasks.empty())
+            continue;
+        if (n == 0)
+        {
+            task = worker.tasks.back();
+            worker.tasks.pop_back();
+        }
+        else
+        {
+            task = worker.tasks.front();
+            worker.tasks.pop_front();
+        }
+        found = true;
+    }
+
+    if (found)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        numQueued_--;
+    }
+    return found;
+}
+
+void TaskScheduler::runWorker(unsigned int index)
+{
+    current_.reset(new unsigned int(index));
+
+#ifdef __linux__
+    if (!cpus_.empty())
+    {
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(cpus_[index % cpus_.size()], &cpu);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+    }
+#endif
+
+    Task task;
+    while (true)
+    {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            while (numQueued_ == 0 && !stopping_)
+                queued_.wait(lock);
+            if (numQueued_ == 0)
+                return;
+        }
+
+        // another worker may have taken it first
+        if (!takeTask(index, task))
+            continue;
+
+        bool skip;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            skip = failed_;
+        }
+        bool threw = false;
+        std::string error;
+        try {
+            if (!skip)
+                task();
+        }
+        catch (std::exception& e) {
+            threw = true;
+            error = e.what();
+        }
+        task = Task();
+
+        boost::mutex::scoped_lock lock(mutex_);
+        if (threw && !failed_)
+        {
+            failed_ = true;
+            error_ = error;
+        }
+        if (--numPending_ == 0)
+            idle_.notify_all();
+    }
+}
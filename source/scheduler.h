@@ -0,0 +1,92 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: scheduler.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/tss.hpp>
+
+//======================================================================
+// TaskScheduler class
+// A fixed set of worker threads, each with a deque of tasks of its own.
+// A worker runs the newest task on its own deque, and once that is empty
+// steals the oldest from the others, so work spreads out without every
+// thread taking it from one shared queue. Tasks should be batches of
+// work rather than single reads, so that the locks are rarely contended
+//======================================================================
+class TaskScheduler
+{
+public:
+    typedef boost::function<void ()> Task;
+
+    // workers are optionally pinned one to each CPU the process may run on, in turn
+    TaskScheduler(unsigned int numThreads, bool pinThreads = false);
+    ~TaskScheduler();
+
+    // queue a task. From a worker it goes on that worker's own deque,
+    // otherwise the workers' deques are used in turn
+    void submit(const Task& task);
+
+    // block until every task submitted, and every task those submit, has
+    // run. Not to be called from a task. Once a task throws, the tasks still
+    // queued are dropped, and wait throws std::runtime_error with its message
+    void wait();
+
+    unsigned int numThreads() const { return workers_.size(); }
+
+    // index of the worker running the caller, numThreads() outside the workers
+    unsigned int currentWorker() const;
+
+private:
+    struct Worker
+    {
+        boost::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<boost::shared_ptr<Worker> > workers_;
+    std::vector<int> cpus_;             // CPUs to pin workers to, empty for none
+    boost::thread_group threads_;
+    boost::thread_specific_ptr<unsigned int> current_;
+
+    boost::mutex mutex_;
+    boost::condition_variable queued_;  // signalled when a task is submitted or on stopping
+    boost::condition_variable idle_;    // signalled when the last pending task finishes
+    uint64_t numQueued_;                // tasks on the deques
+    uint64_t numPending_;               // tasks submitted and not yet finished
+    unsigned int nextWorker_;           // deque for the next task from outside the workers
+    bool stopping_;
+    bool failed_;                       // a task has thrown since the last wait
+    std::string error_;                 // and its message
+
+    void runWorker(unsigned int index);
+    bool takeTask(unsigned int index, Task& task);
+};
+
+#endif /* __SCHEDULER_H__ */
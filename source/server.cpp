@@ -0,0 +1,846 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: server.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <map>
+#include <deque>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <cerrno>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "server.h"
+#include "scheduler.h"
+
+// sequences classified by each job
+static const size_t sequencesPerJob = 64;
+
+// jobs a connection may have queued, per worker thread
+static const size_t jobsPerWorker = 4;
+
+// frames larger than this are taken to be corrupt
+static const uint32_t maxFrameSize = 256 * 1024 * 1024;
+
+// buffer sizes
+static const size_t readBufferSize = 64 * 1024;
+static const size_t writeBufferSize = 64 * 1024;
+
+
+// describe the last system error
+static std::string systemError(const std::string& what)
+{
+    return what + ": " + strerror(errno);
+}
+
+// resolve a file name, so the client and server agree whatever their working directories
+static std::string absolutePath(const std::string& fileName)
+{
+    char resolved[PATH_MAX];
+    if (realpath(fileName.c_str(), resolved))
+        return resolved;
+    return fileName;
+}
+
+// fill in a socket address, checking the path fits
+static void socketAddress(const std::string& socketPath, struct sockaddr_un& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+        throw SocketException("socket path is too long: " + socketPath);
+    strcpy(address.sun_path, socketPath.c_str());
+}
+
+
+//======================================================================
+// FrameStream class
+//======================================================================
+FrameStream::FrameStream(int fd) : fd_(fd), in_(readBufferSize), inPos_(0), inEnd_(0)
+{
+}
+
+FrameStream::~FrameStream()
+{
+    close(fd_);
+}
+
+// make at least needed bytes available, returns false at end of stream
+bool FrameStream::fill(size_t needed)
+{
+    if (inEnd_ - inPos_ >= needed)
+        return true;
+
+    // move the unread bytes to the front
+    memmove(&in_[0], &in_[inPos_], inEnd_ - inPos_);
+    inEnd_ -= inPos_;
+    inPos_ = 0;
+    if (in_.size() < needed)
+        in_.resize(needed);
+
+    while (inEnd_ < needed)
+    {
+        ssize_t n = ::read(fd_, &in_[inEnd_], in_.size() - inEnd_);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw SocketException(systemError("read failed"));
+        if (n == 0)
+        {
+            if (inEnd_ > 0)
+                throw SocketException("connection closed part way through a frame");
+            return false;
+        }
+        inEnd_ += n;
+    }
+    return true;
+}
+
+bool FrameStream::read(char& type, std::string& payload)
+{
+    if (!fill(5))
+        return false;
+
+    const unsigned char *header = reinterpret_cast<const unsigned char*>(&in_[inPos_]);
+    type = header[0];
+    uint32_t length = (uint32_t(header[1]) << 24) | (uint32_t(header[2]) << 16) | (uint32_t(header[3]) << 8) | header[4];
+    if (length > maxFrameSize)
+        throw SocketException("invalid frame received");
+    inPos_ += 5;
+
+    if (!fill(length))
+        throw SocketException("connection closed part way through a frame");
+    payload.assign(&in_[inPos_], length);
+    inPos_ += length;
+    return true;
+}
+
+static void appendFrameHeader(std::string& out, char type, size_t length)
+{
+    out += type;
+    out += static_cast<char>((length >> 24) & 0xff);
+    out += static_cast<char>((length >> 16) & 0xff);
+    out += static_cast<char>((length >> 8) & 0xff);
+    out += static_cast<char>(length & 0xff);
+}
+
+void FrameStream::write(char type, const std::string& payload)
+{
+    appendFrameHeader(out_, type, payload.size());
+    out_ += payload;
+    if (out_.size() >= writeBufferSize)
+        flush();
+}
+
+void FrameStream::writeSequence(const std::string& header, const std::string& sequence)
+{
+    appendFrameHeader(out_, FRAME_SEQUENCE, header.size() + 1 + sequence.size());
+    out_ += header;
+    out_ += '\n';
+    out_ += sequence;
+    if (out_.size() >= writeBufferSize)
+        flush();
+}
+
+void FrameStream::flush()
+{
+    size_t written = 0;
+    while (written < out_.size())
+    {
+        ssize_t n = ::write(fd_, out_.data() + written, out_.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw SocketException(systemError("write failed"));
+        written += n;
+    }
+    out_.clear();
+}
+
+
+//======================================================================
+// ServerJob struct
+// a block of sequences from one connection, and their output
+//======================================================================
+struct ServerJob
+{
+    const Classifier *classifier;
+    unsigned int numBootstrap;
+    unsigned int subsample;
+    bool listAmbiguous;
+    std::vector<DnaSequence> sequences;
+    std::string output;
+    std::string error;              // why the block could not be classified, reported to the client
+    bool done;
+
+    void run()
+    {
+        Classification result;
+        output.clear();
+        try {
+            for (std::vector<DnaSequence>::const_iterator it=sequences.begin(); it!=sequences.end(); ++it)
+            {
+                classifier->classifySequence(it->sequence.data(), it->sequence.size(), NULL, it->number, numBootstrap, subsample, result);
+                classifier->formatResult(it->header, result, output, listAmbiguous);
+            }
+        }
+        catch (std::exception &e) {
+            error = e.what();
+        }
+    }
+};
+
+typedef boost::shared_ptr<ServerJob> ServerJobPtr;
+
+
+//======================================================================
+// WorkerPool class
+// runs jobs from all connections on one TaskScheduler. The scheduler only
+// waits for every task, so each connection waits for its own jobs here
+//======================================================================
+class WorkerPool
+{
+private:
+    boost::mutex mutex_;
+    boost::condition_variable finished_;
+    TaskScheduler scheduler_;
+
+    // a job reports its error to its client, so no task ever throws
+    void runJob(ServerJobPtr job)
+    {
+        job->run();
+
+        boost::mutex::scoped_lock lock(mutex_);
+        job->done = true;
+        finished_.notify_all();
+    }
+
+public:
+    WorkerPool(unsigned int numThreads, bool pinThreads) : scheduler_(numThreads, pinThreads) {}
+
+    unsigned int size() const { return scheduler_.numThreads(); }
+
+    void submit(const ServerJobPtr& job)
+    {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            job->done = false;
+        }
+        scheduler_.submit(boost::bind(&WorkerPool::runJob, this, job));
+    }
+
+    bool done(const ServerJobPtr& job)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        return job->done;
+    }
+
+    void wait(const ServerJobPtr& job)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        while (!job->done)
+            finished_.wait(lock);
+    }
+};
+
+
+//======================================================================
+// Server class
+// accepts connections and keeps each index it loads resident
+//======================================================================
+class Server
+{
+private:
+    typedef std::pair<std::string, int> IndexKey;      // database path and kmer size
+
+    // an index, loaded by the first connection to ask for it while others wait
+    struct ResidentIndex
+    {
+        boost::mutex mutex;
+        boost::shared_ptr<Classifier> classifier;
+    };
+    typedef std::map<IndexKey, boost::shared_ptr<ResidentIndex> > IndexMap;
+
+    ClassifierOptions options_;
+    WorkerPool pool_;
+    boost::mutex indexMutex_;       // guards the map only, not the loading
+    IndexMap indexes_;
+
+    void runConnection(int fd);
+    void serve(FrameStream& stream);
+    void serveSearches(FrameStream& stream, const Database& db);
+
+public:
+    Server(const ClassifierOptions& options) : options_(options), pool_(options.numThreads, options.pinThreads) {}
+
+    // get a resident index, loading it if necessary. Other indexes are served
+    // while it loads, and a load which fails is tried again by the next request
+    const Classifier& index(const std::string& dbFilename, int kmerSize);
+
+    // accept connections until killed
+    void run(int listener);
+};
+
+
+const Classifier& Server::index(const std::string& dbFilename, int kmerSize)
+{
+    IndexKey key(absolutePath(dbFilename), kmerSize);
+    boost::shared_ptr<ResidentIndex> resident;
+    {
+        boost::mutex::scoped_lock lock(indexMutex_);
+        boost::shared_ptr<ResidentIndex>& entry = indexes_[key];
+        if (!entry)
+            entry.reset(new ResidentIndex);
+        resident = entry;
+    }
+
+    boost::mutex::scoped_lock lock(resident->mutex);
+    if (resident->classifier)
+        return *resident->classifier;
+
+    ClassifierOptions options = options_;
+    options.dbFilename = key.first;
+    options.kmerSize = kmerSize;
+    options.statsFilename.clear();
+
+    std::cerr << "Loading index for " << key.first << " with kmer size " << kmerSize << std::endl;
+    resident->classifier.reset(new Classifier(options));
+    return *resident->classifier;
+}
+
+// parse a request, check it and run it
+void Server::serve(FrameStream& stream)
+{
+    char type;
+    std::string payload;
+    if (!stream.read(type, payload))
+        return;
+    if (type != FRAME_REQUEST)
+        throw SocketException("expected a request");
+
+    // key=value lines
+    std::map<std::string, std::string> request;
+    std::istringstream lines(payload);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        size_t eq = line.find('=');
+        if (eq != std::string::npos)
+            request[line.substr(0, eq)] = line.substr(eq + 1);
+    }
+
+    if (atoi(request["version"].c_str()) != SERVER_PROTOCOL_VERSION)
+        throw std::runtime_error("client and server versions do not match");
+
+    int kmerSize = atoi(request["kmersize"].c_str());
+    if (request["mode"] == "search")
+    {
+        if (request["database"].empty() || kmerSize < 1 || kmerSize > 15)
+            throw std::runtime_error("invalid request");
+        serveSearches(stream, index(request["database"], kmerSize).database());
+        return;
+    }
+
+    int numBootstrap = atoi(request["bootstrap"].c_str());
+    int subsample = atoi(request["subsample"].c_str());
+    if (request["database"].empty() || kmerSize < 1 || kmerSize > 15 || numBootstrap < 0 || subsample < 1)
+        throw std::runtime_error("invalid request");
+
+    const Classifier& classifier = index(request["database"], kmerSize);
+
+    // classify blocks of sequences as they arrive, sending results back in order
+    size_t maxPending = jobsPerWorker * pool_.size();
+    std::deque<ServerJobPtr> pending;
+    ServerJobPtr job;
+    long numRead = 0;
+    bool finished = false;
+
+    while (!finished)
+    {
+        if (!stream.read(type, payload))
+            throw SocketException("connection closed before the end of the input");
+
+        if (!job)
+        {
+            job.reset(new ServerJob);
+            job->classifier = &classifier;
+            job->numBootstrap = numBootstrap;
+            job->subsample = subsample;
+            job->listAmbiguous = request["ambiguous"] == "1";
+        }
+
+        if (type == FRAME_SEQUENCE)
+        {
+            size_t newline = payload.find('\n');
+            if (newline == std::string::npos)
+                throw SocketException("invalid sequence frame");
+            job->sequences.push_back(DnaSequence());
+            DnaSequence& seq = job->sequences.back();
+            seq.header.assign(payload, 0, newline);
+            seq.sequence.assign(payload, newline + 1, std::string::npos);
+            seq.number = ++numRead;
+        }
+        else if (type == FRAME_END)
+        {
+            finished = true;
+        }
+        else
+        {
+            throw SocketException("unexpected frame");
+        }
+
+        if (job->sequences.size() == sequencesPerJob || (finished && !job->sequences.empty()))
+        {
+            pool_.submit(job);
+            pending.push_back(job);
+            job.reset();
+        }
+
+        // send whatever has finished, waiting if too much is queued
+        bool sent = false;
+        while (!pending.empty() && (finished || pending.size() > maxPending || pool_.done(pending.front())))
+        {
+            pool_.wait(pending.front());
+            if (!pending.front()->error.empty())
+                throw std::runtime_error(pending.front()->error);
+            stream.write(FRAME_RESULTS, pending.front()->output);
+            pending.pop_front();
+            sent = true;
+        }
+        if (sent)
+            stream.flush();
+    }
+
+    std::ostringstream count;
+    count << numRead;
+    stream.write(FRAME_DONE, count.str());
+    stream.flush();
+}
+
+// append native integers to a frame payload, and read them back
+template<class T>
+static void appendNative(std::string& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<class T>
+static T readNative(const std::string& in, size_t& pos)
+{
+    if (pos + sizeof(T) > in.size())
+        throw SocketException("invalid frame received");
+    T value;
+    memcpy(&value, in.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+}
+
+// answer searches of one index, for a classifier gathering them from its shards
+void Server::serveSearches(FrameStream& stream, const Database& db)
+{
+    std::ostringstream index;
+    index << db.numLevels() << " " << db.numSequences() << "\n";
+    for (unsigned int id=0; id<db.numAnnotations(); id++)
+        index << db.annotationFromId(id) << "\n";
+    stream.write(FRAME_INDEX, index.str());
+    stream.flush();
+
+    char type;
+    std::string payload, reply;
+    KmerSequence query;
+    while (stream.read(type, payload))
+    {
+        if (type != FRAME_SEARCH || payload.size() % sizeof(kmerSize_t))
+            throw SocketException("unexpected frame");
+        query.kmers.resize(payload.size() / sizeof(kmerSize_t));
+        if (!query.kmers.empty())
+            memcpy(&query.kmers[0], payload.data(), payload.size());
+
+        ThreadStats stats;
+        searchHit hit = db.search(query, &stats);
+        uint32_t numHits = hit.annotationIds.empty() ? 0 : hit.annotationIds[0].size();
+
+        reply.clear();
+        appendNative<uint32_t>(reply, hit.topScore);
+        appendNative<uint64_t>(reply, stats.postingsScanned);
+        appendNative<uint64_t>(reply, stats.candidatesTouched);
+        appendNative<uint32_t>(reply, numHits);
+        for (unsigned int i=0; i<hit.annotationIds.size() && numHits; i++)
+            reply.append(reinterpret_cast<const char*>(&hit.annotationIds[i][0]), numHits * sizeof(unsigned int));
+        stream.write(FRAME_HITS, reply);
+        stream.flush();
+    }
+}
+
+// handle one client
+void Server::runConnection(int fd)
+{
+    FrameStream stream(fd);
+    try {
+        serve(stream);
+    }
+    catch (SocketException& e) {
+        std::cerr << "Connection dropped: " << e.what() << std::endl;
+    }
+    catch (std::exception& e) {
+        std::cerr << "Request failed: " << e.what() << std::endl;
+        try {
+            stream.write(FRAME_ERROR, e.what());
+            stream.flush();
+        }
+        catch (SocketException&) {
+        }
+    }
+}
+
+// socket to remove on exit
+static char socketPathToRemove[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static void removeSocket(int)
+{
+    unlink(socketPathToRemove);
+    _exit(EXIT_SUCCESS);
+}
+
+// create the listening socket
+static int listenSocket(const std::string& socketPath)
+{
+    struct sockaddr_un address;
+    socketAddress(socketPath, address);
+
+    // refuse to replace a live server, but clear up after a dead one
+    int existing = connectServer(socketPath);
+    if (existing >= 0)
+    {
+        close(existing);
+        throw SocketException("a server is already listening on " + socketPath);
+    }
+    unlink(socketPath.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        throw SocketException(systemError("could not create socket"));
+    if (bind(listener, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0)
+        throw SocketException(systemError("could not bind to " + socketPath));
+    if (listen(listener, SOMAXCONN) < 0)
+        throw SocketException(systemError("could not listen on " + socketPath));
+
+    strcpy(socketPathToRemove, socketPath.c_str());
+    signal(SIGINT, removeSocket);
+    signal(SIGTERM, removeSocket);
+    return listener;
+}
+
+void Server::run(int listener)
+{
+    std::cerr << "Ready, using " << pool_.size() << " thread" << (pool_.size() > 1 ? "s" : "") << std::endl;
+
+    while (true)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno != EINTR)
+                std::cerr << systemError("accept failed") << std::endl;
+            continue;
+        }
+        boost::thread(boost::bind(&Server::runConnection, this, fd)).detach();
+    }
+}
+
+
+void runServer(const ClassifierOptions& options, const std::string& socketPath)
+{
+    // a client going away must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // claim the socket before spending time loading
+    int listener = listenSocket(socketPath);
+    std::cerr << "Serving on " << socketPath << std::endl;
+
+    Server server(options);
+    if (!options.dbFilename.empty())
+        server.index(options.dbFilename, options.kmerSize);
+    server.run(listener);
+}
+
+
+int connectServer(const std::string& socketPath)
+{
+    struct sockaddr_un address;
+    socketAddress(socketPath, address);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// client thread sending the input sequences
+static void sendSequences(FrameStream& stream, FastaReader& reader)
+{
+    try {
+        DnaSequence seq;
+        while(seq = reader.readSequence())
+            stream.writeSequence(seq.header, seq.sequence);
+        stream.write(FRAME_END, "");
+        stream.flush();
+    }
+    catch (SocketException&) {
+        // the server closed the connection, the reason is read by the receiving side
+    }
+}
+
+void runClient(const ClassifierOptions& options, int fd)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    FastaReader reader(options.inputFilename);
+    FrameStream stream(fd);
+
+    std::ostringstream request;
+    request << "version=" << SERVER_PROTOCOL_VERSION << "\n";
+    request << "database=" << absolutePath(options.dbFilename) << "\n";
+    request << "kmersize=" << options.kmerSize << "\n";
+    request << "bootstrap=" << options.numBootstrap << "\n";
+    request << "subsample=" << options.subsample << "\n";
+    request << "ambiguous=" << (options.dumpAmbiguous ? 1 : 0) << "\n";
+    stream.write(FRAME_REQUEST, request.str());
+    stream.flush();
+
+    ScopedTimer tim;
+    std::cerr << "Classifying sequences....\n";
+
+    boost::thread sender(boost::bind(sendSequences, boost::ref(stream), boost::ref(reader)));
+
+    char type;
+    std::string payload;
+    while (true)
+    {
+        if (!stream.read(type, payload))
+            throw SocketException("server closed the connection");
+
+        if (type == FRAME_RESULTS)
+        {
+            std::cout << payload;
+        }
+        else if (type == FRAME_DONE)
+        {
+            std::cout.flush();
+            sender.join();
+            std::cerr << payload << " sequences processed.";
+            return;
+        }
+        else if (type == FRAME_ERROR)
+        {
+            throw SocketException("server: " + payload);
+        }
+        else
+        {
+            throw SocketException("unexpected frame from server");
+        }
+    }
+}
+
+
+//======================================================================
+// ShardConnection struct
+// a connection to each shard, used by one search at a time
+//======================================================================
+struct ShardConnection
+{
+    std::vector<boost::shared_ptr<FrameStream> > streams;
+    std::vector<std::string> indexes;       // the index frame each shard replied with
+};
+
+ShardClient::ShardClient(const std::string& dbFilename, int kmerSize, const std::vector<std::string>& sockets) :
+    dbFilename_(absolutePath(dbFilename)), kmerSize_(kmerSize), sockets_(sockets), numLevels_(0), numSequences_(0)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    // merge the shard annotation tables in shard order, as a single index would number them
+    boost::shared_ptr<ShardConnection> connection = connect();
+    std::map<std::string, unsigned int> annotationIds;
+    for (unsigned int shard=0; shard<sockets_.size(); shard++)
+    {
+        std::istringstream index(connection->indexes[shard]);
+        unsigned int numLevels;
+        uint64_t numSequences;
+        std::string line;
+        if (!(index >> numLevels >> numSequences) || !std::getline(index, line))
+            throw SocketException("invalid index frame from " + sockets_[shard]);
+        if (shard > 0 && numLevels != numLevels_)
+            throw SocketException("shards have different numbers of taxonomic levels");
+        numLevels_ = numLevels;
+        numSequences_ += numSequences;
+
+        mappings_.push_back(std::vector<unsigned int>());
+        while (std::getline(index, line))
+        {
+            std::map<std::string, unsigned int>::iterator it = annotationIds.find(line);
+            if (it == annotationIds.end())
+            {
+                it = annotationIds.insert(std::make_pair(line, annotations_.size())).first;
+                annotations_.push_back(line);
+            }
+            mappings_.back().push_back(it->second);
+        }
+    }
+    idle_.push_back(connection);
+}
+
+// open a connection to each shard
+boost::shared_ptr<ShardConnection> ShardClient::connect()
+{
+    boost::shared_ptr<ShardConnection> connection(new ShardConnection);
+    for (unsigned int shard=0; shard<sockets_.size(); shard++)
+    {
+        int fd = connectServer(sockets_[shard]);
+        if (fd < 0)
+            throw SocketException("no server is listening on " + sockets_[shard]);
+        boost::shared_ptr<FrameStream> stream(new FrameStream(fd));
+
+        std::ostringstream request;
+        request << "version=" << SERVER_PROTOCOL_VERSION << "\n";
+        request << "mode=search\n";
+        request << "database=" << dbFilename_ << ".shard" << shard + 1 << "\n";
+        request << "kmersize=" << kmerSize_ << "\n";
+        stream->write(FRAME_REQUEST, request.str());
+        stream->flush();
+        connection->streams.push_back(stream);
+    }
+
+    // the shards load their indexes in parallel
+    for (unsigned int shard=0; shard<sockets_.size(); shard++)
+    {
+        char type;
+        std::string payload;
+        if (!connection->streams[shard]->read(type, payload))
+            throw SocketException("shard server on " + sockets_[shard] + " closed the connection");
+        if (type == FRAME_ERROR)
+            throw SocketException("shard server on " + sockets_[shard] + ": " + payload);
+        if (type != FRAME_INDEX)
+            throw SocketException("unexpected frame from " + sockets_[shard]);
+        connection->indexes.push_back(payload);
+    }
+    return connection;
+}
+
+searchHit ShardClient::search(const KmerSequence& query, ThreadStats *stats)
+{
+    boost::shared_ptr<ShardConnection> connection;
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!idle_.empty())
+        {
+            connection = idle_.back();
+            idle_.pop_back();
+        }
+    }
+
+    searchHit hit;
+    hit.annotationIds.resize(numLevels_);
+    hit.topScore = 0;
+    try {
+        if (!connection)
+            connection = connect();
+
+        // send the query to every shard before waiting for any of them
+        std::string kmers(reinterpret_cast<const char*>(query.kmers.empty() ? NULL : &query.kmers[0]),
+                          query.kmers.size() * sizeof(kmerSize_t));
+        for (unsigned int shard=0; shard<sockets_.size(); shard++)
+        {
+            connection->streams[shard]->write(FRAME_SEARCH, kmers);
+            connection->streams[shard]->flush();
+        }
+
+        // keep the hits of the shards with the best score, in shard order
+        // so that they are in the order of the references of a single index
+        char type;
+        std::string payload;
+        uint64_t numHits = 0;
+        for (unsigned int shard=0; shard<sockets_.size(); shard++)
+        {
+            if (!connection->streams[shard]->read(type, payload) || type != FRAME_HITS)
+                throw SocketException("lost the shard server on " + sockets_[shard]);
+
+            size_t pos = 0;
+            uint32_t topScore = readNative<uint32_t>(payload, pos);
+            uint64_t postingsScanned = readNative<uint64_t>(payload, pos);
+            uint64_t candidatesTouched = readNative<uint64_t>(payload, pos);
+            uint32_t count = readNative<uint32_t>(payload, pos);
+            if (stats)
+            {
+                stats->postingsScanned += postingsScanned;
+                stats->candidatesTouched += candidatesTouched;
+            }
+
+            if (topScore < hit.topScore)
+                continue;
+            if (topScore > hit.topScore)
+            {
+                hit.topScore = topScore;
+                for (unsigned int i=0; i<numLevels_; i++)
+                    hit.annotationIds[i].clear();
+            }
+
+            const std::vector<unsigned int>& mapping = mappings_[shard];
+            for (unsigned int i=0; i<numLevels_; i++)
+            {
+                for (uint32_t n=0; n<count; n++)
+                {
+                    uint32_t id = readNative<uint32_t>(payload, pos);
+                    if (id >= mapping.size())
+                        throw SocketException("invalid annotation from " + sockets_[shard]);
+                    hit.annotationIds[i].push_back(mapping[id]);
+                }
+            }
+            numHits = hit.annotationIds.empty() ? 0 : hit.annotationIds[0].size();
+        }
+
+        if (stats)
+        {
+            stats->searches++;
+            stats->tieSizes.add(numHits);
+        }
+    }
+    catch (SocketException& e) {
+        // a failed shard fails the search, not the connection it was made for
+        throw std::runtime_error(e.what());
+    }
+
+    hit.score = static_cast<float>(hit.topScore) / static_cast<float>(query.kmers.size());
+
+    boost::mutex::scoped_lock lock(mutex_);
+    idle_.push_back(connection);
+    return hit;
+}
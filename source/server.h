@@ -0,0 +1,155 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: server.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "classifier.h"
+
+/* Classification server and client over a Unix domain socket.
+ *
+ * Every message is a frame: a one byte type, the payload length as a
+ * 4 byte big-endian integer, then the payload. A client sends one
+ * request frame, any number of sequence frames and an end frame. The
+ * server replies with result frames, in input order, as the sequences
+ * are classified, followed by a done frame, or an error frame if the
+ * request cannot be served.
+ *
+ * A request with mode=search instead asks for searches of a single index,
+ * so that a classifier can gather them from the shards of a larger one.
+ * The server replies with an index frame, then answers each search frame
+ * with a hits frame until the client closes the connection. Search and
+ * hits frames hold native integers, as both ends are on one machine.
+ */
+
+// protocol version, sent in the request
+static const int SERVER_PROTOCOL_VERSION = 2;
+
+enum FrameType
+{
+    FRAME_REQUEST = 'Q',        // key=value lines describing the run
+    FRAME_SEQUENCE = 'S',       // header, newline, sequence
+    FRAME_END = 'E',            // no more sequences
+    FRAME_RESULTS = 'R',        // output lines for a block of sequences
+    FRAME_DONE = 'D',           // number of sequences classified
+    FRAME_ERROR = 'X',          // error message, the connection is closed
+    FRAME_INDEX = 'I',          // number of levels and references, then the annotations, a line each
+    FRAME_SEARCH = 'K',         // query kmers
+    FRAME_HITS = 'H'            // top score, postings scanned, references touched, number of
+                                // hits, then the annotation ids of the hits at each level
+};
+
+
+//======================================================================
+// SocketException class
+// Raised when a socket cannot be used or the peer breaks the protocol
+//======================================================================
+class SocketException : public std::runtime_error
+{
+public:
+    SocketException(const std::string &message) : std::runtime_error(message) {}
+};
+
+
+//======================================================================
+// FrameStream class
+// Buffered frame reading and writing on a connected socket. Reading
+// and writing may be done from two different threads
+//======================================================================
+class FrameStream
+{
+private:
+    int fd_;
+    std::vector<char> in_;
+    size_t inPos_;
+    size_t inEnd_;
+    std::string out_;
+
+    bool fill(size_t needed);
+
+public:
+    FrameStream(int fd);
+    ~FrameStream();
+
+    // read the next frame, returns false at end of stream
+    bool read(char& type, std::string& payload);
+
+    // frames are buffered until flush() or the buffer is large
+    void write(char type, const std::string& payload);
+    void writeSequence(const std::string& header, const std::string& sequence);
+    void flush();
+};
+
+
+//======================================================================
+// ShardClient class
+// searches the shards of an index, each held by a server, and merges
+// their hits into those a single index would give. Shard N of DATABASE
+// is the index DATABASE.shardN, built by spindex --shards
+//======================================================================
+struct ShardConnection;
+
+class ShardClient
+{
+private:
+    std::string dbFilename_;
+    int kmerSize_;
+    std::vector<std::string> sockets_;
+    unsigned int numLevels_;
+    uint64_t numSequences_;
+    std::vector<std::string> annotations_;
+    std::vector<std::vector<unsigned int> > mappings_;  // shard annotation ids to merged ones
+
+    // connections not in use by a search, one to each shard
+    boost::mutex mutex_;
+    std::vector<boost::shared_ptr<ShardConnection> > idle_;
+
+    boost::shared_ptr<ShardConnection> connect();
+
+public:
+    // throws SocketException if a shard can not be reached
+    ShardClient(const std::string& dbFilename, int kmerSize, const std::vector<std::string>& sockets);
+
+    unsigned int numLevels() const { return numLevels_; }
+    uint64_t numSequences() const { return numSequences_; }
+    const std::vector<std::string>& annotations() const { return annotations_; }
+
+    // search every shard, may be called from several threads
+    searchHit search(const KmerSequence& query, ThreadStats *stats);
+};
+
+
+// serve classification requests on socketPath until killed. options
+// supply the worker threads, memory limit, and the index to preload
+// if a database is given
+void runServer(const ClassifierOptions& options, const std::string& socketPath);
+
+// connect to a server, returns -1 if there is none listening
+int connectServer(const std::string& socketPath);
+
+// classify options.inputFilename on the server connected to fd,
+// writing results to stdout
+void runClient(const ClassifierOptions& options, int fd);
+
+#endif /* __SERVER_H__ */
@@ -0,0 +1,185 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: spill.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+#include "spill.h"
+
+// smallest run, and read buffer of a run while merging, in pairs
+static const size_t minRunPairs = 1 << 16;
+static const size_t minBufferPairs = 1 << 12;
+
+
+RunMerger::RunMerger(const std::vector<std::string>& fileNames, uint64_t bufferBytes)
+{
+    size_t bufferPairs = fileNames.empty() ? 0 : bufferBytes / sizeof(uint64_t) / fileNames.size();
+    bufferPairs = std::max(bufferPairs, minBufferPairs);
+
+    for (size_t i=0; i<fileNames.size(); i++)
+    {
+        boost::shared_ptr<Run> run(new Run);
+        run->fileName = fileNames[i];
+        run->input.open(fileNames[i].c_str(), std::ios::binary);
+        if (!run->input)
+        {
+            throw std::runtime_error("Could not read temporary file " + fileNames[i]);
+        }
+        run->buffer.resize(bufferPairs);
+        run->next = 0;
+        runs_.push_back(run);
+        if (refill(*run))
+            heads_.push(Head(run->buffer[0], i));
+    }
+}
+
+
+// read the next buffer of a run, false at its end
+bool RunMerger::refill(Run& run)
+{
+    run.buffer.resize(run.buffer.capacity());
+    run.input.read(reinterpret_cast<char *>(&run.buffer[0]), run.buffer.size() * sizeof(uint64_t));
+    if (run.input.bad() || run.input.gcount() % sizeof(uint64_t))
+    {
+        throw std::runtime_error("Could not read temporary file " + run.fileName);
+    }
+    run.buffer.resize(run.input.gcount() / sizeof(uint64_t));
+    run.next = 0;
+    return !run.buffer.empty();
+}
+
+
+bool RunMerger::next(uint64_t& pair)
+{
+    if (heads_.empty())
+        return false;
+
+    Head head = heads_.top();
+    heads_.pop();
+    pair = head.first;
+
+    Run& run = *runs_[head.second];
+    if (++run.next < run.buffer.size() || refill(run))
+        heads_.push(Head(run.buffer[run.next], head.second));
+    return true;
+}
+
+
+KmerSpill::KmerSpill(const std::string& directory, uint64_t memory, uint64_t numSlots, TaskScheduler& scheduler) :
+    directory_(directory), memory_(memory), numSlots_(numSlots), scheduler_(scheduler), numPairs_(0), numWriting_(0),
+    writingBytes_(0), peakBytes_(0)
+{
+    // a run for each thread, all but one being written while the last is gathered
+    unsigned int numThreads = std::max(scheduler.numThreads(), 1U);
+    runPairs_ = std::max(static_cast<size_t>(memory / sizeof(uint64_t) / numThreads), minRunPairs);
+    maxWriting_ = numThreads - 1;
+}
+
+
+KmerSpill::~KmerSpill()
+{
+    for (std::vector<std::string>::const_iterator it=runFiles_.begin(); it!=runFiles_.end(); ++it)
+        remove(it->c_str());
+}
+
+
+void KmerSpill::add(unsigned int id, const std::vector<kmerSize_t>& kmers)
+{
+    uint64_t ignored = numSlots_ - 1;
+    if (buffer_.capacity() < runPairs_)
+        buffer_.reserve(runPairs_);
+
+    for (std::vector<kmerSize_t>::const_iterator it=kmers.begin(); it!=kmers.end(); ++it)
+    {
+        if (*it == ignored)
+            continue;
+        buffer_.push_back((static_cast<uint64_t>(*it) << 32) | id);
+        numPairs_++;
+        if (buffer_.size() == runPairs_)
+            spill(true);
+    }
+}
+
+
+void KmerSpill::finish()
+{
+    if (!buffer_.empty())
+        spill(false);
+    std::vector<uint64_t>().swap(buffer_);
+}
+
+
+// hand the gathered run on to be written, in the background if a thread is free
+void KmerSpill::spill(bool background)
+{
+    boost::shared_ptr<std::vector<uint64_t> > run(new std::vector<uint64_t>);
+    run->swap(buffer_);
+    uint64_t runBytes = run->size() * sizeof(uint64_t);
+
+    std::ostringstream fileName;
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        fileName << directory_ << "/spindex." << getpid() << "." << runFiles_.size() << ".run";
+        runFiles_.push_back(fileName.str());
+        background = background && numWriting_ < maxWriting_;
+        peakBytes_ = std::max(peakBytes_, writingBytes_ + runBytes);
+        if (background)
+        {
+            numWriting_++;
+            writingBytes_ += runBytes;
+        }
+    }
+
+    if (background)
+        scheduler_.submit(boost::bind(&KmerSpill::writeRun, this, run, fileName.str(), true));
+    else
+        writeRun(run, fileName.str(), false);
+}
+
+
+// sort a run and write it out, releasing it
+void KmerSpill::writeRun(boost::shared_ptr<std::vector<uint64_t> > run, const std::string& fileName, bool background)
+{
+    uint64_t runBytes = run->size() * sizeof(uint64_t);
+    std::sort(run->begin(), run->end());
+
+    std::ofstream output(fileName.c_str(), std::ios::binary | std::ios::trunc);
+    output.write(reinterpret_cast<const char *>(&(*run)[0]), run->size() * sizeof(uint64_t));
+    output.close();
+    if (!output)
+    {
+        throw std::runtime_error("Could not write temporary file " + fileName);
+    }
+    std::vector<uint64_t>().swap(*run);
+
+    if (background)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        numWriting_--;
+        writingBytes_ -= runBytes;
+    }
+}
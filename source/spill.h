@@ -0,0 +1,257 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: spill.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <fstream>
+#include <functional>
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/serialization/collection_size_type.hpp>
+#include <boost/serialization/array_wrapper.hpp>
+
+#include "kmerizer.h"
+#include "scheduler.h"
+
+/* External index build
+ *
+ * The (kmer, reference) pairs of an index too large to build in memory
+ * are packed one to a uint64_t, kmer above reference, so that sorting
+ * them orders them by kmer and then reference as the postings are. They
+ * are gathered into runs of a fixed size, each sorted and written to a
+ * file of its own, and the runs are merged back into one sorted stream
+ * as the index file is written.
+ */
+
+//======================================================================
+// RunMerger class
+// merges the sorted runs into one stream, reading each a buffer at a time
+//======================================================================
+class RunMerger
+{
+private:
+    struct Run
+    {
+        std::ifstream input;
+        std::string fileName;
+        std::vector<uint64_t> buffer;
+        size_t next;
+    };
+    typedef std::pair<uint64_t, size_t> Head;   // next pair of a run, and the run
+
+    std::vector<boost::shared_ptr<Run> > runs_;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads_;
+
+    bool refill(Run& run);
+
+public:
+    // bufferBytes shared between the runs
+    RunMerger(const std::vector<std::string>& fileNames, uint64_t bufferBytes);
+
+    // the next pair, false once every run is used up
+    bool next(uint64_t& pair);
+};
+
+//======================================================================
+// KmerSpill class
+// the kmers of the references, gathered in runs of no more than memory
+// bytes between them. Full runs are sorted and written by the scheduler's
+// threads while the next is gathered, or in turn if they are all busy
+//======================================================================
+class KmerSpill
+{
+private:
+    std::string directory_;
+    uint64_t memory_;
+    uint64_t numSlots_;             // kmer slots, the last being kmers with non-ACGTU bases
+    size_t runPairs_;
+    unsigned int maxWriting_;       // runs written at once in the background
+    TaskScheduler& scheduler_;
+
+    std::vector<uint64_t> buffer_;  // the run being gathered
+    uint64_t numPairs_;
+
+    boost::mutex mutex_;
+    std::vector<std::string> runFiles_;
+    unsigned int numWriting_;
+    uint64_t writingBytes_;         // kmers held by the runs being written
+    uint64_t peakBytes_;            // the most kmers held by the runs at once
+
+    void spill(bool background);
+    void writeRun(boost::shared_ptr<std::vector<uint64_t> > run, const std::string& fileName, bool background);
+
+    static uint32_t kmerOf(uint64_t pair) { return pair >> 32; }
+    static uint32_t referenceOf(uint64_t pair) { return pair & 0xffffffffULL; }
+
+    // the elements of a vector are written as one array, so may be written a chunk at a time
+    static const size_t chunkSize = 1 << 16;
+
+    template<class Archive>
+    static void saveChunk(Archive& ar, std::vector<uint32_t>& chunk)
+    {
+        if (!chunk.empty())
+            ar << boost::serialization::make_array(&chunk[0], chunk.size());
+        chunk.clear();
+    }
+
+    // the references of every pair, which are the postings of the compact and sparse layouts
+    template<class Archive>
+    void savePostings(Archive& ar) const
+    {
+        std::vector<uint32_t> chunk;
+        chunk.reserve(chunkSize);
+        uint64_t pair;
+
+        boost::serialization::collection_size_type numPostings(numPairs_);
+        ar << numPostings;
+        RunMerger merger(runFiles_, memory_);
+        while (merger.next(pair))
+        {
+            chunk.push_back(referenceOf(pair));
+            if (chunk.size() == chunkSize)
+                saveChunk(ar, chunk);
+        }
+        saveChunk(ar, chunk);
+    }
+
+public:
+    // runs are written to directory, and removed along with the spill
+    KmerSpill(const std::string& directory, uint64_t memory, uint64_t numSlots, TaskScheduler& scheduler);
+    ~KmerSpill();
+
+    // add the kmers of reference id. References are added in id order, one at a time
+    void add(unsigned int id, const std::vector<kmerSize_t>& kmers);
+
+    // write the last run, once the scheduler has finished every run before it
+    void finish();
+
+    uint64_t numSlots() const { return numSlots_; }
+    uint64_t numPairs() const { return numPairs_; }
+    unsigned int numRuns() const { return runFiles_.size(); }
+
+    // the most memory the kmers of the runs have taken at once, reported once they are written
+    uint64_t memoryUsage() const { return peakBytes_; }
+
+    // write the postings as Database::save would, one slot at a time
+    // as the dense layout has them, merged from the runs as they go
+    template<class Archive>
+    void saveDense(Archive& ar) const
+    {
+        RunMerger merger(runFiles_, memory_);
+        std::vector<unsigned int> slot;
+        uint64_t pair;
+        bool more = merger.next(pair);
+        for (uint64_t kmer=0; kmer<numSlots_; kmer++)
+        {
+            slot.clear();
+            for (; more && kmerOf(pair) == kmer; more = merger.next(pair))
+                slot.push_back(referenceOf(pair));
+            ar & slot;
+        }
+    }
+
+    // or as the offsets and postings arrays of the compact layout, written as
+    // std::vector<uint32_t> is, each from a pass over the runs of its own
+    template<class Archive>
+    void saveCompact(Archive& ar) const
+    {
+        std::vector<uint32_t> chunk;
+        chunk.reserve(chunkSize);
+        uint64_t pair;
+
+        boost::serialization::collection_size_type numOffsets(numSlots_ + 1);
+        ar << numOffsets;
+        {
+            RunMerger merger(runFiles_, memory_);
+            bool more = merger.next(pair);
+            uint32_t offset = 0;
+            for (uint64_t kmer=0; kmer<=numSlots_; kmer++)
+            {
+                chunk.push_back(offset);
+                for (; more && kmerOf(pair) == kmer; more = merger.next(pair))
+                    offset++;
+                if (chunk.size() == chunkSize || kmer == numSlots_)
+                    saveChunk(ar, chunk);
+            }
+        }
+
+        savePostings(ar);
+    }
+
+    // or as the kmers which occur, their offsets and the postings of the sparse
+    // layout. The kmers are counted first, taking a pass of their own
+    template<class Archive>
+    void saveSparse(Archive& ar) const
+    {
+        std::vector<uint32_t> chunk;
+        chunk.reserve(chunkSize);
+        uint64_t pair;
+
+        uint64_t numKmers = 0;
+        {
+            RunMerger merger(runFiles_, memory_);
+            for (uint64_t last=numSlots_; merger.next(pair); last=kmerOf(pair))
+                if (kmerOf(pair) != last)
+                    numKmers++;
+        }
+
+        boost::serialization::collection_size_type numOccurring(numKmers);
+        ar << numOccurring;
+        {
+            RunMerger merger(runFiles_, memory_);
+            for (uint64_t last=numSlots_; merger.next(pair); last=kmerOf(pair))
+            {
+                if (kmerOf(pair) == last)
+                    continue;
+                chunk.push_back(kmerOf(pair));
+                if (chunk.size() == chunkSize)
+                    saveChunk(ar, chunk);
+            }
+            saveChunk(ar, chunk);
+        }
+
+        boost::serialization::collection_size_type numOffsets(numKmers + 1);
+        ar << numOffsets;
+        {
+            RunMerger merger(runFiles_, memory_);
+            uint32_t offset = 0;
+            for (uint64_t last=numSlots_; merger.next(pair); last=kmerOf(pair), offset++)
+            {
+                if (kmerOf(pair) == last)
+                    continue;
+                chunk.push_back(offset);
+                if (chunk.size() == chunkSize)
+                    saveChunk(ar, chunk);
+            }
+            chunk.push_back(offset);
+            saveChunk(ar, chunk);
+        }
+
+        savePostings(ar);
+    }
+};
+
+#endif /* __SPILL_H__ */
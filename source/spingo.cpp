@@ -0,0 +1,222 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: spingo.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <stdexcept>
+#include <sstream>
+
+#include "spingo.h"
+#include "classifier.h"
+#include "memory.h"
+
+namespace spingo {
+
+// sequences classified by each task
+static const size_t sequencesPerTask = 64;
+
+
+// convert an internal classification to the public result
+static void toResult(const Classification& classification, size_t index, Result& result)
+{
+    result.index = index;
+    result.score = classification.score;
+    result.levels.resize(classification.annotationIds.size());
+    for (unsigned int i=0; i<classification.annotationIds.size(); i++)
+    {
+        const std::vector<unsigned int>& ids = classification.annotationIds[i];
+        result.levels[i].annotationId = ids.size() == 1 ? ids[0] : AMBIGUOUS;
+        result.levels[i].bootstrap = classification.bootstraps[i];
+        result.levels[i].candidates = ids;
+    }
+}
+
+// and back again
+static void fromResult(const Result& result, Classification& classification)
+{
+    classification.score = result.score;
+    classification.annotationIds.resize(result.levels.size());
+    classification.bootstraps.resize(result.levels.size());
+    for (unsigned int i=0; i<result.levels.size(); i++)
+    {
+        classification.annotationIds[i] = result.levels[i].candidates;
+        classification.bootstraps[i] = result.levels[i].bootstrap;
+    }
+}
+
+
+//======================================================================
+// ClassifyTask class
+// classifies one chunk of a batch per call
+//======================================================================
+class ClassifyTask : public Task
+{
+private:
+    const Classifier& classifier_;
+    const Sequence *sequences_;
+    size_t count_;
+    ResultHandler& handler_;
+    size_t firstRecord_;
+
+public:
+    ClassifyTask(const Classifier& classifier, const Sequence *sequences, size_t count, ResultHandler& handler, size_t firstRecord) :
+        classifier_(classifier), sequences_(sequences), count_(count), handler_(handler), firstRecord_(firstRecord) {}
+
+    void execute(size_t chunk)
+    {
+        Classification classification;
+        Result result;
+        size_t end = std::min(count_, (chunk + 1) * sequencesPerTask);
+        for (size_t i=chunk * sequencesPerTask; i<end; i++)
+        {
+            classifier_.classifySequence(sequences_[i].data, sequences_[i].length, firstRecord_ + i + 1, classification);
+            toResult(classification, i, result);
+            handler_.handle(result);
+        }
+    }
+};
+
+
+//======================================================================
+// BufferHandler class
+// stores results by batch position
+//======================================================================
+class BufferHandler : public ResultHandler
+{
+private:
+    std::vector<Result>& results_;
+
+public:
+    BufferHandler(std::vector<Result>& results) : results_(results) {}
+    void handle(const Result& result) { results_[result.index] = result; }
+};
+
+
+//======================================================================
+// Index::Impl class
+//======================================================================
+class Index::Impl
+{
+public:
+    boost::scoped_ptr<Classifier> classifier;
+};
+
+
+// open or build the index
+Index::Index(const std::string& databaseFile, const IndexOptions& options) : impl_(NULL)
+{
+    if (options.kmerSize < 1 || options.kmerSize > 15)
+        throw std::invalid_argument("kmerSize must be in the range [1,15]");
+    if (options.numBootstrap < 0 || options.subsample < 0 || options.numThreads < 1)
+        throw std::invalid_argument("numBootstrap and subsample must be >= 0, numThreads >= 1");
+
+    ClassifierOptions classifierOptions;
+    classifierOptions.kmerSize = options.kmerSize;
+    classifierOptions.numThreads = options.numThreads;
+    classifierOptions.pinThreads = false;
+    classifierOptions.numBootstrap = options.numBootstrap;
+    classifierOptions.subsample = options.subsample ? options.subsample : options.kmerSize;
+    classifierOptions.dbFilename = databaseFile;
+    classifierOptions.interleaved = false;
+    classifierOptions.minQuality = 0;
+    classifierOptions.seedBySequence = false;
+    classifierOptions.checkpointInterval = 0;
+    classifierOptions.resume = false;
+    classifierOptions.saveIndex = options.saveIndex;
+    classifierOptions.dumpAmbiguous = false;
+    classifierOptions.writeReads = true;
+    classifierOptions.binaryOutput = false;
+    classifierOptions.binaryNames = true;
+    classifierOptions.statsInterval = 0;
+    classifierOptions.statsPerf = false;
+    classifierOptions.maxMemory = options.maxMemory.empty() ? 0 : parseMemorySize(options.maxMemory);
+    classifierOptions.exhaustive = false;
+    classifierOptions.hierarchical = false;
+    classifierOptions.engine = ENGINE_AUTO;
+    classifierOptions.calibrate = 0;
+
+    // nothing is held until the index has loaded, so a throw leaks nothing
+    boost::scoped_ptr<Classifier> classifier(new Classifier(classifierOptions));
+    impl_ = new Impl;
+    impl_->classifier.swap(classifier);
+}
+
+Index::~Index()
+{
+    delete impl_;
+}
+
+unsigned int Index::kmerSize() const
+{
+    return impl_->classifier->database().kmerSize();
+}
+
+unsigned int Index::numLevels() const
+{
+    return impl_->classifier->database().numLevels();
+}
+
+unsigned int Index::numReferences() const
+{
+    return impl_->classifier->database().numSequences();
+}
+
+const std::string& Index::annotation(unsigned int id) const
+{
+    return impl_->classifier->database().annotationFromId(id);
+}
+
+// classify a batch, results passed to handler
+void Index::classify(const Sequence *sequences, size_t count, ResultHandler& handler, TaskRunner *runner, size_t firstRecord) const
+{
+    ClassifyTask task(*impl_->classifier, sequences, count, handler, firstRecord);
+    size_t numTasks = (count + sequencesPerTask - 1) / sequencesPerTask;
+
+    if (runner)
+    {
+        runner->run(numTasks, task);
+    }
+    else
+    {
+        for (size_t i=0; i<numTasks; i++)
+            task.execute(i);
+    }
+}
+
+// classify a batch into a result buffer
+void Index::classify(const Sequence *sequences, size_t count, std::vector<Result>& results, TaskRunner *runner, size_t firstRecord) const
+{
+    results.resize(count);
+    BufferHandler handler(results);
+    classify(sequences, count, handler, runner, firstRecord);
+}
+
+// format a result in the spingo text output format
+std::string Index::format(const std::string& name, const Result& result, bool listAmbiguous) const
+{
+    Classification classification;
+    fromResult(result, classification);
+
+    std::string line;
+    impl_->classifier->formatResult(name, classification, line, listAmbiguous);
+    if (!line.empty() && line[line.size() - 1] == '\n')
+        line.resize(line.size() - 1);
+    return line;
+}
+
+} // namespace spingo
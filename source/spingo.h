@@ -0,0 +1,190 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: spingo.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __SPINGO_H__
+#define __SPINGO_H__
+
+/* libspingo - embeddable classification API.
+ *
+ * Only standard library types appear in this header, and the classes
+ * hide their implementation, so programs built against it do not need
+ * the boost headers and are not affected by changes to the internals.
+ *
+ * Typical use:
+ *
+ *     spingo::IndexOptions options;
+ *     options.kmerSize = 8;
+ *     spingo::Index index("RDP_11.2.species.fa", options);
+ *
+ *     std::vector<spingo::Sequence> batch;     // pointers into caller memory
+ *     std::vector<spingo::Result> results;
+ *     index.classify(&batch[0], batch.size(), results);
+ */
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace spingo {
+
+// increment when the API changes incompatibly
+static const int API_VERSION = 1;
+
+// annotation id reported for a level with no unique assignment
+static const unsigned int AMBIGUOUS = 0xffffffffu;
+
+
+//======================================================================
+// IndexOptions struct
+// settings used to open an index, defaults match the spingo program
+//======================================================================
+struct IndexOptions
+{
+    int kmerSize;                   // kmer size [1,15]
+    int numBootstrap;               // bootstrap samples per sequence
+    int subsample;                  // 1/subsample of the kmers used for each bootstrap, 0 for kmerSize
+    int numThreads;                 // threads used if the index has to be built
+    bool saveIndex;                 // write the index next to the database if it was built
+    std::string maxMemory;          // memory limit, e.g. "4G", empty for none
+
+    IndexOptions() : kmerSize(8), numBootstrap(10), subsample(0), numThreads(1), saveIndex(false) {}
+};
+
+
+//======================================================================
+// Sequence struct
+// a query sequence held in caller memory. The data is not copied and
+// must stay valid until classification returns
+//======================================================================
+struct Sequence
+{
+    const char *data;
+    size_t length;
+
+    Sequence() : data(NULL), length(0) {}
+    Sequence(const char *d, size_t l) : data(d), length(l) {}
+};
+
+
+//======================================================================
+// LevelResult struct
+// assignment at one taxonomic level
+//======================================================================
+struct LevelResult
+{
+    unsigned int annotationId;              // unique assignment, or AMBIGUOUS
+    float bootstrap;                        // bootstrap support [0,1]
+    std::vector<unsigned int> candidates;   // all annotation ids tied for the best hit
+};
+
+
+//======================================================================
+// Result struct
+// classification of one sequence. Level 0 is the first taxonomic
+// column of the database headers
+//======================================================================
+struct Result
+{
+    size_t index;                           // position of the sequence in its batch
+    float score;                            // fraction of query kmers shared with the best hit
+    std::vector<LevelResult> levels;
+};
+
+
+//======================================================================
+// ResultHandler class
+// receives results as they are produced. handle() may be called
+// concurrently from several threads, in any order
+//======================================================================
+class ResultHandler
+{
+public:
+    virtual ~ResultHandler() {}
+    virtual void handle(const Result& result) = 0;
+};
+
+
+//======================================================================
+// Task / TaskRunner classes
+// lets the caller run classification on its own thread pool.
+// run() must call task.execute(i) exactly once for every i in
+// [0, count), from any threads, and return once all calls have finished
+//======================================================================
+class Task
+{
+public:
+    virtual ~Task() {}
+    virtual void execute(size_t index) = 0;
+};
+
+class TaskRunner
+{
+public:
+    virtual ~TaskRunner() {}
+    virtual void run(size_t count, Task& task) = 0;
+};
+
+
+//======================================================================
+// Index class
+// a loaded reference database. Loading is expensive; classification
+// is const and safe to call from several threads at once
+//======================================================================
+class Index
+{
+public:
+    // open the cached index for databaseFile at the requested kmer size,
+    // building it from the fasta database if necessary.
+    // Throws std::runtime_error if the database cannot be read
+    Index(const std::string& databaseFile, const IndexOptions& options = IndexOptions());
+    ~Index();
+
+    unsigned int kmerSize() const;
+    unsigned int numLevels() const;
+    unsigned int numReferences() const;
+
+    // annotation string for an id from a LevelResult
+    const std::string& annotation(unsigned int id) const;
+
+    // classify a batch, passing each result to handler. Without a runner
+    // the batch is classified on the calling thread. firstRecord is the
+    // number of sequences preceding the batch in its sample, and keeps
+    // bootstrap values identical to the spingo program
+    void classify(const Sequence *sequences, size_t count, ResultHandler& handler,
+                  TaskRunner *runner = NULL, size_t firstRecord = 0) const;
+
+    // classify a batch into a result buffer, indexed like the batch
+    void classify(const Sequence *sequences, size_t count, std::vector<Result>& results,
+                  TaskRunner *runner = NULL, size_t firstRecord = 0) const;
+
+    // format a result in the spingo text output format, without a trailing newline
+    std::string format(const std::string& name, const Result& result, bool listAmbiguous = false) const;
+
+private:
+    class Impl;
+    Impl *impl_;
+
+    Index(const Index&);
+    Index& operator=(const Index&);
+};
+
+} // namespace spingo
+
+#endif /* __SPINGO_H__ */
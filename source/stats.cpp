@@ -0,0 +1,416 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: stats.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <algorithm>
+
+#include "stats.h"
+#include "common.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char *phaseNames[NUM_STATS_PHASES] = {
+    "parse",
+    "kmerize",
+    "search_forward",
+    "search_reverse",
+    "bootstrap",
+    "format",
+    "output_write",
+    "reader_lock_wait",
+    "output_lock_wait"
+};
+
+static const char *perfNames[NUM_PERF_EVENTS] = {
+    "cycles",
+    "instructions",
+    "cache_misses",
+    "branch_misses"
+};
+
+
+// reset the histogram
+void Histogram::clear()
+{
+    std::fill(buckets_, buckets_ + NUM_BUCKETS, 0);
+    count_ = total_ = max_ = 0;
+}
+
+// add a value to the histogram
+void Histogram::add(uint64_t value)
+{
+    unsigned int bucket = 0;
+    uint64_t v = value;
+    while (v && bucket < NUM_BUCKETS - 1)
+    {
+        v >>= 1;
+        bucket++;
+    }
+    buckets_[bucket]++;
+    count_++;
+    total_ += value;
+    if (value > max_)
+        max_ = value;
+}
+
+// combine the contents of another histogram into this one
+void Histogram::merge(const Histogram& other)
+{
+    for (unsigned int i=0; i<NUM_BUCKETS; i++)
+        buckets_[i] += other.buckets_[i];
+    count_ += other.count_;
+    total_ += other.total_;
+    if (other.max_ > max_)
+        max_ = other.max_;
+}
+
+// upper bound of the bucket containing the given quantile
+uint64_t Histogram::quantile(double q) const
+{
+    if (count_ == 0)
+        return 0;
+
+    uint64_t target = static_cast<uint64_t>(q * count_);
+    uint64_t seen = 0;
+    for (unsigned int i=0; i<NUM_BUCKETS; i++)
+    {
+        seen += buckets_[i];
+        if (seen > target)
+            return std::min(max_, (static_cast<uint64_t>(1) << i) - 1);
+    }
+    return max_;
+}
+
+
+// reset all counters
+void ThreadStats::clear()
+{
+    std::fill(phaseNs, phaseNs + NUM_STATS_PHASES, 0);
+    std::fill(phaseCount, phaseCount + NUM_STATS_PHASES, 0);
+    std::fill(perf, perf + NUM_PERF_EVENTS, 0);
+    reads = searches = postingsScanned = candidatesTouched = 0;
+    tieSizes.clear();
+    readLatencyNs.clear();
+    perfValid = false;
+}
+
+// combine the counters of another thread into this one
+void ThreadStats::merge(const ThreadStats& other)
+{
+    for (unsigned int i=0; i<NUM_STATS_PHASES; i++)
+    {
+        phaseNs[i] += other.phaseNs[i];
+        phaseCount[i] += other.phaseCount[i];
+    }
+    reads += other.reads;
+    searches += other.searches;
+    postingsScanned += other.postingsScanned;
+    candidatesTouched += other.candidatesTouched;
+    tieSizes.merge(other.tieSizes);
+    readLatencyNs.merge(other.readLatencyNs);
+    if (other.perfValid)
+    {
+        for (unsigned int i=0; i<NUM_PERF_EVENTS; i++)
+            perf[i] += other.perf[i];
+        perfValid = true;
+    }
+}
+
+
+#ifdef __linux__
+// open a single hardware counter for the calling thread
+static int openPerfCounter(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// open the hardware counters for the calling thread
+PerfCounters::PerfCounters(bool enable)
+{
+    std::fill(fds_, fds_ + NUM_PERF_EVENTS, -1);
+#ifdef __linux__
+    if (!enable)
+        return;
+
+    static const uint64_t configs[NUM_PERF_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    for (unsigned int i=0; i<NUM_PERF_EVENTS; i++)
+        fds_[i] = openPerfCounter(configs[i]);
+#endif
+}
+
+// close the hardware counters
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+    for (unsigned int i=0; i<NUM_PERF_EVENTS; i++)
+        if (fds_[i] >= 0)
+            close(fds_[i]);
+#endif
+}
+
+// store the current counter values, counters which failed to open are left at zero
+void PerfCounters::read(ThreadStats& stats) const
+{
+#ifdef __linux__
+    for (unsigned int i=0; i<NUM_PERF_EVENTS; i++)
+    {
+        uint64_t value;
+        if (fds_[i] >= 0 && ::read(fds_[i], &value, sizeof(value)) == sizeof(value))
+        {
+            stats.perf[i] = value;
+            stats.perfValid = true;
+        }
+    }
+#endif
+}
+
+
+// open the report file, "-" for stderr
+StatsCollector::StatsCollector(const std::string& fileName, double interval, bool usePerf) :
+    fileName_(fileName), usePerf_(usePerf), loadSeconds_(0.0), startNs_(statsNow()),
+    interval_(interval), stopping_(false)
+{
+    if (fileName_ != "-")
+    {
+        output_.open(fileName_.c_str());
+        if (!output_.is_open())
+        {
+            std::ostringstream msg;
+            msg << "Could not open " << fileName_;
+            throw FileOpenException(msg.str());
+        }
+    }
+}
+
+StatsCollector::~StatsCollector()
+{
+    stopReporter();
+}
+
+void StatsCollector::setLoadSeconds(double seconds)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    loadSeconds_ = seconds;
+}
+
+void StatsCollector::setMemory(const MemoryEstimate& memory)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    memory_ = memory;
+}
+
+// register a worker thread
+unsigned int StatsCollector::addThread()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    threads_.push_back(ThreadStats());
+    return threads_.size() - 1;
+}
+
+// replace the snapshot for a worker thread
+void StatsCollector::publish(unsigned int slot, const ThreadStats& stats)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    threads_[slot] = stats;
+}
+
+// combined counters of all threads
+ThreadStats StatsCollector::total()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    ThreadStats sum;
+    for (std::vector<ThreadStats>::const_iterator it=threads_.begin(); it!=threads_.end(); ++it)
+        sum.merge(*it);
+    return sum;
+}
+
+// start the interval reporter
+void StatsCollector::start()
+{
+    startNs_ = statsNow();
+    if (interval_ > 0)
+        reporter_ = boost::thread(boost::bind(&StatsCollector::reporterThread, this));
+}
+
+// stop the interval reporter and write the final report
+void StatsCollector::finish()
+{
+    stopReporter();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    writeJson(true);
+}
+
+// signal the interval reporter to stop and wait for it
+void StatsCollector::stopReporter()
+{
+    if (!reporter_.joinable())
+        return;
+
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        stopping_ = true;
+    }
+    stopCondition_.notify_all();
+    reporter_.join();
+}
+
+// periodically write a report until stopped
+void StatsCollector::reporterThread()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!stopping_)
+    {
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(static_cast<long>(interval_ * 1000));
+        stopCondition_.timed_wait(lock, timeout);
+        if (!stopping_)
+            writeJson(false);
+    }
+}
+
+
+// json helpers
+static void writeHistogram(std::ostream& s, const Histogram& h, double scale)
+{
+    s << "{\"count\": " << h.count();
+    s << ", \"mean\": " << (h.count() ? h.total() / scale / h.count() : 0.0);
+    s << ", \"p50\": " << h.quantile(0.5) / scale;
+    s << ", \"p90\": " << h.quantile(0.9) / scale;
+    s << ", \"p99\": " << h.quantile(0.99) / scale;
+    s << ", \"max\": " << h.max() / scale;
+    s << ", \"buckets\": [";
+    bool first = true;
+    for (unsigned int i=0; i<Histogram::NUM_BUCKETS; i++)
+    {
+        if (!h.bucket(i))
+            continue;
+        if (!first)
+            s << ", ";
+        first = false;
+        s << "{\"le\": " << ((static_cast<uint64_t>(1) << i) - 1) / scale << ", \"count\": " << h.bucket(i) << "}";
+    }
+    s << "]}";
+}
+
+static void writePhases(std::ostream& s, const ThreadStats& t)
+{
+    s << "{";
+    for (unsigned int i=0; i<NUM_STATS_PHASES; i++)
+    {
+        if (i)
+            s << ", ";
+        s << "\"" << phaseNames[i] << "\": {\"seconds\": " << t.phaseNs[i] / 1e9 << ", \"count\": " << t.phaseCount[i] << "}";
+    }
+    s << "}";
+}
+
+static void writePerf(std::ostream& s, const ThreadStats& t)
+{
+    if (!t.perfValid)
+    {
+        s << "null";
+        return;
+    }
+    s << "{";
+    for (unsigned int i=0; i<NUM_PERF_EVENTS; i++)
+    {
+        if (i)
+            s << ", ";
+        s << "\"" << perfNames[i] << "\": " << t.perf[i];
+    }
+    s << "}";
+}
+
+// write a report, one json object per line. Must be called with mutex_ held
+void StatsCollector::writeJson(bool final)
+{
+    ThreadStats sum;
+    for (std::vector<ThreadStats>::const_iterator it=threads_.begin(); it!=threads_.end(); ++it)
+        sum.merge(*it);
+
+    double elapsed = (statsNow() - startNs_) / 1e9;
+
+    std::ostringstream s;
+    s << std::setprecision(6);
+    s << "{\"final\": " << (final ? "true" : "false");
+    s << ", \"load_seconds\": " << loadSeconds_;
+    s << ", \"classify_seconds\": " << elapsed;
+    s << ", \"threads\": " << threads_.size();
+    s << ", \"reads\": " << sum.reads;
+    s << ", \"reads_per_second\": " << (elapsed > 0 ? sum.reads / elapsed : 0.0);
+    s << ", \"searches\": " << sum.searches;
+    s << ", \"postings_scanned\": " << sum.postingsScanned;
+    s << ", \"candidates_touched\": " << sum.candidatesTouched;
+    s << ", \"phases\": ";
+    writePhases(s, sum);
+    s << ", \"tie_size\": ";
+    writeHistogram(s, sum.tieSizes, 1.0);
+    s << ", \"read_latency_us\": ";
+    writeHistogram(s, sum.readLatencyNs, 1000.0);
+    s << ", \"perf\": ";
+    writePerf(s, sum);
+    s << ", \"memory\": {\"index\": " << memory_.index;
+    s << ", \"annotations\": " << memory_.annotations;
+    s << ", \"thread_scratch\": " << memory_.threadScratch;
+    s << ", \"in_flight\": " << memory_.inFlight;
+    s << ", \"total\": " << memory_.total();
+    s << ", \"peak_rss\": " << peakResidentMemory() << "}";
+    s << ", \"per_thread\": [";
+    for (unsigned int i=0; i<threads_.size(); i++)
+    {
+        if (i)
+            s << ", ";
+        s << "{\"reads\": " << threads_[i].reads << ", \"phases\": ";
+        writePhases(s, threads_[i]);
+        s << ", \"perf\": ";
+        writePerf(s, threads_[i]);
+        s << "}";
+    }
+    s << "]}\n";
+
+    if (output_.is_open())
+    {
+        output_ << s.str();
+        output_.flush();
+    }
+    else
+        std::cerr << s.str();
+}
@@ -0,0 +1,216 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: stats.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdint.h>
+#include <time.h>
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "memory.h"
+
+/* Run-time profiling counters */
+
+// timed phases of the classification pipeline
+enum StatsPhase
+{
+    PHASE_PARSE = 0,        // reading and parsing input records
+    PHASE_KMERIZE,          // converting sequences to kmers
+    PHASE_SEARCH_FWD,       // forward strand search
+    PHASE_SEARCH_REV,       // reverse complement search
+    PHASE_BOOTSTRAP,        // bootstrap searches
+    PHASE_FORMAT,           // building the output line
+    PHASE_OUTPUT_WRITE,     // writing output while holding the output lock
+    PHASE_READER_LOCK,      // waiting for the input reader lock
+    PHASE_OUTPUT_LOCK,      // waiting for the output lock
+    NUM_STATS_PHASES
+};
+
+// hardware counters collected through perf_event_open
+enum PerfEvent
+{
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    NUM_PERF_EVENTS
+};
+
+// monotonic clock in nanoseconds
+inline uint64_t statsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+
+//======================================================================
+// Histogram class
+// Power-of-two bucketed histogram of unsigned values
+//======================================================================
+class Histogram
+{
+public:
+    static const unsigned int NUM_BUCKETS = 48;
+
+    Histogram() { clear(); }
+    void clear();
+    void add(uint64_t value);
+    void merge(const Histogram& other);
+
+    uint64_t count() const { return count_; }
+    uint64_t total() const { return total_; }
+    uint64_t max() const { return max_; }
+    uint64_t bucket(unsigned int i) const { return buckets_[i]; }
+
+    // upper bound of the bucket containing the given quantile
+    uint64_t quantile(double q) const;
+
+private:
+    uint64_t buckets_[NUM_BUCKETS];     // bucket i holds values in [2^(i-1), 2^i)
+    uint64_t count_;
+    uint64_t total_;
+    uint64_t max_;
+};
+
+
+//======================================================================
+// ThreadStats struct
+// Counters and timers owned by a single worker thread
+//======================================================================
+struct ThreadStats
+{
+    uint64_t phaseNs[NUM_STATS_PHASES];     // accumulated time per phase
+    uint64_t phaseCount[NUM_STATS_PHASES];  // number of timed intervals per phase
+    uint64_t reads;                         // query sequences classified
+    uint64_t searches;                      // database searches performed
+    uint64_t postingsScanned;               // postings list entries visited
+    uint64_t candidatesTouched;             // references with a non-zero score
+    Histogram tieSizes;                     // references tied for the top score
+    Histogram readLatencyNs;                // per-read wall time
+    uint64_t perf[NUM_PERF_EVENTS];         // hardware counters
+    bool perfValid;
+
+    ThreadStats() { clear(); }
+    void clear();
+    void merge(const ThreadStats& other);
+    void addPhase(StatsPhase phase, uint64_t ns) { phaseNs[phase] += ns; phaseCount[phase]++; }
+};
+
+
+//======================================================================
+// PhaseTimer class
+// Adds the time between its construction and destruction to a phase.
+// Does nothing when constructed with a NULL stats pointer
+//======================================================================
+class PhaseTimer
+{
+private:
+    ThreadStats *stats_;
+    StatsPhase phase_;
+    uint64_t start_;
+
+public:
+    PhaseTimer(ThreadStats *stats, StatsPhase phase) : stats_(stats), phase_(phase), start_(stats ? statsNow() : 0) {}
+    ~PhaseTimer() { stop(); }
+    void stop()
+    {
+        if (stats_)
+            stats_->addPhase(phase_, statsNow() - start_);
+        stats_ = NULL;
+    }
+};
+
+
+//======================================================================
+// PerfCounters class
+// Per-thread hardware counters. Silently unavailable when the kernel
+// or platform does not allow perf_event_open
+//======================================================================
+class PerfCounters
+{
+private:
+    int fds_[NUM_PERF_EVENTS];
+
+public:
+    PerfCounters(bool enable);
+    ~PerfCounters();
+    void read(ThreadStats& stats) const;
+};
+
+
+//======================================================================
+// StatsCollector class
+// Gathers snapshots published by worker threads and writes them as JSON,
+// optionally at regular intervals from a background thread
+//======================================================================
+class StatsCollector
+{
+private:
+    boost::mutex mutex_;
+    std::vector<ThreadStats> threads_;      // latest snapshot of each thread
+    std::ofstream output_;
+    std::string fileName_;
+    bool usePerf_;
+    double loadSeconds_;
+    MemoryEstimate memory_;
+    uint64_t startNs_;
+
+    // interval reporting
+    double interval_;
+    bool stopping_;
+    boost::condition_variable stopCondition_;
+    boost::thread reporter_;
+    void reporterThread();
+    void stopReporter();
+
+    void writeJson(bool final);
+
+public:
+    StatsCollector(const std::string& fileName, double interval, bool usePerf);
+    ~StatsCollector();
+
+    bool usePerf() const { return usePerf_; }
+    void setLoadSeconds(double seconds);
+    void setMemory(const MemoryEstimate& memory);
+
+    // register a worker thread, returns its slot
+    unsigned int addThread();
+
+    // replace the snapshot for a worker thread
+    void publish(unsigned int slot, const ThreadStats& stats);
+
+    // start / stop the interval reporter
+    void start();
+    void finish();
+
+    // combined counters of all threads
+    ThreadStats total();
+};
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,182 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: summary.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <sstream>
+
+#include "summary.h"
+#include "format.h"
+
+// a value as it appears in the output, which is what the script compares
+static double printedValue(float value)
+{
+    uint64_t hundredths;
+    bool negative;
+    if (!toHundredths(value, hundredths, negative))
+        return std::numeric_limits<double>::quiet_NaN();
+    return (negative ? -1.0 : 1.0) * hundredths / 100.0;
+}
+
+void AbundanceTable::reset(unsigned int numLevels, unsigned int numAnnotations)
+{
+    counts_.assign(numLevels, std::vector<Count>(numAnnotations));
+    ambiguous_.assign(numLevels, Count());
+    unclassified_.assign(numLevels, Count());
+    total_ = 0;
+}
+
+void AbundanceTable::add(float score, const std::vector<std::vector<unsigned int> >& annotationIds,
+                         const std::vector<float>& bootstraps, uint64_t record, const SummaryOptions& options)
+{
+    bool similar = printedValue(score) >= options.similarity;
+    unsigned int numLevels = counts_.size();
+    for (unsigned int level=0; level<numLevels; level++)
+    {
+        // levels are output last first
+        unsigned int i = numLevels - 1 - level;
+        if (annotationIds[i].size() != 1)
+            ambiguous_[level].add(record);
+        else if (similar && printedValue(bootstraps[i]) >= options.threshold)
+            counts_[level][annotationIds[i][0]].add(record);
+        else
+            unclassified_[level].add(record);
+    }
+    total_++;
+}
+
+// the number of levels and annotations and the total, then a line per level:
+// the ambiguous and unclassified counts, then the annotations counted there
+void AbundanceTable::save(std::ostream& s) const
+{
+    s << counts_.size() << " " << (empty() ? 0 : counts_[0].size()) << " " << total_ << "\n";
+    for (unsigned int level=0; level<counts_.size(); level++)
+    {
+        s << ambiguous_[level].reads << " " << ambiguous_[level].first << " ";
+        s << unclassified_[level].reads << " " << unclassified_[level].first;
+        for (unsigned int id=0; id<counts_[level].size(); id++)
+        {
+            if (counts_[level][id].reads)
+                s << " " << id << " " << counts_[level][id].reads << " " << counts_[level][id].first;
+        }
+        s << "\n";
+    }
+}
+
+bool AbundanceTable::load(std::istream& s)
+{
+    unsigned int numLevels, numAnnotations;
+    uint64_t total;
+    std::string line;
+    if (!std::getline(s, line) || !(std::istringstream(line) >> numLevels >> numAnnotations >> total))
+        return false;
+
+    if (numLevels)
+        reset(numLevels, numAnnotations);
+    else
+        *this = AbundanceTable();
+    total_ = total;
+    for (unsigned int level=0; level<numLevels; level++)
+    {
+        if (!std::getline(s, line))
+            return false;
+        std::istringstream fields(line);
+        if (!(fields >> ambiguous_[level].reads >> ambiguous_[level].first >> unclassified_[level].reads >> unclassified_[level].first))
+            return false;
+        unsigned int id;
+        while (fields >> id)
+        {
+            if (id >= numAnnotations || !(fields >> counts_[level][id].reads >> counts_[level][id].first))
+                return false;
+        }
+        if (!fields.eof())
+            return false;
+    }
+    return true;
+}
+
+
+// orders taxa by decreasing count, then by first appearance
+struct CountOrder
+{
+    const std::vector<uint64_t>& reads_;
+    const std::vector<uint64_t>& first_;
+    CountOrder(const std::vector<uint64_t>& reads, const std::vector<uint64_t>& first) : reads_(reads), first_(first) {}
+    bool operator()(unsigned int a, unsigned int b) const
+    {
+        if (reads_[a] != reads_[b])
+            return reads_[a] > reads_[b];
+        return first_[a] < first_[b];
+    }
+};
+
+void AbundanceTable::write(std::ostream& s, const Database& db, const SummaryOptions& options) const
+{
+    unsigned int numLevels = empty() ? db.numLevels() : counts_.size();
+    for (unsigned int level=0; level<numLevels; level++)
+    {
+        if (options.level && level + 1 != static_cast<unsigned int>(options.level))
+            continue;
+        if (!options.level)
+            s << (level ? "\n" : "") << "# Level " << level + 1 << "\n";
+
+        std::vector<uint64_t> reads, first;
+        std::vector<unsigned int> order;
+        if (!empty())
+        {
+            for (unsigned int id=0; id<counts_[level].size(); id++)
+            {
+                const Count& count = counts_[level][id];
+                const std::string& name = db.annotationFromId(id);
+                if (count.reads && name != "AMBIGUOUS" && name != "UNCLASSIFIED")
+                    order.push_back(id);
+                reads.push_back(count.reads);
+                first.push_back(count.first);
+            }
+            std::sort(order.begin(), order.end(), CountOrder(reads, first));
+        }
+
+        uint64_t ambiguous = empty() ? 0 : ambiguous_[level].reads;
+        uint64_t unclassified = (empty() ? 0 : unclassified_[level].reads) + ambiguous;
+        char buffer[64];
+        for (std::vector<unsigned int>::const_iterator it=order.begin(); it!=order.end(); ++it)
+        {
+            if (options.percent)
+                snprintf(buffer, sizeof(buffer), "%f", 100.0 * reads[*it] / total_);
+            else
+                snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(reads[*it]));
+            s << db.annotationFromId(*it) << "\t" << buffer << "\n";
+        }
+
+        if (options.percent)
+        {
+            double total = total_ ? static_cast<double>(total_) : 1.0;
+            snprintf(buffer, sizeof(buffer), "UNCLASSIFIED\t%f\n(AMBIGUOUS\t%f)\n", 100.0 * unclassified / total, 100.0 * ambiguous / total);
+        }
+        else
+        {
+            snprintf(buffer, sizeof(buffer), "UNCLASSIFIED\t%llu\n(AMBIGUOUS\t%llu)\n",
+                     static_cast<unsigned long long>(unclassified), static_cast<unsigned long long>(ambiguous));
+        }
+        s << buffer;
+    }
+}
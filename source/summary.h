@@ -0,0 +1,95 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: summary.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __SUMMARY_H__
+#define __SUMMARY_H__
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <stdint.h>
+
+#include "database.h"
+
+/* Per-taxon abundance summary, built while classifying.
+ * Gives the same figures as dist/spingo_summary.py run on the output */
+
+// summary settings, defaults match spingo_summary.py
+struct SummaryOptions
+{
+    std::string fileName;       // empty for no summary, "-" for stdout
+    int level;                  // level to summarise, 1 for the first level in the output, 0 for all
+    double similarity;          // minimum similarity score
+    double threshold;           // minimum bootstrap
+    bool percent;               // percentages instead of read counts
+
+    SummaryOptions() : level(0), similarity(0.5), threshold(0.8), percent(false) {}
+};
+
+
+//======================================================================
+// AbundanceTable class
+// Read counts per level and annotation id. A sample has one table,
+// filled as its results are written out in input order
+//======================================================================
+class AbundanceTable
+{
+private:
+    struct Count
+    {
+        uint64_t reads;
+        uint64_t first;         // first record counted, orders equal counts as the script does
+        Count() : reads(0), first(0) {}
+        void add(uint64_t record) { if (!reads++ || record < first) first = record; }
+    };
+
+    // levels in output order, each indexed by annotation id
+    std::vector<std::vector<Count> > counts_;
+    std::vector<Count> ambiguous_;
+    std::vector<Count> unclassified_;
+    uint64_t total_;
+
+public:
+    AbundanceTable() : total_(0) {}
+
+    // memory used by a table
+    static uint64_t tableBytes(unsigned int numLevels, unsigned int numAnnotations)
+    {
+        return static_cast<uint64_t>(numLevels) * (numAnnotations + 2) * sizeof(Count);
+    }
+
+    bool empty() const { return counts_.empty(); }
+    void reset(unsigned int numLevels, unsigned int numAnnotations);
+
+    // count one classified read. annotationIds and bootstraps are indexed as in
+    // Classification, record is the position of the read in its sample
+    void add(float score, const std::vector<std::vector<unsigned int> >& annotationIds,
+             const std::vector<float>& bootstraps, uint64_t record, const SummaryOptions& options);
+
+    void write(std::ostream& s, const Database& db, const SummaryOptions& options) const;
+
+    // the counts as text, for a checkpoint to carry. load returns false if
+    // the text is not a table
+    void save(std::ostream& s) const;
+    bool load(std::istream& s);
+};
+
+#endif /* __SUMMARY_H__ */
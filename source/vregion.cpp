@@ -0,0 +1,330 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: vregion.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "vregion.h"
+#include "common.h"
+
+static const unsigned int wordBits = 64;
+
+// characters matched by each IUPAC code, as expanded by ambicode.py
+static const char *expandBase(char base)
+{
+    switch (toupper(base))
+    {
+        case 'R': return "AG";
+        case 'Y': return "CTU";
+        case 'K': return "GTU";
+        case 'M': return "AC";
+        case 'S': return "CG";
+        case 'W': return "ATU";
+        case 'B': return "CGTU";
+        case 'D': return "AGTU";
+        case 'H': return "ACTU";
+        case 'V': return "ACG";
+        case 'N': return "ACGTU";
+        default: return NULL;
+    }
+}
+
+static char complementBase(char base, bool rna)
+{
+    static const char *from = "ACGTURYKMSWBDHVN";
+    static const char *to =   "TGCAAYRMKSWVHDBN";
+    const char *pos = strchr(from, toupper(base));
+    if (!base || !pos)
+        return base;
+    char c = to[pos - from];
+    if (rna && c == 'T')
+        c = 'U';
+    return islower(base) ? tolower(c) : c;
+}
+
+std::string reverseComplement(const std::string& sequence)
+{
+    bool rna = sequence.find_first_of("Uu") != std::string::npos && sequence.find_first_of("Tt") == std::string::npos;
+    std::string result(sequence.rbegin(), sequence.rend());
+    for (std::string::iterator it=result.begin(); it!=result.end(); ++it)
+        *it = complementBase(*it, rna);
+    return result;
+}
+
+bool validPrimerChoice(const std::string& choice)
+{
+    return choice == "f" || choice == "r" || choice == "fr";
+}
+
+// the primer, then with a single internal insertion, internal
+// substitution or deletion when mismatches are allowed
+std::vector<std::string> primerPatterns(const std::string& primer, bool mismatch)
+{
+    std::vector<std::string> patterns(1, primer);
+    if (mismatch)
+    {
+        for (size_t x=1; x<primer.size(); x++)
+            patterns.push_back(primer.substr(0, x) + "N" + primer.substr(x));
+        for (size_t x=1; x+1<primer.size(); x++)
+            patterns.push_back(primer.substr(0, x) + "N" + primer.substr(x + 1));
+        for (size_t x=0; x<primer.size(); x++)
+            patterns.push_back(primer.substr(0, x) + primer.substr(x + 1));
+    }
+    return patterns;
+}
+
+
+// pack the patterns into words, never splitting one across words
+PrimerMatcher::PrimerMatcher(const std::vector<std::string>& patterns) : numWords_(0), maxLength_(0)
+{
+    unsigned int used = wordBits;
+    std::vector<std::pair<unsigned int, unsigned int> > placement;   // word and first bit
+    for (std::vector<std::string>::const_iterator it=patterns.begin(); it!=patterns.end(); ++it)
+    {
+        if (it->size() > wordBits)
+        {
+            std::ostringstream msg;
+            msg << "primer " << *it << " is longer than " << wordBits << " bases";
+            throw std::runtime_error(msg.str());
+        }
+        if (used + it->size() > wordBits)
+        {
+            numWords_++;
+            used = 0;
+        }
+        placement.push_back(std::make_pair(numWords_ - 1, used));
+        used += it->size();
+        maxLength_ = std::max<unsigned int>(maxLength_, it->size());
+    }
+
+    masks_.assign(256 * numWords_, 0);
+    startBits_.assign(numWords_, 0);
+    endBits_.assign(numWords_, 0);
+    for (unsigned int i=0; i<patterns.size(); i++)
+    {
+        const std::string& pattern = patterns[i];
+        if (pattern.empty())
+            continue;
+
+        unsigned int word = placement[i].first;
+        unsigned int first = placement[i].second;
+        for (unsigned int pos=0; pos<pattern.size(); pos++)
+        {
+            uint64_t bit = static_cast<uint64_t>(1) << (first + pos);
+            const char *bases = expandBase(pattern[pos]);
+            std::string accepted = bases ? bases : std::string(1, pattern[pos]);
+            for (std::string::const_iterator c=accepted.begin(); c!=accepted.end(); ++c)
+            {
+                masks_[static_cast<unsigned char>(toupper(*c)) * numWords_ + word] |= bit;
+                masks_[static_cast<unsigned char>(tolower(*c)) * numWords_ + word] |= bit;
+            }
+        }
+
+        Pattern p;
+        p.word = word;
+        p.endBit = static_cast<uint64_t>(1) << (first + pattern.size() - 1);
+        p.length = pattern.size();
+        patterns_.push_back(p);
+        startBits_[word] |= static_cast<uint64_t>(1) << first;
+        endBits_[word] |= p.endBit;
+    }
+}
+
+
+bool PrimerMatcher::find(const char *sequence, size_t length, size_t& start, size_t& end) const
+{
+    std::vector<uint64_t> state(numWords_, 0);
+    size_t bestStart = std::string::npos;
+    unsigned int best = 0;
+    for (size_t j=0; j<length; j++)
+    {
+        // nothing ending here can start before the best match
+        if (bestStart != std::string::npos && j >= bestStart + maxLength_)
+            break;
+
+        const uint64_t *mask = &masks_[static_cast<unsigned char>(sequence[j]) * numWords_];
+        bool matched = false;
+        for (unsigned int w=0; w<numWords_; w++)
+        {
+            state[w] = ((state[w] << 1) | startBits_[w]) & mask[w];
+            if (state[w] & endBits_[w])
+                matched = true;
+        }
+        if (!matched)
+            continue;
+
+        for (unsigned int i=0; i<patterns_.size(); i++)
+        {
+            const Pattern& p = patterns_[i];
+            if (!(state[p.word] & p.endBit))
+                continue;
+            size_t s = j + 1 - p.length;
+            if (bestStart == std::string::npos || s < bestStart || (s == bestStart && i < best))
+            {
+                bestStart = s;
+                best = i;
+            }
+        }
+    }
+
+    if (bestStart == std::string::npos)
+        return false;
+    start = bestStart;
+    end = bestStart + patterns_[best].length;
+    return true;
+}
+
+
+RegionExtractor::RegionExtractor(const RegionOptions& options) : options_(options)
+{
+    if (options.primerFile.empty())
+        return;
+    loadPrimers(options.primerFile);
+    forward_ = PrimerMatcher(primerPatterns(forwardPrimer_, options.mismatch));
+    reverse_ = PrimerMatcher(primerPatterns(reversePrimer_, options.mismatch));
+    reverseComplement_ = PrimerMatcher(primerPatterns(reverseComplement(reversePrimer_), options.mismatch));
+}
+
+
+// the last records whose names contain FORWARD and REVERSE
+void RegionExtractor::loadPrimers(const std::string& fileName)
+{
+    FastaReader reader(fileName);
+    DnaSequence seq;
+    while (seq = reader.readSequence())
+    {
+        std::string header(seq.header);
+        std::transform(header.begin(), header.end(), header.begin(), ::toupper);
+
+        std::string primer;
+        for (std::string::const_iterator it=seq.sequence.begin(); it!=seq.sequence.end(); ++it)
+            if (!isspace(*it))
+                primer += *it;
+
+        if (header.find("FORWARD") != std::string::npos)
+            forwardPrimer_ = primer;
+        else if (header.find("REVERSE") != std::string::npos)
+            reversePrimer_ = primer;
+    }
+
+    if (forwardPrimer_.empty() || reversePrimer_.empty())
+    {
+        throw std::runtime_error("Could not find primer sequences in " + fileName);
+    }
+}
+
+
+// forward primer, then the reverse primer or its reverse complement after it
+bool RegionExtractor::primerBounds(const std::string& sequence, size_t& begin, size_t& end) const
+{
+    size_t s, e;
+    begin = 0;
+    end = sequence.size();
+    if (forward_.find(sequence.data(), sequence.size(), s, e))
+        begin = options_.trim.find('f') != std::string::npos ? e : s;
+    else if (options_.require.find('f') != std::string::npos)
+        return false;
+
+    const char *rest = sequence.data() + begin;
+    if (reverse_.find(rest, end - begin, s, e) || reverseComplement_.find(rest, end - begin, s, e))
+        end = begin + (options_.trim.find('r') != std::string::npos ? s : e);
+    else if (options_.require.find('r') != std::string::npos)
+        return false;
+    return true;
+}
+
+
+bool RegionExtractor::extract(const std::string& sequence, std::string& region) const
+{
+    if (sequence.empty())
+        return false;
+
+    // discard sequences with too many ambiguous bases
+    if (options_.badchars > -1)
+    {
+        int bad = 0;
+        for (std::string::const_iterator it=sequence.begin(); it!=sequence.end(); ++it)
+            if (strchr("RYKMSWBDHVNX-", toupper(*it)) && *it)
+                bad++;
+        if (bad > options_.badchars)
+            return false;
+    }
+
+    size_t begin, end;
+    if (options_.primerFile.empty())
+    {
+        // positions, cut short by the end of the sequence
+        if (sequence.size() < options_.regionStart)
+            return false;
+        begin = options_.regionStart - 1;
+        end = std::min<size_t>(options_.regionEnd, sequence.size());
+    }
+    else if (!primerBounds(sequence, begin, end))
+    {
+        return false;
+    }
+
+    size_t length = end - begin;
+    if (length == 0 || (options_.filterSizes && (length < options_.minSize || length > options_.maxSize)))
+        return false;
+
+    region.assign(sequence, begin, length);
+    return true;
+}
+
+
+// the next sequence with a region
+DnaSequence RegionReader::readSequence(ThreadStats *stats)
+{
+    DnaSequence seq;
+    std::string region;
+    while (seq = source_.readSequence(stats))
+    {
+        bool found = extractor_.extract(seq.sequence, region);
+        boost::mutex::scoped_lock lock(mutex_);
+        numRead_++;
+        if (found)
+        {
+            numKept_++;
+            seq.sequence.swap(region);
+            return seq;
+        }
+    }
+    return DnaSequence();
+}
+
+
+long RegionReader::numRead()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return numRead_;
+}
+
+
+long RegionReader::numKept()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return numKept_;
+}
@@ -0,0 +1,148 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: vregion.h
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#ifndef __VREGION_H__
+#define __VREGION_H__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/thread/mutex.hpp>
+
+#include "fasta.h"
+
+/* Variable region extraction with degenerate primers, as v_ripper.py */
+
+//======================================================================
+// RegionOptions struct
+// primers and filters applied to each sequence
+//======================================================================
+struct RegionOptions
+{
+    std::string primerFile;     // fasta with records named FORWARD and REVERSE
+    unsigned int regionStart;   // or fixed positions in each sequence, from 1,
+    unsigned int regionEnd;     // used if there is no primer file
+    std::string trim;           // primers to cut off: "f", "r" or "fr"
+    std::string require;        // primers that must be found: "f", "r" or "fr"
+    bool filterSizes;
+    unsigned int minSize;       // region length limits, if filterSizes
+    unsigned int maxSize;
+    bool mismatch;              // allow a single substitution, insertion or deletion
+    int badchars;               // most ambiguous bases allowed, -1 for any
+
+    RegionOptions() : regionStart(0), regionEnd(0), filterSizes(false), minSize(0), maxSize(0), mismatch(false), badchars(-1) {}
+};
+
+
+//======================================================================
+// PrimerMatcher class
+// Finds the leftmost occurrence of any of a set of fixed length IUPAC
+// patterns, preferring earlier patterns at the same position, as a
+// regular expression alternation would. All patterns are matched at
+// once with a multi-pattern Shift-And over 64 bit words
+//======================================================================
+class PrimerMatcher
+{
+private:
+    struct Pattern
+    {
+        unsigned int word;
+        uint64_t endBit;
+        unsigned int length;
+    };
+
+    std::vector<Pattern> patterns_;
+    unsigned int numWords_;
+    unsigned int maxLength_;
+    std::vector<uint64_t> masks_;       // [character][word], positions accepting the character
+    std::vector<uint64_t> startBits_;   // first position of each pattern, by word
+    std::vector<uint64_t> endBits_;     // last position of each pattern, by word
+
+public:
+    PrimerMatcher() : numWords_(0), maxLength_(0) {}
+    PrimerMatcher(const std::vector<std::string>& patterns);
+
+    // start and end of the match in sequence, false if there is none
+    bool find(const char *sequence, size_t length, size_t& start, size_t& end) const;
+};
+
+
+//======================================================================
+// RegionExtractor class
+// Cuts the primer bounded region, or a fixed range of positions, out
+// of a sequence
+//======================================================================
+class RegionExtractor
+{
+private:
+    RegionOptions options_;
+    std::string forwardPrimer_;
+    std::string reversePrimer_;
+    PrimerMatcher forward_;
+    PrimerMatcher reverse_;
+    PrimerMatcher reverseComplement_;
+
+    void loadPrimers(const std::string& fileName);
+    bool primerBounds(const std::string& sequence, size_t& begin, size_t& end) const;
+
+public:
+    RegionExtractor(const RegionOptions& options);
+
+    // the region of sequence, false if it is discarded
+    bool extract(const std::string& sequence, std::string& region) const;
+
+    const std::string& forwardPrimer() const { return forwardPrimer_; }
+    const std::string& reversePrimer() const { return reversePrimer_; }
+};
+
+
+//======================================================================
+// RegionReader class
+// Passes on sequences from another source with only their region,
+// dropping those without one. Extraction runs on the calling thread
+//======================================================================
+class RegionReader : public SequenceSource
+{
+private:
+    SequenceSource& source_;
+    const RegionExtractor& extractor_;
+    boost::mutex mutex_;
+    long numRead_;
+    long numKept_;
+
+public:
+    RegionReader(SequenceSource& source, const RegionExtractor& extractor) :
+        source_(source), extractor_(extractor), numRead_(0), numKept_(0) {}
+
+    DnaSequence readSequence(ThreadStats *stats = NULL);
+    long numRead();
+    long numKept();
+};
+
+// true for the primer choices accepted by --trim and --require: "f", "r" or "fr"
+bool validPrimerChoice(const std::string& choice);
+
+// the pattern alternatives accepted for a primer
+std::vector<std::string> primerPatterns(const std::string& primer, bool mismatch);
+
+// reverse complement, keeping ambiguity codes and case
+std::string reverseComplement(const std::string& sequence);
+
+#endif /* __VREGION_H__ */
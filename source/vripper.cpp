@@ -0,0 +1,309 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: vripper.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork 
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <fstream>
+#include <map>
+#include "common.h"
+#include "rdp.h"
+#include "vregion.h"
+
+// version
+static const std::string versionString("Version 1.3");
+
+// architecture
+#ifdef __x86_64__
+static const std::string archString("(64bit)");
+#else
+static const std::string archString("(32bit)");
+#endif
+
+// defaults
+static const int minThreads = 1;
+static const int defaultThreads = 1;
+
+// bases per line of output, as written by Biopython
+static const size_t lineWidth = 60;
+
+
+// somewhere to store the program options
+struct ProgramOptions {
+    std::string inputFilename;
+    std::string outputFilename;
+    int numThreads;
+    RegionOptions region;
+};
+
+
+//======================================================================
+// OrderedWriter class
+// Writes records in input order, whichever thread finishes them
+//======================================================================
+class OrderedWriter
+{
+private:
+    boost::mutex mutex_;
+    std::ostream& out_;
+    long next_;
+    std::map<long, std::string> waiting_;
+    long numWritten_;
+
+    void put(const std::string& text)
+    {
+        if (text.empty())
+            return;
+        out_.write(text.data(), text.size());
+        numWritten_++;
+    }
+
+public:
+    OrderedWriter(std::ostream& out) : out_(out), next_(1), numWritten_(0) {}
+
+    // text is the formatted record, empty if it was discarded
+    void write(long number, std::string& text)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (number != next_)
+        {
+            waiting_[number].swap(text);
+            return;
+        }
+
+        put(text);
+        std::map<long, std::string>::iterator it;
+        while ((it = waiting_.find(++next_)) != waiting_.end())
+        {
+            put(it->second);
+            waiting_.erase(it);
+        }
+    }
+
+    long numWritten() const { return numWritten_; }
+};
+
+
+// fasta record for the region, named with the first word of the header
+static void formatRecord(const std::string& header, const std::string& region, std::string& out)
+{
+    out += '>';
+    out.append(header, 0, header.find_first_of(" \t\n\r\f\v"));
+    out += '\n';
+    for (size_t pos=0; pos<region.size(); pos+=lineWidth)
+    {
+        out.append(region, pos, lineWidth);
+        out += '\n';
+    }
+}
+
+
+static void extractThread(RdpReader& reader, const RegionExtractor& extractor, OrderedWriter& writer)
+{
+    DnaSequence seq;
+    std::string region, record;
+    while (seq = reader.readSequence())
+    {
+        record.clear();
+        if (extractor.extract(seq.sequence, region))
+            formatRecord(seq.header, region, record);
+        writer.write(seq.number, record);
+    }
+}
+
+
+// process the command-line args
+ProgramOptions parseCommandLine(int argc, char **argv)
+{
+    // parse command line options
+    ProgramOptions options;
+    std::vector<std::string> sizes, files;
+    namespace po = boost::program_options;
+    std::string title("VRIPPER - extract variable regions from sequences.\n" + versionString + " " + archString);
+    std::string usage("Usage: vripper [options] IN_FILE OUT_FILE PRIMER_FILE\n"
+                      "IN_FILE may be gzipped, '-' reads stdin and writes stdout");
+    po::options_description desc("Available options");
+    desc.add_options()
+        (
+            "help,h",
+            "display this message"
+        )
+        (
+            "version,v",
+            "display version information"
+        )
+        (
+            "trim,t",
+            po::value<std::string>(&options.region.trim),
+            "conserved regions to trim: 'fr' forward and reverse, 'f' forward only, 'r' reverse only"
+        )
+        (
+            "require,r",
+            po::value<std::string>(&options.region.require),
+            "conserved regions required for a sequence to be kept: 'fr', 'f' or 'r'"
+        )
+        (
+            "sizes,s",
+            po::value<std::vector<std::string> >(&sizes)->multitoken(),
+            "min and max lengths of the extracted region. Not filtered by size if omitted"
+        )
+        (
+            "mismatch,m",
+            po::value<bool>(&options.region.mismatch)->zero_tokens()->default_value(false),
+            "allow a single substitution, insertion or deletion in each primer"
+        )
+        (
+            "badchars,b",
+            po::value<int>(&options.region.badchars)->default_value(-1),
+            "maximum number of ambiguous bases allowed (-1 for no filtering)"
+        )
+        (
+            "processors,p",
+            po::value<int>(&options.numThreads)->default_value(defaultThreads),
+            "number of processor threads"
+        );
+
+    po::options_description hidden;
+    hidden.add_options()
+        ("files", po::value<std::vector<std::string> >(&files));
+
+    po::options_description all;
+    all.add(desc).add(hidden);
+    po::positional_options_description p;
+    p.add("files", -1);
+
+    po::variables_map vm;
+    try{
+        po::store(po::command_line_parser(argc, argv).options(all).positional(p).run(), vm);
+
+        if(vm.count("help"))
+        {
+            std::cerr << title << std::endl << usage << std::endl;
+            std::cerr << desc << std::endl;
+            exit(EXIT_SUCCESS);
+        }
+
+        if(vm.count("version"))
+        {
+            std::cerr << title << std::endl;
+            exit(EXIT_SUCCESS);
+        }
+
+        po::notify(vm);
+
+        // --sizes takes exactly two values, any more are the file names
+        if(sizes.size() > 2)
+        {
+            files.insert(files.begin(), sizes.begin() + 2, sizes.end());
+            sizes.resize(2);
+        }
+
+        // check for invalid options
+        if(files.size() != 3)
+            throw po::error("input, output and primer files must all be given");
+        options.inputFilename = files[0];
+        options.outputFilename = files[1];
+        options.region.primerFile = files[2];
+
+        if(vm.count("trim") && !validPrimerChoice(options.region.trim))
+            throw po::error("trim (--trim, -t) must be one of fr, f or r");
+
+        if(vm.count("require") && !validPrimerChoice(options.region.require))
+            throw po::error("require (--require, -r) must be one of fr, f or r");
+
+        if(vm.count("sizes"))
+        {
+            if (sizes.size() != 2)
+                throw po::error("sizes (--sizes, -s) needs a min and max length");
+            unsigned int a, b;
+            try {
+                a = boost::lexical_cast<unsigned int>(sizes[0]);
+                b = boost::lexical_cast<unsigned int>(sizes[1]);
+            }
+            catch(boost::bad_lexical_cast&) {
+                throw po::error("sizes (--sizes, -s) must be two lengths");
+            }
+            options.region.filterSizes = true;
+            options.region.minSize = std::min(a, b);
+            options.region.maxSize = std::max(a, b);
+        }
+
+        if(options.numThreads < minThreads)
+        {
+            std::ostringstream msg;
+            msg << "processors (--processors, -p) = " << options.numThreads;
+            msg << ": value must be >= " << minThreads;
+            throw po::error(msg.str());
+        }
+    }
+    catch(po::error& e)
+    {
+        std::cerr << "OOPS! " << e.what() << std::endl;
+        std::cerr << "Try 'vripper --help' for available options" << std::endl << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return options;
+}
+
+int main(int argc, char **argv)
+{
+    ProgramOptions options = parseCommandLine(argc, argv);
+
+    try {
+        std::cerr << "loading primer sequences from " << options.region.primerFile << std::endl;
+        RegionExtractor extractor(options.region);
+        std::cerr << "forward primer: " << extractor.forwardPrimer() << " \t reverse primer: " << extractor.reversePrimer() << std::endl;
+
+        std::vector<std::string> inputs(1, options.inputFilename);
+        RdpReader reader(inputs, "");
+
+        std::ofstream file;
+        std::ostream *out = &std::cout;
+        if (options.outputFilename != "-")
+        {
+            file.open(options.outputFilename.c_str(), std::ios::binary);
+            if (!file.is_open())
+                throw FileOpenException("Could not open " + options.outputFilename);
+            out = &file;
+        }
+
+        ScopedTimer tim;
+        OrderedWriter writer(*out);
+        boost::thread_group threads;
+        for (int i=0; i<options.numThreads; i++)
+            threads.create_thread(boost::bind(extractThread, boost::ref(reader), boost::cref(extractor), boost::ref(writer)));
+        threads.join_all();
+        out->flush();
+
+        std::cerr << writer.numWritten() << " of " << reader.numKept() << " sequences contained the region ";
+    }
+    catch (FileOpenException &e) {
+        std::cerr << "\nError: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    catch (std::exception &e) {
+        std::cerr << "\nError: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*============================================================================
+Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+File: apicheck.cpp
+Author: Guy Allard
+Copyright (C) 2014  Department of Microbiology, University College Cork
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+=============================================================================*/
+
+/* Classifies a fasta file through libspingo, using only spingo.h, and
+ * writes the results as spingo -a would. Run by check.sh.
+ *
+ * usage: apicheck DATABASE QUERIES
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "spingo.h"
+
+
+// runs the tasks last to first, as a pool may run them in any order
+class ReverseRunner : public spingo::TaskRunner
+{
+public:
+    void run(size_t count, spingo::Task& task)
+    {
+        for (size_t i=count; i>0; i--)
+            task.execute(i - 1);
+    }
+};
+
+// keeps each result by its position in the batch
+class StoreHandler : public spingo::ResultHandler
+{
+private:
+    std::vector<spingo::Result>& results_;
+
+public:
+    StoreHandler(std::vector<spingo::Result>& results) : results_(results) {}
+    void handle(const spingo::Result& result) { results_[result.index] = result; }
+};
+
+static void readFasta(const char *fileName, std::vector<std::string>& names, std::vector<std::string>& sequences)
+{
+    std::ifstream input(fileName);
+    std::string line;
+    while (std::getline(input, line))
+    {
+        if (!line.empty() && line[0] == '>')
+        {
+            names.push_back(line.substr(1, line.find_first_of(" \t") - 1));
+            sequences.push_back("");
+        }
+        else if (!sequences.empty())
+        {
+            sequences.back() += line;
+        }
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "usage: apicheck DATABASE QUERIES" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // invalid options are refused before anything is loaded
+    spingo::IndexOptions options;
+    options.kmerSize = 0;
+    try {
+        spingo::Index index(argv[1], options);
+        std::cerr << "kmerSize 0 was accepted" << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (std::invalid_argument&) {
+    }
+
+    // as is a database which cannot be read
+    options = spingo::IndexOptions();
+    try {
+        spingo::Index index(std::string(argv[1]) + ".missing", options);
+        std::cerr << "a missing database was accepted" << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (std::runtime_error&) {
+    }
+
+    std::vector<std::string> names;
+    std::vector<std::string> sequences;
+    readFasta(argv[2], names, sequences);
+
+    std::vector<spingo::Sequence> batch;
+    for (size_t i=0; i<sequences.size(); i++)
+        batch.push_back(spingo::Sequence(sequences[i].data(), sequences[i].size()));
+
+    options.numThreads = 2;
+    spingo::Index index(argv[1], options);
+    if (index.kmerSize() != 8 || index.numLevels() != 3)
+    {
+        std::cerr << "unexpected kmer size or levels" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // the first half on the calling thread into a buffer, the rest
+    // through a runner and handler, numbered after the first half
+    size_t half = batch.size() / 2;
+    std::vector<spingo::Result> first;
+    index.classify(&batch[0], half, first);
+
+    std::vector<spingo::Result> second(batch.size() - half);
+    StoreHandler handler(second);
+    ReverseRunner runner;
+    index.classify(&batch[half], batch.size() - half, handler, &runner, half);
+
+    for (size_t i=0; i<batch.size(); i++)
+        std::cout << index.format(names[i], i < half ? first[i] : second[i - half], true) << "\n";
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,397 @@
+#!/bin/bash
+#============================================================================
+# Program: SPINGO - SPecies level IdentificatioN of metaGenOmic amplicons.
+# File: check.sh
+# Author: Guy Allard
+# Copyright (C) 2014  Department of Microbiology, University College Cork
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#============================================================================
+#
+# Regression checks of spingo and spindex against the results in this
+# directory, which were written by the SPINGO 1.3 sources:
+#   expected.out     -k 8 -a
+#   expected_k5.out  -k 5 -b 20
+#   expected_k12.out -k 12 -a
+# and by dist/spingo_summary.py from expected.out:
+#   expected_level3.summary  -l 3
+#   expected_level1.summary  -l 1 -p -s 0.7 -t 0.9
+# and by dist/v_ripper.py from the references with primers.fa added, as below:
+#   expected_region.fa    -m -t fr -r fr -s 150 300
+#   expected_region_f.fa  -t f -r f
+# for queries.fa against db.fa. The database holds 60 synthetic references
+# of 16 species in 4 genera, and the queries are 200 reads taken from them,
+# some reverse complemented, with 3% of their bases changed.
+#
+# usage: check.sh [DIR holding the spingo and spindex binaries, default ../source]
+# make check in source builds them, and apicheck, then runs this
+
+TESTDIR=$(cd "$(dirname "$0")" && pwd)
+BINDIR=$(cd "${1:-$TESTDIR/../source}" && pwd)
+SPINGO=$BINDIR/spingo
+SPINDEX=$BINDIR/spindex
+
+WORK=$(mktemp -d)
+SERVERS=
+cleanup()
+{
+    [ -n "$SERVERS" ] && kill $SERVERS 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# run a command, the check passing if it succeeds
+failed=0
+expect()
+{
+    local name=$1
+    shift
+    if "$@"; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        failed=1
+    fi
+}
+
+check()
+{
+    expect "$1" cmp -s "$2" "$3"
+}
+
+# succeeds if the command fails
+refused()
+{
+    ! "$@" > /dev/null 2>&1
+}
+
+# a copy of the database and queries, as spindex writes alongside the database
+setup()
+{
+    mkdir "$WORK/$1" && cp "$TESTDIR/db.fa" "$TESTDIR/queries.fa" "$WORK/$1" && cd "$WORK/$1"
+}
+
+# start a server on socket $1, waiting until it listens
+serve()
+{
+    "$SPINGO" --serve "$1" -p 1 2>/dev/null &
+    SERVERS="$SERVERS $!"
+    for i in $(seq 50); do
+        [ -S "$1" ] && return
+        sleep 0.1
+    done
+}
+
+
+# classification from the fasta database
+setup plain
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 > out 2>/dev/null
+check "default search" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i queries.fa -k 5 -b 20 -p 2 > out 2>/dev/null
+check "kmer size 5" out "$TESTDIR/expected_k5.out"
+
+# profiling leaves the results alone, and the final report counts every read
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --stats stats.json --stats-interval 0.001 > out 2>/dev/null
+check "--stats" out "$TESTDIR/expected.out"
+expect "--stats report" grep -q '^{"final": true, .*"threads": 2, "reads": 200, "reads_per_second"' stats.json
+
+# a compact index when the standard one would not fit, and a refusal when neither fits
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --max-memory 2M > out 2>/dev/null
+check "--max-memory, compact index" out "$TESTDIR/expected.out"
+expect "--max-memory, over the limit" refused "$SPINGO" -d db.fa -i queries.fa -k 8 --max-memory 1M
+setup compact
+"$SPINDEX" -d db.fa -k 8 --max-memory 2M > /dev/null 2>&1
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 > out 2>/dev/null
+check "spindex --max-memory" out "$TESTDIR/expected.out"
+
+# the library, through spingo.h alone, built by make check
+if [ -x "$BINDIR/apicheck" ]; then
+    setup library
+    "$BINDIR/apicheck" db.fa queries.fa > out 2>/dev/null
+    check "libspingo" out "$TESTDIR/expected.out"
+else
+    echo "skip libspingo, apicheck is built by make check"
+fi
+
+# several samples with one index load, each written to its own file
+setup samples
+cp queries.fa again.fa
+printf 'queries.fa first.out\nagain.fa second.out\n' > samples.txt
+"$SPINGO" -d db.fa -k 8 -a -p 2 --manifest samples.txt 2>/dev/null
+check "--manifest, first sample" first.out "$TESTDIR/expected.out"
+check "--manifest, second sample" second.out "$TESTDIR/expected.out"
+mkdir results
+expect "several inputs, one missing" refused "$SPINGO" -d db.fa -k 8 -a -p 2 queries.fa none.fa again.fa --output-dir results
+check "several inputs, --output-dir" results/again.fa.spingo.txt "$TESTDIR/expected.out"
+
+# abundance summaries, the same as spingo_summary.py gives
+setup summary
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --summary level3.summary --summary-level 3 --no-reads > out 2>/dev/null
+check "--summary" level3.summary "$TESTDIR/expected_level3.summary"
+expect "--no-reads" test ! -s out
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --summary level1.summary --summary-level 1 --percent --similarity 0.7 --threshold 0.9 > out 2>/dev/null
+check "--summary with --percent, --similarity and --threshold" level1.summary "$TESTDIR/expected_level1.summary"
+check "--summary, reads" out "$TESTDIR/expected.out"
+
+# binary results converted back to text, with read names or their positions
+setup binary
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --binary > results.bin 2>/dev/null
+"$SPINGO" --convert results.bin > out 2>/dev/null
+check "--binary and --convert" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --binary --no-names > results.bin 2>/dev/null
+"$SPINGO" --convert results.bin > out 2>/dev/null
+awk 'BEGIN { FS = OFS = "\t" } { $1 = NR; print }' "$TESTDIR/expected.out" > numbered.out
+check "--binary --no-names" out numbered.out
+
+# a server, which reports a database it cannot load and carries on
+setup server
+serve "$WORK/server.sock"
+"$SPINGO" -d "$WORK/server/db.fa" -i queries.fa -k 8 -a --server "$WORK/server.sock" > out 2>/dev/null
+check "--server" out "$TESTDIR/expected.out"
+expect "--server, missing database" refused "$SPINGO" -d "$WORK/server/none.fa" -i queries.fa -k 8 --server "$WORK/server.sock"
+"$SPINGO" -d "$WORK/server/db.fa" -i queries.fa -k 5 -b 20 --server "$WORK/server.sock" > out 2>/dev/null
+check "--server, after a failed request" out "$TESTDIR/expected_k5.out"
+
+# an index built from RDP release files: the database references in lower case,
+# half of them gzipped, among reads missing from a taxonomy map with CRLF endings.
+# make_database.py makes db.fa again from these
+setup rdp
+rdpfasta()
+{
+    awk '/^>/ { split($0, f, "\t"); print f[1] " Bacteria;" f[2] "\tlineage"; next } { print tolower($0) }'
+}
+awk '/^>/ { n++ } n <= 30' db.fa | rdpfasta | gzip > release1.fa.gz
+{ awk '/^>/ { n++ } n > 30' db.fa; sed 's/^>query/>unlisted/' queries.fa; } | rdpfasta > release2.fa
+awk -F'\t' '/^>/ { print substr($1, 2) "\t" $2 "\t" $3 "\t" $4 "\r" }' db.fa > taxonomy.map
+"$SPINDEX" -d release.fa -k 8 --rdp release1.fa.gz release2.fa --taxonomy taxonomy.map > /dev/null 2>&1
+"$SPINGO" -d release.fa -i queries.fa -k 8 -a -p 2 > out 2>/dev/null
+check "spindex --rdp" out "$TESTDIR/expected.out"
+
+# variable regions cut from the references with primers added, some with a
+# substituted forward primer, some missing the reverse one or not complemented
+setup vregion
+cp "$TESTDIR/primers.fa" .
+awk '
+/^>/ { n++; i = 0; print; next }
+{
+    i++
+    if (i == 2)
+        print (n % 7 == 3) ? "GTGCCAGCAGCCGCTGTAA" : (n % 2) ? "GTGCCAGCAGCCGCGGTAA" : "GTGCCAGCCGCCGCGGTAA"
+    if (i == 5 && n % 11 != 5)
+        print (n % 5 == 0) ? "GGACTACCAGGGTATCTAAT" : (n % 3) ? "ATTAGATACCCTGGTAGTCC" : "ATTAGAAACCCGAGTAGTCC"
+    print
+}' db.fa > amplicons.fa
+"$BINDIR/vripper" -p 2 -m -t fr -r fr -s 150 300 amplicons.fa region.fa primers.fa 2>/dev/null
+check "vripper" region.fa "$TESTDIR/expected_region.fa"
+gzip -c amplicons.fa | "$BINDIR/vripper" -t f -r f - - primers.fa > region_f.fa 2>/dev/null
+check "vripper, gzipped stdin" region_f.fa "$TESTDIR/expected_region_f.fa"
+
+# an index of the region gives the results of one built from the expected region sequences
+"$SPINDEX" -d amplicons.fa -k 8 --primers primers.fa --mismatch --trim fr --require fr --sizes 150 300 > /dev/null 2>&1
+"$SPINGO" -d amplicons.fa.primers -i queries.fa -k 8 -a -p 2 > out 2>/dev/null
+awk -F'\t' 'NR == FNR { if (/^>/) taxonomy[$1] = $0; next } /^>/ { $0 = taxonomy[$0] } 1' db.fa "$TESTDIR/expected_region.fa" > expected.fa
+"$SPINGO" -d expected.fa -i queries.fa -k 8 -a -p 2 > expected.out 2>/dev/null
+check "spindex --primers" out expected.out
+
+# region indexes derived from a full index, against ones built from the sequences
+setup region
+"$SPINDEX" -d db.fa -k 8 --region 200 800 > /dev/null 2>&1
+"$SPINGO" -d db.fa.200-800 -i queries.fa -k 8 -a -p 2 > direct.out 2>/dev/null
+setup derived
+"$SPINDEX" -d db.fa -k 8 --keep-sequences > /dev/null 2>&1
+rm db.fa
+"$SPINDEX" -d db.fa -k 8 --region 200 800 --from-index db.fa.idx_8 > /dev/null 2>&1
+"$SPINGO" -d db.fa.200-800 -i queries.fa -k 8 -a -p 2 > out 2>/dev/null
+check "spindex --from-index --region" out "$WORK/region/direct.out"
+cp "$WORK/vregion/amplicons.fa" "$TESTDIR/primers.fa" .
+"$SPINDEX" -d amplicons.fa -k 8 --keep-sequences > /dev/null 2>&1
+"$SPINDEX" -d amplicons.fa -k 8 --from-index amplicons.fa.idx_8 --primers primers.fa --mismatch --trim fr --require fr --sizes 150 300 > /dev/null 2>&1
+"$SPINGO" -d amplicons.fa.primers -i queries.fa -k 8 -a -p 2 > out 2>/dev/null
+check "spindex --from-index --primers" out "$WORK/vregion/expected.out"
+
+# the index of the first 40 references, with the others added as a segment
+setup segments
+awk '/^>/ { n++ } n <= 40' "$TESTDIR/db.fa" > db.fa
+awk '/^>/ { n++ } n > 40' "$TESTDIR/db.fa" > added.fa
+"$SPINDEX" -d db.fa -k 8 > /dev/null 2>&1
+"$SPINDEX" -d db.fa -k 8 --add added.fa > /dev/null 2>&1
+expect "spindex --add, segment" test -f db.fa.idx_8.1
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 > out 2>/dev/null
+check "spindex --add" out "$TESTDIR/expected.out"
+"$SPINDEX" -d db.fa -k 8 --compact > /dev/null 2>&1
+expect "spindex --compact, no segment" test ! -f db.fa.idx_8.1
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 > out 2>/dev/null
+check "spindex --compact" out "$TESTDIR/expected.out"
+
+# two shards, each held by a server, one of which is then stopped
+setup shards
+"$SPINDEX" -d db.fa -k 8 --shards 2 > /dev/null 2>&1
+serve "$WORK/shard1.sock"
+serve "$WORK/shard2.sock"
+"$SPINGO" -d "$WORK/shards/db.fa" -i queries.fa -k 8 -a -p 2 --shards "$WORK/shard1.sock" "$WORK/shard2.sock" > out 2>/dev/null
+check "--shards" out "$TESTDIR/expected.out"
+kill $!
+wait $! 2>/dev/null
+expect "--shards, a shard stopped" refused "$SPINGO" -d "$WORK/shards/db.fa" -i queries.fa -k 8 --shards "$WORK/shard1.sock" "$WORK/shard2.sock"
+
+# searches which skip references, with the results of scoring them all
+setup searches
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --exhaustive > out 2>/dev/null
+check "--exhaustive" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i queries.fa -k 5 -b 20 -p 2 --exhaustive > out 2>/dev/null
+check "--exhaustive, kmer size 5" out "$TESTDIR/expected_k5.out"
+
+# approximate searches which skip no kmers are exact, and calibrate as such
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --approximate --common-kmers 1 > out 2>/dev/null
+check "--approximate, every kmer" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --approximate > out 2>/dev/null
+cut -f 1 out > names
+cut -f 1 "$TESTDIR/expected.out" > expected.names
+check "--approximate, common kmers skipped" names expected.names
+"$SPINGO" -d db.fa -i queries.fa -k 8 -p 2 --calibrate 100 --common-kmers 1 > report 2>/dev/null
+expect "--calibrate" test "$(awk -F'\t' '$2 == "100.00" && $3 == "100.00" && $4 == "0.0000"' report | wc -l)" = 3
+
+# searches of groups of references first
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --hierarchical > out 2>/dev/null
+check "--hierarchical" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i queries.fa -k 5 -b 20 -p 2 --hierarchical > out 2>/dev/null
+check "--hierarchical, kmer size 5" out "$TESTDIR/expected_k5.out"
+
+# both search engines, and a bit matrix file left from other references
+setup engines
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --engine postings > out 2>/dev/null
+check "--engine postings" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --engine bitmatrix > out 2>/dev/null
+check "--engine bitmatrix" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i queries.fa -k 5 -b 20 -p 2 --engine bitmatrix > out 2>/dev/null
+check "--engine bitmatrix, kmer size 5" out "$TESTDIR/expected_k5.out"
+awk '/^>/ { n++ } { r[n] = r[n] $0 "\n" } END { t = r[1]; r[1] = r[31]; r[31] = t; for (i = 1; i <= n; i++) printf "%s", r[i] }' db.fa > swapped.fa
+"$SPINDEX" -d swapped.fa -k 8 --engine bitmatrix > /dev/null 2>&1
+"$SPINDEX" -d db.fa -k 8 --engine bitmatrix > /dev/null 2>&1
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --engine bitmatrix > out 2>/dev/null
+check "spindex --engine bitmatrix" out "$TESTDIR/expected.out"
+cp swapped.fa.idx_8.bits db.fa.idx_8.bits
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --engine bitmatrix > out 2>/dev/null
+check "--engine bitmatrix, stale matrix file" out "$TESTDIR/expected.out"
+
+# read pairs: a read with its own reverse complement as the second mate is
+# searched as the read alone, and reads cut in two give the same results
+# from two files as interleaved, one line per pair
+setup pairs
+awk 'function rc(s,  r, i) { r = ""; for (i = length(s); i > 0; i--) r = r substr("TGCAN", index("ACGTN", substr(s, i, 1)), 1); return r }
+     function pair(h, s,  n) { n = int(length(s) / 2)
+         print h > "mates1.fa"; print s > "mates1.fa"; print h > "mates2.fa"; print rc(s) > "mates2.fa"
+         print h > "pairs.fa"; print s > "pairs.fa"; print h > "pairs.fa"; print rc(s) > "pairs.fa"
+         print h > "half1.fa"; print substr(s, 1, n) > "half1.fa"; print h > "half2.fa"; print rc(substr(s, n + 1)) > "half2.fa"
+         print h > "halves.fa"; print substr(s, 1, n) > "halves.fa"; print h > "halves.fa"; print rc(substr(s, n + 1)) > "halves.fa" }
+     /^>/ { if (h) pair(h, s); h = $0; s = ""; next } { s = s $0 } END { pair(h, s) }' queries.fa
+"$SPINGO" -d db.fa -i mates1.fa --mates mates2.fa -k 8 -a -p 2 > out 2>/dev/null
+check "--mates" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i pairs.fa --interleaved -k 8 -a -p 2 > out 2>/dev/null
+check "--interleaved" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i half1.fa --mates half2.fa -k 8 -a -p 2 > mates.out 2>/dev/null
+"$SPINGO" -d db.fa -i halves.fa --interleaved -k 8 -a -p 2 > interleaved.out 2>/dev/null
+check "--mates and --interleaved, halves" mates.out interleaved.out
+expect "--mates, a line per pair" test "$(wc -l < mates.out)" = 200
+head -n -2 half2.fa > short.fa
+expect "--mates, a missing mate" refused "$SPINGO" -d db.fa -i half1.fa --mates short.fa -k 8
+
+# fastq reads: records without bases are skipped, and a low quality base
+# leaves out the kmers spanning it as an N does. Empty mates are searched
+# on the other mate of the pair
+setup fastq
+awk 'function record(h, s,  q, n, i) {
+         q = ""; n = ""
+         for (i = 1; i <= length(s); i++) { q = q (i % 20 ? "I" : "#"); n = n (i % 20 ? substr(s, i, 1) : "N") }
+         print "@" h > "queries.fq"; print s > "queries.fq"; print "+" > "queries.fq"; print q > "queries.fq"
+         print "@" h > "low.fq"; print s > "low.fq"; print "+" > "low.fq"; print q > "low.fq"
+         print ">" h > "masked.fa"; print n > "masked.fa"
+         print "@" h > "pairs.fq"; print s > "pairs.fq"; print "+" > "pairs.fq"; print q > "pairs.fq"; print "@" h "/2\n+" > "pairs.fq"
+         if (h == "query100") { print "@empty\n\n+\n" > "queries.fq" } }
+     /^>/ { if (h) record(h, s); h = substr($0, 2); s = ""; next } { s = s $0 } END { record(h, s) }' queries.fa
+"$SPINGO" -d db.fa -i queries.fq -k 8 -a -p 2 > out 2>/dev/null
+check "fastq, an empty record" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i low.fq -k 8 -a -p 2 --min-quality 10 > out 2>/dev/null
+"$SPINGO" -d db.fa -i masked.fa -k 8 -a -p 2 > masked.out 2>/dev/null
+check "--min-quality" out masked.out
+expect "--min-quality, some kmers left out" refused cmp -s out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i pairs.fq --interleaved -k 8 -a -p 2 > out 2>/dev/null
+check "fastq, empty mates" out "$TESTDIR/expected.out"
+
+# reads streamed from stdin and through a pipe
+setup stdin
+"$SPINGO" -d db.fa -i - -k 8 -a -p 2 < queries.fa > out 2>/dev/null
+check "stdin" out "$TESTDIR/expected.out"
+cat queries.fa | "$SPINGO" -d db.fa -i /dev/stdin -k 8 -a -p 2 > out 2>/dev/null
+check "a pipe" out "$TESTDIR/expected.out"
+
+# a run stopped by a file size limit, carried on from its checkpoint. A
+# resume without a checkpoint starts at the beginning, and one of another
+# run is refused
+setup checkpoint
+( ulimit -f 8; "$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --checkpoint run.ckpt --checkpoint-interval 0.001 > out ) 2>/dev/null
+expect "--checkpoint, stopped part way" test "$(wc -l < out)" -lt 200
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --checkpoint run.ckpt --resume >> out 2>/dev/null
+check "--resume" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --checkpoint none.ckpt --resume > out 2>/dev/null
+check "--resume, no checkpoint" out "$TESTDIR/expected.out"
+expect "--resume, another run" refused "$SPINGO" -d db.fa -i queries.fa -k 5 -p 2 --checkpoint run.ckpt --resume
+
+# indexes built on disk, from one sorted run and from several, give the
+# results of one built in memory, and report the memory the runs took
+setup external
+"$SPINDEX" -d db.fa -k 8 --external > /dev/null 2> report
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 > out 2>/dev/null
+check "spindex --external" out "$TESTDIR/expected.out"
+expect "spindex --external, memory report" refused grep -q "Memory: index 0B" report
+# runs are split between the threads, so many threads give runs small enough to split these references
+"$SPINDEX" -d db.fa -k 8 -p 32 --external --max-memory 1M 2>&1 | grep -q "in 2 sorted runs"
+expect "spindex --external, several runs" test $? = 0
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 > out 2>/dev/null
+check "spindex --external, merged runs" out "$TESTDIR/expected.out"
+
+# a kmer size whose kmers mostly do not occur, held in the sparse layout,
+# from the fasta database and from indexes built in memory and on disk
+setup sparse
+"$SPINGO" -d db.fa -i queries.fa -k 12 -a -p 2 > out 2> report
+check "kmer size 12" out "$TESTDIR/expected_k12.out"
+expect "kmer size 12, sparse" grep -q "Using sparse index" report
+"$SPINDEX" -d db.fa -k 12 > /dev/null 2>&1
+"$SPINGO" -d db.fa -i queries.fa -k 12 -a -p 2 > out 2>/dev/null
+check "spindex, kmer size 12" out "$TESTDIR/expected_k12.out"
+"$SPINDEX" -d db.fa -k 12 --external > /dev/null 2>&1
+"$SPINGO" -d db.fa -i queries.fa -k 12 -a -p 2 > out 2>/dev/null
+check "spindex --external, kmer size 12" out "$TESTDIR/expected_k12.out"
+
+# results kept between runs are the results classifying would give. Seeded
+# from their bases, reads are found again in another order
+setup cache
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --cache results.cache > out 2>/dev/null
+check "--cache, filled" out "$TESTDIR/expected.out"
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --cache results.cache > out 2> report
+check "--cache, read back" out "$TESTDIR/expected.out"
+expect "--cache, every read found" grep -q "200 hits, 0 misses" report
+awk '/^>/ { if (s) print s; print; s = ""; next } { s = s $0 } END { print s }' queries.fa | paste - - | tac | tr '\t' '\n' > reversed.fa
+"$SPINGO" -d db.fa -i queries.fa -k 8 -a -p 2 --seed-by-sequence --cache seeded.cache > seeded.out 2>/dev/null
+"$SPINGO" -d db.fa -i reversed.fa -k 8 -a -p 2 --seed-by-sequence --cache seeded.cache > out 2> report
+expect "--seed-by-sequence, every read found" grep -q "200 hits, 0 misses" report
+tac seeded.out > expected.out
+check "--seed-by-sequence, reordered" out expected.out
+"$SPINGO" -d db.fa -i reversed.fa -k 8 -a -p 2 --seed-by-sequence > out 2>/dev/null
+check "--seed-by-sequence, without the cache" out expected.out
+
+if [ $failed = 0 ]; then
+    echo "All checks passed"
+fi
+exit $failed